@@ -7,9 +7,6 @@
 #include "cvs.h"
 #include "hash.h"
 #include <stdint.h>
-#ifdef THREADS
-#include <pthread.h>
-#endif /* THREADS */
 /*****************************************************************************
 
 From http://planetmath.org/goodhashtableprimes:
@@ -73,75 +70,184 @@ Happy hashing!
  * repository, which at around 135K masters is the largest we know of.
  * The intent is to reduce expected depth of the hash buckets in the
  * worst case to about 4.  Space cost on a 64-bit machine is 8 times
- * this in bytes.
+ * this in bytes.  It is only the starting size; the tables grow through
+ * the primes above when chains get deeper than MAX_LOAD.
  */
 #define HASH_SIZE	49157
+#define NUMBER_HASH_SIZE 6151
+#define MAX_LOAD	4
+
+static const size_t primes[] = {
+    6151, 12289, 24593, 49157, 98317, 196613, 393241, 786433, 1572869,
+    3145739, 6291469, 12582917, 25165843, 50331653, 100663319, 201326611,
+    402653189, 805306457, 1610612741,
+};
 
 unsigned int natoms;	/* we report this so we can tune the hash properly */
 
+/*
+ * Both tables are insert-only, so they can be searched without locks.
+ * A new entry is appended by compare-and-swap on the NULL link at the
+ * end of its chain; a thread that loses the race simply carries on
+ * walking from the entry that won.  Growth relinks every chain, which
+ * cannot be done under concurrent readers, so it only happens while
+ * the program is single-threaded: on the fly when running sequentially,
+ * otherwise when atom_reserve() is called before the workers start.
+ */
+typedef struct _bucket {
+    struct _bucket	*next;
+    hash_t		hash;
+} bucket_t;
+
+typedef struct _atom_table {
+    bucket_t		**heads;
+    size_t		size;
+    size_t		count;
+} atom_table_t;
+
 typedef struct _hash_bucket {
     struct _hash_bucket	*next;
     hash_t		hash;
     char		string[0];
 } hash_bucket_t;
 
-static hash_bucket_t	*buckets[HASH_SIZE];
-#ifdef THREADS
-static pthread_mutex_t bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif /* THREADS */
+typedef struct _number_bucket {
+    struct _number_bucket *next;
+    hash_t		hash;
+    cvs_number number;
+} number_bucket_t;
 
-const char *
-atom(const char *string)
-/* intern a string, avoiding having separate storage for duplicate copies */
+static atom_table_t	string_table, number_table;
+
+static void
+table_resize(atom_table_t *table, size_t size)
+/* relink a table into size buckets; caller guarantees no concurrent access */
 {
-    hash_t		hash = hash_string(string);
-    hash_bucket_t	**head = &buckets[hash % HASH_SIZE];
-    hash_bucket_t	*b;
-    int			len;
+    bucket_t	**heads = xcalloc(size, sizeof(bucket_t *), __func__);
+    bucket_t	*b, *next;
+    size_t	i;
 
-    while ((b = *head)) {
-collision:
-	if (b->hash == hash && !strcmp(string, b->string))
-	    return b->string;
-	head = &(b->next);
-    }
+    for (i = 0; i < table->size; i++)
+	for (b = table->heads[i]; b; b = next) {
+	    next = b->next;
+	    b->next = heads[b->hash % size];
+	    heads[b->hash % size] = b;
+	}
+    free(table->heads);
+    table->heads = heads;
+    table->size = size;
+}
+
+static void
+table_reserve(atom_table_t *table, size_t minimum, size_t expected)
+/* make a table big enough for an expected entry count */
+{
+    size_t size = minimum, i;
+
+    for (i = 0; i < sizeof(primes) / sizeof(primes[0]); i++)
+	if (primes[i] >= minimum) {
+	    size = primes[i];
+	    if (size * MAX_LOAD >= expected)
+		break;
+	}
+    if (size > table->size)
+	table_resize(table, size);
+}
+
+static bucket_t **
+table_head(atom_table_t *table, const hash_t hash, const size_t minimum)
+/* find the chain for a hash, first growing the table if it is safe to */
+{
+    if (table->count >= table->size * MAX_LOAD
 #ifdef THREADS
-    if (threads > 1)
-	pthread_mutex_lock(&bucket_mutex);
+	&& threads <= 1
 #endif /* THREADS */
-    if ((b = *head)) {
+	)
+	table_reserve(table, minimum, table->count + 1);
+    return &table->heads[hash % table->size];
+}
+
+static bucket_t *
+table_link(atom_table_t *table, bucket_t **head, bucket_t *b)
+/* append b at the NULL link head, or return whatever got there first */
+{
 #ifdef THREADS
-	if (threads > 1)
-	    pthread_mutex_unlock(&bucket_mutex);
-#endif /* THREADS */
-	goto collision;
-    }
+    if (threads > 1) {
+	bucket_t *expected = NULL;
 
-    len = strlen(string);
-    b = xmalloc(sizeof(hash_bucket_t) + len + 1, __func__);
-    b->next = 0;
-    b->hash = hash;
-    memcpy(b->string, string, len + 1);
+	if (!__atomic_compare_exchange_n(head, &expected, b, false,
+					 __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	    return expected;
+	__atomic_add_fetch(&table->count, 1, __ATOMIC_RELAXED);
+	return NULL;
+    }
+#endif /* THREADS */
     *head = b;
-    natoms++;
+    table->count++;
+    return NULL;
+}
+
+static inline bucket_t *
+table_next(bucket_t **link)
+/* read a chain link, pairing with the release in table_link() */
+{
 #ifdef THREADS
-    if (threads > 1)
-	pthread_mutex_unlock(&bucket_mutex);
+    return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+#else
+    return *link;
 #endif /* THREADS */
-    return b->string;
 }
 
-typedef struct _number_bucket {
-    struct _number_bucket *next;
-    cvs_number number;
-} number_bucket_t;
+void
+atom_reserve(size_t strings, size_t numbers)
+/* presize the tables; must not be called while other threads are interning */
+{
+    if (string_table.heads == NULL)
+	table_reserve(&string_table, HASH_SIZE, 0);
+    if (number_table.heads == NULL)
+	table_reserve(&number_table, NUMBER_HASH_SIZE, 0);
+    table_reserve(&string_table, HASH_SIZE, strings);
+    table_reserve(&number_table, NUMBER_HASH_SIZE, numbers);
+}
 
-#define NUMBER_HASH_SIZE 6151
+const char *
+atom(const char *string)
+/* intern a string, avoiding having separate storage for duplicate copies */
+{
+    hash_t		hash = hash_string(string);
+    bucket_t		**head;
+    hash_bucket_t	*b, *fresh = NULL;
+    int			len;
 
-static number_bucket_t  *number_buckets[NUMBER_HASH_SIZE];
+    if (string_table.heads == NULL)
+	atom_reserve(0, 0);
+    head = table_head(&string_table, hash, HASH_SIZE);
+    for (;;) {
+	while ((b = (hash_bucket_t *)table_next(head))) {
+	    if (b->hash == hash && !strcmp(string, b->string)) {
+		free(fresh);	/* lost a race to intern the same string */
+		return b->string;
+	    }
+	    head = (bucket_t **)&(b->next);
+	}
+	if (fresh == NULL) {
+	    len = strlen(string);
+	    fresh = xmalloc(sizeof(hash_bucket_t) + len + 1, __func__);
+	    fresh->next = NULL;
+	    fresh->hash = hash;
+	    memcpy(fresh->string, string, len + 1);
+	}
+	if (table_link(&string_table, head, (bucket_t *)fresh) == NULL)
+	    break;
+    }
 #ifdef THREADS
-static pthread_mutex_t number_bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+    if (threads > 1)
+	__atomic_add_fetch(&natoms, 1, __ATOMIC_RELAXED);
+    else
 #endif /* THREADS */
+	natoms++;
+    return fresh->string;
+}
 
 /*
  * Intern a revision number
@@ -150,64 +256,70 @@ static pthread_mutex_t number_bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
 const cvs_number *
 atom_cvs_number(const cvs_number n)
 {
-    size_t          bucket = hash_cvs_number(&n) % NUMBER_HASH_SIZE;
-    number_bucket_t **head = &number_buckets[bucket];
-    number_bucket_t *b;
-
-    while ((b = *head)) {
-    collision:
-	if (cvs_number_equal(&b->number, &n))
-	    return &b->number;
-	head = &(b->next);
-    }
-#ifdef THREADS
-    if (threads > 1)
-	pthread_mutex_lock(&number_bucket_mutex);
-#endif /* THREADS */
-    if ((b = *head)) {
-#ifdef THREADS
-	if (threads > 1)
-	    pthread_mutex_unlock(&number_bucket_mutex);
-#endif /* THREADS */
-	goto collision;
+    hash_t          hash = hash_cvs_number(&n);
+    bucket_t        **head;
+    number_bucket_t *b, *fresh = NULL;
+
+    if (number_table.heads == NULL)
+	atom_reserve(0, 0);
+    head = table_head(&number_table, hash, NUMBER_HASH_SIZE);
+    for (;;) {
+	while ((b = (number_bucket_t *)table_next(head))) {
+	    if (b->hash == hash && cvs_number_equal(&b->number, &n)) {
+		free(fresh);
+		return &b->number;
+	    }
+	    head = (bucket_t **)&(b->next);
+	}
+	if (fresh == NULL) {
+	    fresh = xmalloc(sizeof(number_bucket_t), __func__);
+	    fresh->next = NULL;
+	    fresh->hash = hash;
+	    memcpy(&fresh->number, &n, sizeof(cvs_number));
+	}
+	if (table_link(&number_table, head, (bucket_t *)fresh) == NULL)
+	    break;
     }
+    return &fresh->number;
+}
 
-    b = xmalloc(sizeof(number_bucket_t), __func__);
-    b->next = NULL;
-    memcpy(&b->number, &n, sizeof(cvs_number));
-    *head = b;
-#ifdef THREADS
-    if (threads > 1)
-	pthread_mutex_unlock(&number_bucket_mutex);
-#endif /* THREADS */
-    return &b->number;
+static size_t
+table_collisions(const atom_table_t *table)
+/* count entries that share a chain with an earlier one */
+{
+    size_t	i, used = 0;
+
+    for (i = 0; i < table->size; i++)
+	if (table->heads[i] != NULL)
+	    used++;
+    return table->count - used;
 }
+
+void
+atom_stats(size_t *strings, size_t *numbers, size_t *collisions)
+/* report table populations and hash collisions */
+{
+    *strings = string_table.count;
+    *numbers = number_table.count;
+    *collisions = table_collisions(&string_table)
+		  + table_collisions(&number_table);
+}
+
 void
 discard_atoms(void)
 /* empty all string buckets */
 {
-    hash_bucket_t	**head, *b;
-    int			i;
+    bucket_t		**head, *b;
+    size_t		i;
 
-#ifdef THREADS
-    if (threads > 1)
-	pthread_mutex_lock(&bucket_mutex);
-#endif /* THREADS */
-    for (i = 0; i < HASH_SIZE; i++)
-	for (head = &buckets[i]; (b = *head);) {
+    for (i = 0; i < string_table.size; i++)
+	for (head = &string_table.heads[i]; (b = *head);) {
 	    *head = b->next;
 	    free(b);
 	}
-#ifdef THREADS
-    if (threads > 1) {
-	pthread_mutex_unlock(&bucket_mutex);
-	/*
-	 * This is irreversible, and will have to be factored out if
-	 * dicard_atoms() is ever called anywhere but in final cleanup.
-	 */
-	pthread_mutex_destroy(&bucket_mutex);
-    }
-#endif /* THREADS */
+    free(string_table.heads);
+    string_table.heads = NULL;
+    string_table.size = string_table.count = 0;
 }
 
 /* end */
@@ -5,6 +5,9 @@
  */
 #include "cvs.h"
 #include "revdir.h"
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
 /*
  * These functions analyze a CVS revlist into a changeset DAG.
  *
@@ -15,6 +18,10 @@
  * Pack the dead flag into the commit pointer so we can avoid dereferencing
  * in the inner loop. Also keep the dir near the packed pointer
  * as it is used in the inner loop.
+ *
+ * The tailed flag, marking a revision that has reached its parent
+ * branch, lives here too rather than in the cvs_commit, because
+ * sibling branches collated at the same time may share that commit.
  */
 typedef struct _revision {
     /* packed commit pointer and dead flag */
@@ -32,7 +39,9 @@ typedef struct _revision {
 	(rev).dir = (commit)->master->dir;	\
     } while (0)
 #define REVISION_T_DEAD(rev) (((rev).packed) & 1)
-#define COMMIT_MASK (~(uintptr_t)0 ^ 1)
+#define REVISION_T_TAILED(rev) (((rev).packed) & 2)
+#define REVISION_T_SET_TAILED(rev) ((rev).packed |= 2)
+#define COMMIT_MASK (~(uintptr_t)0 ^ 3)
 #define REVISION_T_COMMIT(rev) (cvs_commit *)(((rev).packed) & (COMMIT_MASK))
 
 /*
@@ -40,8 +49,11 @@ typedef struct _revision {
  * is in scope
  */
 #define DEAD(index) (REVISION_T_DEAD(revisions[(index)]))
+#define TAILED(index) (REVISION_T_TAILED(revisions[(index)]))
 #define REVISIONS(index) (REVISION_T_COMMIT(revisions[(index)]))
 #define DIR(index) (revisions[(index)].dir)
+/* a queued revision that still has older history to collate */
+#define LIVE(index) (REVISIONS(index)->parent || !REVISIONS(index)->dead)
 
 static rev_ref *
 rev_find_head(head_list *rl, const char *name)
@@ -127,8 +139,9 @@ rev_ref_tsort(rev_ref *git_branches, cvs_master *masters, size_t nmasters)
 static int
 cvs_commit_date_compare(const void *av, const void *bv)
 {
-    const cvs_commit	*a = REVISION_T_COMMIT(*(revision_t *) av);
-    const cvs_commit	*b = REVISION_T_COMMIT(*(revision_t *) bv);
+    const revision_t	*ra = av, *rb = bv;
+    const cvs_commit	*a = REVISION_T_COMMIT(*ra);
+    const cvs_commit	*b = REVISION_T_COMMIT(*rb);
     int			t;
 
     /*
@@ -143,8 +156,8 @@ cvs_commit_date_compare(const void *av, const void *bv)
     /*
      * tailed entries sort next
      */
-    if (a->tailed != b->tailed)
-	return(int)a->tailed - (int)b->tailed;
+    if (!REVISION_T_TAILED(*ra) != !REVISION_T_TAILED(*rb))
+	return REVISION_T_TAILED(*ra) ? 1 : -1;
     /*
      * Newest entries sort first
      */
@@ -241,6 +254,249 @@ cvs_commit_match(const cvs_commit *a, const cvs_commit *b)
     return true;
 }
 
+/*
+ * Clique selection for collate_branches().
+ *
+ * Each changeset is led by the newest untailed revision and takes in
+ * every other revision that matches it.  Rather than rescan the whole
+ * revision set for each changeset, the untailed revisions are kept in
+ * a max-heap on date, with ties going to the lower index as a scan in
+ * index order would give them.  Matches without a commitid have to be
+ * within the time window of the leader, which is the newest, so they
+ * are found by a walk of the heap that stops at any node too old.
+ * Commitid matches can be any age, so when commitids are trusted the
+ * revisions are also bucketed by commitid.  A changeset then costs
+ * about its own size times log n, not the size of the whole set.
+ */
+typedef struct _commitid_bucket {
+    const char	*commitid;
+    int		head;		/* first revision holding it, -1 if none */
+} commitid_bucket_t;
+
+typedef struct _clique_queue {
+    revision_t		*revisions;
+    int			*heap, *pos;	/* heap of indices; where each sits */
+    int			nheap;
+    int			*next, *prev;	/* commitid bucket chains */
+    commitid_bucket_t	*buckets;
+    size_t		nbuckets, nids;
+    int			*stack;		/* scratch for the heap walk */
+} clique_queue_t;
+
+static bool
+queue_before(const clique_queue_t *q, const int a, const int b)
+/* should revision a come off the queue ahead of revision b? */
+{
+    cvstime_t da = (REVISION_T_COMMIT(q->revisions[a]))->date;
+    cvstime_t db = (REVISION_T_COMMIT(q->revisions[b]))->date;
+
+    return da > db || (da == db && a < b);
+}
+
+static void
+queue_place(clique_queue_t *q, int at, const int n)
+/* put revision n at heap slot at */
+{
+    q->heap[at] = n;
+    q->pos[n] = at;
+}
+
+static void
+queue_down(clique_queue_t *q, int at)
+/* move the revision at slot at down below any that should precede it */
+{
+    int n = q->heap[at];
+
+    for (;;) {
+	int child = 2 * at + 1;
+	if (child >= q->nheap)
+	    break;
+	if (child + 1 < q->nheap && queue_before(q, q->heap[child + 1], q->heap[child]))
+	    child++;
+	if (!queue_before(q, q->heap[child], n))
+	    break;
+	queue_place(q, at, q->heap[child]);
+	at = child;
+    }
+    queue_place(q, at, n);
+}
+
+static void
+queue_sift(clique_queue_t *q, int at)
+/* restore heap order after the revision at slot at changed */
+{
+    int n = q->heap[at];
+
+    while (at > 0 && queue_before(q, n, q->heap[(at - 1) / 2])) {
+	queue_place(q, at, q->heap[(at - 1) / 2]);
+	at = (at - 1) / 2;
+    }
+    queue_place(q, at, n);
+    queue_down(q, at);
+}
+
+static commitid_bucket_t *
+queue_bucket(clique_queue_t *q, const char *commitid)
+/* find or make the bucket for a commitid */
+{
+    uint64_t x = (uintptr_t)commitid;
+    size_t i;
+
+    if (q->nids * 2 >= q->nbuckets) {
+	commitid_bucket_t *old = q->buckets;
+	size_t oldsize = q->nbuckets;
+
+	q->nbuckets = q->nbuckets ? q->nbuckets * 2 : 1024;
+	q->buckets = xcalloc(q->nbuckets, sizeof(commitid_bucket_t), "commitid buckets");
+	q->nids = 0;
+	for (i = 0; i < oldsize; i++)
+	    if (old[i].commitid != NULL)
+		*queue_bucket(q, old[i].commitid) = old[i];
+	free(old);
+    }
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    for (i = x & (q->nbuckets - 1);;
+	 i = (i + 1) & (q->nbuckets - 1)) {
+	if (q->buckets[i].commitid == commitid)
+	    return &q->buckets[i];
+	if (q->buckets[i].commitid == NULL) {
+	    q->buckets[i].commitid = commitid;
+	    q->buckets[i].head = -1;
+	    q->nids++;
+	    return &q->buckets[i];
+	}
+    }
+}
+
+static void
+queue_link(clique_queue_t *q, const int n)
+/* enter revision n under its commitid */
+{
+    const char *commitid = (REVISION_T_COMMIT(q->revisions[n]))->commitid;
+    commitid_bucket_t *b;
+
+    if (!trust_commitids || !commitid)
+	return;
+    b = queue_bucket(q, commitid);
+    q->prev[n] = -1;
+    q->next[n] = b->head;
+    if (b->head >= 0)
+	q->prev[b->head] = n;
+    b->head = n;
+}
+
+static void
+queue_unlink(clique_queue_t *q, const int n)
+/* take revision n out of its commitid bucket */
+{
+    const char *commitid = (REVISION_T_COMMIT(q->revisions[n]))->commitid;
+
+    if (!trust_commitids || !commitid)
+	return;
+    if (q->prev[n] >= 0)
+	q->next[q->prev[n]] = q->next[n];
+    else
+	queue_bucket(q, commitid)->head = q->next[n];
+    if (q->next[n] >= 0)
+	q->prev[q->next[n]] = q->prev[n];
+}
+
+static void
+queue_init(clique_queue_t *q, revision_t *revisions, const int nrevisions)
+/* queue the untailed revisions of a branch set */
+{
+    int n;
+
+    memset(q, '\0', sizeof(clique_queue_t));
+    q->revisions = revisions;
+    q->heap = xmalloc(nrevisions * sizeof(int), "clique queue");
+    q->pos = xmalloc(nrevisions * sizeof(int), "clique queue");
+    q->stack = xmalloc(nrevisions * sizeof(int), "clique queue");
+    if (trust_commitids) {
+	q->next = xmalloc(nrevisions * sizeof(int), "clique queue");
+	q->prev = xmalloc(nrevisions * sizeof(int), "clique queue");
+    }
+    for (n = 0; n < nrevisions; n++) {
+	q->pos[n] = -1;
+	if (!REVISIONS(n) || TAILED(n))
+	    continue;
+	q->heap[q->nheap++] = n;
+	queue_link(q, n);
+    }
+    for (n = q->nheap / 2 - 1; n >= 0; n--)
+	queue_down(q, n);
+    for (n = 0; n < q->nheap; n++)
+	q->pos[q->heap[n]] = n;
+}
+
+static void
+queue_update(clique_queue_t *q, const int n)
+/* revision n has moved on to an older commit, or left the queue */
+{
+    const revision_t *revisions = q->revisions;
+    int at = q->pos[n];
+
+    if (REVISIONS(n) && !TAILED(n)) {
+	queue_sift(q, at);
+	queue_link(q, n);
+	return;
+    }
+    q->pos[n] = -1;
+    if (at != --q->nheap) {
+	queue_place(q, at, q->heap[q->nheap]);
+	queue_sift(q, at);
+    }
+}
+
+static int
+queue_clique(clique_queue_t *q, int *members)
+/* find the revisions making up the next changeset, leader last */
+{
+    const revision_t *revisions = q->revisions;
+    const cvs_commit *leader = REVISIONS(q->heap[0]);
+    int count = 0, depth = 0;
+
+    if (trust_commitids && leader->commitid) {
+	int n;
+
+	for (n = queue_bucket(q, leader->commitid)->head; n >= 0; n = q->next[n])
+	    if (n != q->heap[0])
+		members[count++] = n;
+    } else {
+	/* anything time-close to the newest is near the top of the heap */
+	q->stack[depth++] = 0;
+	while (depth > 0) {
+	    int at = q->stack[--depth], child;
+	    const cvs_commit *c = REVISIONS(q->heap[at]);
+
+	    if (!cvs_commit_time_close(c->date, leader->date))
+		continue;
+	    if (at > 0 && cvs_commit_match(c, leader))
+		members[count++] = q->heap[at];
+	    for (child = 2 * at + 1; child <= 2 * at + 2 && child < q->nheap; child++)
+		q->stack[depth++] = child;
+	}
+    }
+    members[count++] = q->heap[0];
+    /* unlink before any member moves on, so the buckets stay consistent */
+    for (depth = 0; depth < count; depth++)
+	queue_unlink(q, members[depth]);
+    return count;
+}
+
+static void
+queue_free(clique_queue_t *q)
+{
+    free(q->heap);
+    free(q->pos);
+    free(q->stack);
+    free(q->next);
+    free(q->prev);
+    free(q->buckets);
+}
+
 /*
  * These statics are part of an optimization to reduce allocation calls
  * by only doing one when more memory needs to be grabbed than the
@@ -260,12 +516,92 @@ git_commit_cleanup(void)
     }
 }
 
+/*
+ * Fingerprints of gitspace commits, for tag placement.
+ *
+ * A fingerprint is a sum of mixed per-revision keys, so it doesn't
+ * depend on the order revisions are packed in and can be computed
+ * from the tag side without building a revdir.  Revisions 1.1 and
+ * 1.1.1.1 of a master key alike, because git_commit_contains_revs()
+ * treats them as interchangeable.  Every commit built is entered in a
+ * hash table by fingerprint, so rev_tag_search() can tell with one
+ * lookup whether any commit can hold a tag's revision set at all.
+ */
+static const cvs_number *initial_rev, *initial_vendor_rev;
+
+static void
+initial_revs_init(void)
+/* atomize the revision numbers that may stand in for each other */
+{
+    initial_rev = atom_cvs_number(lex_number("1.1"));
+    initial_vendor_rev = atom_cvs_number(lex_number("1.1.1.1"));
+}
+
+static inline hash_t
+fingerprint_revision(const cvs_commit *c)
+/* mix the key of one revision for summing into a fingerprint */
+{
+    uint64_t x;
+
+    if (c->number == initial_rev || c->number == initial_vendor_rev)
+	x = (uintptr_t)c->master | 1;	/* can't equal a commit pointer */
+    else
+	x = (uintptr_t)c;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (hash_t)x;
+}
+
+static git_commit	**fingerprint_table;
+static size_t		fingerprint_size, fingerprint_count;
+
+static void
+fingerprint_enter(git_commit *commit)
+/* add a commit to the fingerprint index, growing it as needed */
+{
+    git_commit **bucket;
+
+    if (fingerprint_count >= fingerprint_size) {
+	size_t	oldsize = fingerprint_size, i;
+	git_commit **old = fingerprint_table;
+
+	fingerprint_size = oldsize ? oldsize * 2 : 1024;
+	fingerprint_table = xcalloc(fingerprint_size, sizeof(git_commit *),
+				    __func__);
+	for (i = 0; i < oldsize; i++) {
+	    git_commit *g, *next;
+	    for (g = old[i]; g; g = next) {
+		next = g->same_fingerprint;
+		bucket = &fingerprint_table[g->fingerprint & (fingerprint_size - 1)];
+		g->same_fingerprint = *bucket;
+		*bucket = g;
+	    }
+	}
+	free(old);
+    }
+    bucket = &fingerprint_table[commit->fingerprint & (fingerprint_size - 1)];
+    commit->same_fingerprint = *bucket;
+    *bucket = commit;
+    fingerprint_count++;
+}
+
+static void
+fingerprint_free(void)
+/* drop the fingerprint index */
+{
+    free(fingerprint_table);
+    fingerprint_table = NULL;
+    fingerprint_size = fingerprint_count = 0;
+}
+
 static git_commit *
 git_commit_build(revision_t *revisions, const cvs_commit *leader, const int nrevisions)
 /* build a changeset commit from a clique of CVS revisions */
 {
     size_t     n;
     git_commit *commit;
+    struct timespec lap;
 
     commit = xmalloc(sizeof(git_commit), "creating commit");
 
@@ -278,13 +614,18 @@ git_commit_build(revision_t *revisions, const cvs_commit *leader, const int nrev
     commit->dead = false;
     commit->refcount = commit->serial = 0;
 
+    commit->fingerprint = 0;
+
+    stats_clock(&lap);
     revdir_pack_init();
     for (n = 0; n < nrevisions; n++) {
 	if (REVISIONS(n) && !(DEAD(n))) {
 	    revdir_pack_add(REVISIONS(n), DIR(n));
+	    commit->fingerprint += fingerprint_revision(REVISIONS(n));
 	}
     }
     revdir_pack_end(&commit->revdir);
+    stats_lap(PHASE_REVDIR, &lap);
 
 #ifdef ORDERDEBUG
     debugmsg("commit_build: %p\n", commit);
@@ -305,42 +646,285 @@ git_commit_build(revision_t *revisions, const cvs_commit *leader, const int nrev
     return commit;
 }
 
-static git_commit *
-git_commit_locate_date(const rev_ref *branch, const cvstime_t date)
-/* on branch, locate a commit within fuzz-time distance of date */
+/*
+ * Index of collated gitspace branches, for finding branch points.
+ *
+ * Finding where a branch joins its parent used to mean walking the
+ * parent's whole parent chain, which runs on through the grandparents
+ * down to the root, calling cvs_commit_match() on every commit.  With
+ * thousands of branches and long histories that is quadratic.  Instead,
+ * as each branch finishes collation we record its own commits (newest
+ * first, the order the chain walk meets them) in a commit_chain_t, plus
+ * where its chain continues in an earlier branch.  A search then visits
+ * at most one chain per branch level, and within each it finds the
+ * first match by binary search over commits sorted by commitid or by
+ * log and author, which between them decide cvs_commit_match(), and
+ * the first date hit by binary search over a running minimum of dates.
+ * Results are the same commits the chain walk would return.
+ *
+ * Every branch has its slot in the map before collation starts, so
+ * branches collated in parallel only ever write their own slot.
+ */
+typedef struct _chain_key {
+    uintptr_t	a, b;		/* commitid and 0, or log and author */
+    size_t	pos;		/* index into the chain's commits */
+} chain_key_t;
+
+typedef struct _commit_chain {
+    git_commit		**commits;	/* the branch's own, newest first */
+    cvstime_t		*lowest;	/* running minimum of their dates */
+    chain_key_t		*byid, *bymeta;
+    size_t		ncommits, nbyid, nbymeta;
+    struct _commit_chain *next;		/* where the chain walk goes on */
+    size_t		next_pos;
+} commit_chain_t;
+
+typedef struct _chain_location {
+    commit_chain_t	*chain;
+    size_t		pos;
+} chain_location_t;
+
+/* open-addressed map from gitspace branch to its chain */
+static struct {
+    const rev_ref	*branch;
+    commit_chain_t	*chain;
+} *chain_map;
+static size_t chain_map_size;
+
+static size_t chain_slot(const rev_ref *branch);
+
+static void
+chain_index_init(const git_repo *gl, const size_t nbranches)
+/* make room to index the nbranches gitspace branches of gl */
 {
-    git_commit	*commit;
+    const rev_ref *h;
+
+    chain_map_size = 16;
+    while (chain_map_size < nbranches * 2)
+	chain_map_size *= 2;
+    chain_map = xcalloc(chain_map_size, sizeof(*chain_map), __func__);
+    for (h = gl->heads; h; h = h->next)
+	chain_map[chain_slot(h)].branch = h;
+}
+
+static size_t
+chain_slot(const rev_ref *branch)
+/* find the map slot for a branch, or the empty one where it would go */
+{
+    size_t i = ((uintptr_t)branch >> 4) & (chain_map_size - 1);
+
+    while (chain_map[i].branch && chain_map[i].branch != branch)
+	i = (i + 1) & (chain_map_size - 1);
+    return i;
+}
+
+static commit_chain_t *
+chain_of(const rev_ref *branch)
+/* the chain of a collated branch, or NULL */
+{
+    if (!branch || !chain_map)
+	return NULL;
+    return chain_map[chain_slot(branch)].chain;
+}
+
+static int
+chain_key_compare(const void *av, const void *bv)
+{
+    const chain_key_t *a = av, *b = bv;
+
+    if (a->a != b->a)
+	return a->a < b->a ? -1 : 1;
+    if (a->b != b->b)
+	return a->b < b->b ? -1 : 1;
+    if (a->pos != b->pos)
+	return a->pos < b->pos ? -1 : 1;
+    return 0;
+}
+
+static void
+chain_build(const rev_ref *branch, const chain_location_t *join)
+/* index a branch that has just been collated */
+{
+    commit_chain_t	*chain = xcalloc(1, sizeof(commit_chain_t), __func__);
+    git_commit		*stop = NULL, *commit;
+    size_t		n, alloc = 0;
 
+    if (join && join->chain)
+	stop = join->chain->commits[join->pos];
     /* PUNNING: see the big comment in cvs.h */
-    for (commit = (git_commit *)branch->commit; commit; commit = commit->parent)
-    {
-	if (time_compare(commit->date, date) <= 0)
-	    return commit;
+    for (commit = (git_commit *)branch->commit;
+	 commit && commit != stop;
+	 commit = commit->parent) {
+	if (chain->ncommits >= alloc) {
+	    alloc = alloc ? alloc * 2 : 16;
+	    chain->commits = xrealloc(chain->commits,
+				      alloc * sizeof(git_commit *), __func__);
+	}
+	chain->commits[chain->ncommits++] = commit;
+    }
+    if (commit && commit == stop) {
+	chain->next = join->chain;
+	chain->next_pos = join->pos;
+    }
+
+    chain->lowest = xmalloc(chain->ncommits * sizeof(cvstime_t), __func__);
+    chain->byid = xmalloc(chain->ncommits * sizeof(chain_key_t), __func__);
+    chain->bymeta = xmalloc(chain->ncommits * sizeof(chain_key_t), __func__);
+    for (n = 0; n < chain->ncommits; n++) {
+	commit = chain->commits[n];
+	chain->lowest[n] = commit->date;
+	if (n > 0 && time_compare(chain->lowest[n - 1], commit->date) < 0)
+	    chain->lowest[n] = chain->lowest[n - 1];
+	/*
+	 * When commitids are trusted, a commit with one can only match
+	 * by it, and one without only by the metadata comparison.
+	 */
+	if (trust_commitids && commit->commitid) {
+	    chain_key_t *k = &chain->byid[chain->nbyid++];
+	    k->a = (uintptr_t)commit->commitid;
+	    k->b = 0;
+	    k->pos = n;
+	} else {
+	    chain_key_t *k = &chain->bymeta[chain->nbymeta++];
+	    k->a = (uintptr_t)commit->log;
+	    k->b = (uintptr_t)commit->author;
+	    k->pos = n;
+	}
+    }
+    qsort(chain->byid, chain->nbyid, sizeof(chain_key_t), chain_key_compare);
+    qsort(chain->bymeta, chain->nbymeta, sizeof(chain_key_t), chain_key_compare);
+
+    chain_map[chain_slot(branch)].chain = chain;
+}
+
+static void
+chain_index_free(void)
+/* release the branch index once collation is done */
+{
+    size_t i, n;
+
+    for (i = 0; i < chain_map_size; i++) {
+	commit_chain_t *chain = chain_map[i].chain;
+	if (chain) {
+	    /* every commit collation built is on exactly one chain */
+	    for (n = 0; n < chain->ncommits; n++)
+		fingerprint_enter(chain->commits[n]);
+	    free(chain->commits);
+	    free(chain->lowest);
+	    free(chain->byid);
+	    free(chain->bymeta);
+	    free(chain);
+	}
+    }
+    free(chain_map);
+    chain_map = NULL;
+    chain_map_size = 0;
+}
+
+static const chain_key_t *
+chain_key_search(const chain_key_t *keys, const size_t nkeys,
+		 const uintptr_t a, const uintptr_t b, const size_t pos)
+/* first key not less than (a, b, pos), or NULL if not the same a and b */
+{
+    size_t lo = 0, hi = nkeys;
+    chain_key_t probe;
+
+    probe.a = a;
+    probe.b = b;
+    probe.pos = pos;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (chain_key_compare(&keys[mid], &probe) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
+    if (lo < nkeys && keys[lo].a == a && keys[lo].b == b)
+	return &keys[lo];
     return NULL;
 }
 
 static git_commit *
-git_commit_locate_one(const rev_ref *branch, const cvs_commit *part)
-/* seek a gitspace commit on branch incorporating cvs_commit */
+chain_locate(const commit_chain_t *chain, size_t pos,
+	     const cvs_commit *part, chain_location_t *found)
+/* first commit from chain position pos on matching part, as the walk would */
 {
-    git_commit	*commit;
+    for (; chain; pos = chain->next_pos, chain = chain->next) {
+	const chain_key_t *k;
+
+	if (trust_commitids && part->commitid) {
+	    k = chain_key_search(chain->byid, chain->nbyid,
+				 (uintptr_t)part->commitid, 0, pos);
+	    if (k)
+		goto hit;
+	    continue;
+	}
+	k = chain_key_search(chain->bymeta, chain->nbymeta,
+			     (uintptr_t)part->log, (uintptr_t)part->author, pos);
+	for (; k && k < chain->bymeta + chain->nbymeta
+		 && k->a == (uintptr_t)part->log
+		 && k->b == (uintptr_t)part->author; k++)
+	    if (cvs_commit_time_close(chain->commits[k->pos]->date, part->date))
+		goto hit;
+	continue;
+    hit:
+	if (found) {
+	    found->chain = (commit_chain_t *)chain;
+	    found->pos = k->pos;
+	}
+	return chain->commits[k->pos];
+    }
+    return NULL;
+}
 
-    if (!branch)
-	return NULL;
+static git_commit *
+chain_locate_date(const commit_chain_t *chain, size_t pos,
+		  const cvstime_t date, chain_location_t *found)
+/* first commit from chain position pos on no later than date */
+{
+    for (; chain; pos = chain->next_pos, chain = chain->next) {
+	size_t lo = pos, hi = chain->ncommits;
 
-    /* PUNNING: see the big comment in cvs.h */
-    for (commit = (git_commit *)branch->commit;
-	 commit;
-	 commit = commit->parent)
-    {
-	/* PUNNING: see the big comment in cvs.h */
-	if (cvs_commit_match((cvs_commit *)commit, part))
-	    return commit;
+	if (pos > 0 && time_compare(chain->lowest[pos - 1], date) <= 0) {
+	    /* the running minimum can't help here, so walk */
+	    while (lo < hi && time_compare(chain->commits[lo]->date, date) > 0)
+		lo++;
+	} else {
+	    while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (time_compare(chain->lowest[mid], date) <= 0)
+		    hi = mid;
+		else
+		    lo = mid + 1;
+	    }
+	}
+	if (lo < chain->ncommits) {
+	    if (found) {
+		found->chain = (commit_chain_t *)chain;
+		found->pos = lo;
+	    }
+	    return chain->commits[lo];
+	}
     }
     return NULL;
 }
 
+static git_commit *
+git_commit_locate_date(const rev_ref *branch, const cvstime_t date,
+		       chain_location_t *found)
+/* on branch, locate a commit within fuzz-time distance of date */
+{
+    return chain_locate_date(chain_of(branch), 0, date, found);
+}
+
+static git_commit *
+git_commit_locate_one(const rev_ref *branch, const cvs_commit *part,
+		      chain_location_t *found)
+/* seek a gitspace commit on branch incorporating cvs_commit */
+{
+    return chain_locate(chain_of(branch), 0, part, found);
+}
+
 static git_commit *
 git_commit_locate_any(const rev_ref *branch, const cvs_commit *part)
 /* seek a gitspace commit on *any* branch incorporating cvs_commit */
@@ -352,7 +936,7 @@ git_commit_locate_any(const rev_ref *branch, const cvs_commit *part)
     commit = git_commit_locate_any(branch->next, part);
     if (commit)
 	return commit;
-    return git_commit_locate_one(branch, part);
+    return git_commit_locate_one(branch, part, NULL);
 }
 
 static git_commit *
@@ -363,7 +947,7 @@ git_commit_locate(const rev_ref *branch, const cvs_commit *cm)
     /*
      * Check the presumed trunk first
      */
-    commit = git_commit_locate_one(branch, cm);
+    commit = git_commit_locate_one(branch, cm, NULL);
     if (commit)
 	return commit;
     /*
@@ -375,13 +959,14 @@ git_commit_locate(const rev_ref *branch, const cvs_commit *cm)
 }
 
 static rev_ref *
-git_branch_of_commit(const git_repo *gl, const cvs_commit *commit)
-/* return the gitspace branch head that owns a specified CVS commit */
+git_branch_of_commit(const git_repo *gl, const cvs_commit *commit,
+		     const rev_ref *until)
+/* return the gitspace branch head before until that owns a CVS commit */
 {
     rev_ref	*h;
     cvs_commit	*c;
 
-    for (h = gl->heads; h; h = h->next)
+    for (h = gl->heads; h && h != until; h = h->next)
     {
 	if (h->tail)
 	    continue;
@@ -404,9 +989,54 @@ cvs_commit_first_date(cvs_commit *commit)
     return commit->date;
 }
 
+/*
+ * Collation of one gitspace branch, as scheduled over the thread pool.
+ * A branch can be collated once its parent is done, so siblings run
+ * side by side.  Warnings are captured per branch and written out in
+ * branch order afterwards, so the log reads as a sequential run's would.
+ * Likewise the gitspace links a branch makes for CVS commits it shares
+ * with its parent, which its siblings may be linking at the same time:
+ * they are kept in the job and made in branch order, so the last branch
+ * to claim a commit wins as it does sequentially.
+ */
+typedef struct _gitspace_link {
+    cvs_commit		*commit;
+    git_commit		*gitspace;
+} gitspace_link_t;
+
+typedef struct _collate_job {
+    rev_ref		*branch;
+    struct _collate_job	*parent;
+    struct _collate_job	*children, *sibling;
+    FILE		*log;		/* captured warnings */
+    char		*logbuf;
+    size_t		loglen;
+    const cvs_commit	*lost;		/* deferred git_branch_of_commit() */
+    long		lost_at;	/* where its result goes in the log */
+    gitspace_link_t	*links;		/* deferred shared gitspace links */
+    size_t		nlinks, linkalloc;
+} collate_job_t;
+
+static void
+gitspace_link(collate_job_t *job, cvs_commit *c, git_commit *commit)
+/* link a CVS commit the branch shares to its gitspace commit */
+{
+    if (job == NULL) {
+	c->gitspace = commit;
+	return;
+    }
+    if (job->nlinks >= job->linkalloc) {
+	job->linkalloc = job->linkalloc ? job->linkalloc * 2 : 16;
+	job->links = xrealloc(job->links,
+			      job->linkalloc * sizeof(gitspace_link_t), __func__);
+    }
+    job->links[job->nlinks].commit = c;
+    job->links[job->nlinks++].gitspace = commit;
+}
+
 static void
 collate_branches(rev_ref **branches, int nbranch,
-		  rev_ref *branch, git_repo *gl)
+		  rev_ref *branch, git_repo *gl, collate_job_t *job)
 /* collate a set of per-CVS-master branches into a gitspace DAG branch */
 {
     int nlive;
@@ -418,6 +1048,9 @@ collate_branches(rev_ref **branches, int nbranch,
     cvs_commit *latest;
     revision_t *p;
     time_t birth = 0;
+    chain_location_t join = {NULL, 0};
+    clique_queue_t queue;
+    int *members, live, nkilled = 0;
 
     /*
      * It is expected that the array of input branches is all CVS branches
@@ -444,7 +1077,7 @@ collate_branches(rev_ref **branches, int nbranch,
 	if (!c)
 	    continue;
 	if (branches[n]->tail) {
-	    c->tailed = true;
+	    REVISION_T_SET_TAILED(revisions[n]);
 	    continue;
 	}
 	nlive++;
@@ -477,7 +1110,7 @@ collate_branches(rev_ref **branches, int nbranch,
      */
     for (n = 0; n < nbranch; n++) {
 	cvs_commit *c = REVISIONS(n);
-	if (!c->tailed)
+	if (!TAILED(n))
 	    continue;
 	if (!birth || time_compare(birth, c->date) >= 0)
 	    continue;
@@ -491,27 +1124,33 @@ collate_branches(rev_ref **branches, int nbranch,
      * Walk down CVS branches creating gitspace commits until each CVS
      * branch has collated with its parent.
      */
-    while (nlive > 0 && nbranch > 0) {
+    queue_init(&queue, revisions, nbranch);
+    members = xmalloc(nbranch * sizeof(int), "collating per-file branches");
+    for (n = 0, live = 0; n < queue.nheap; n++)
+	if (LIVE(queue.heap[n]))
+	    live++;
+    while (nlive > 0 && queue.nheap > 0) {
+	int nmembers, m;
+
 	/*
-	 * Gather the next set of CVS commits down the branch and
-	 * figure out which (non-tailed) one of them is latest in
-	 * time.  It will be the leader for the git commit build.
+	 * Once more than half the set has dropped out, squeeze the
+	 * null commit pointers out so the commit builds stay cheap.
 	 */
-	for (n = 0, p = revisions, latest = NULL; n < nbranch; n++) {
-	    /*
-	     * Squeeze null commit pointers out of the current set.
-	     */
-	    cvs_commit *rev = REVISIONS(n);
-	    if (!rev)
-		continue;
-	    *p++ = revisions[n];
-	    if (rev->tailed)
-		continue;
-	    if (!latest || time_compare(latest->date, rev->date) < 0)
-		latest = rev;
+	if (nkilled * 2 > nbranch) {
+	    for (n = 0, p = revisions; n < nbranch; n++)
+		if (REVISIONS(n))
+		    *p++ = revisions[n];
+	    nbranch = p - revisions;
+	    nkilled = 0;
+	    queue_free(&queue);
+	    queue_init(&queue, revisions, nbranch);
 	}
-	assert(latest != NULL);
-	nbranch = p - revisions;
+
+	/*
+	 * The newest (non-tailed) CVS commit down the branch is the
+	 * leader for the git commit build.
+	 */
+	latest = REVISIONS(queue.heap[0]);
 
 	/*
 	 * Construct current commit from the set of CVS commits
@@ -522,30 +1161,30 @@ collate_branches(rev_ref **branches, int nbranch,
 	commit = git_commit_build(revisions, latest, nbranch);
 
 	/*
-	 * Step down each CVS branch in parallel.  Our goal is to land on
-	 * a clique of matching CVS commits that will  be made into a
-	 * matching gitspace commit on the next time around the loop.
+	 * Step down each CVS branch in the clique matching the leader.
+	 * Our goal is to land on the next clique of matching CVS
+	 * commits that will be made into a matching gitspace commit on
+	 * the next time around the loop.  Unaffected branches stay put.
 	 */
-	nlive = 0;
-	for (n = 0; n < nbranch; n++) {
-	    cvs_commit *c = REVISIONS(n);
-	    cvs_commit *to;
-	    /* already got to parent branch? */
-	    if (c->tailed)
-		continue;
-	    /* not affected? */
-	    if (c != latest && !cvs_commit_match(c, latest)) {
-		if (c->parent || !c->dead)
-		    nlive++;
-		continue;
-	    }
+	nmembers = queue_clique(&queue, members);
+	for (m = 0; m < nmembers; m++) {
+	    cvs_commit *c, *to;
+	    bool tailed = false;
+
+	    n = members[m];
+	    c = REVISIONS(n);
+	    if (LIVE(n))
+		live--;
 #ifdef GITSPACEDEBUG
 	    if (c->gitspace) {
 		warn("CVS commit allocated to multiple git commits: ");
-		dump_number_file(LOGFILE, c->master->name, c->number);
+		dump_number_file(LOGSTREAM, c->master->name, c->number);
 		warn("\n");
 	    } else
 #endif /* GITSPACEDEBUG */
+	    if (TAILED(n))
+		gitspace_link(job, c, commit);	/* on the parent branch */
+	    else
 		c->gitspace = commit;
 
 	    to = c->parent;
@@ -577,10 +1216,8 @@ collate_branches(rev_ref **branches, int nbranch,
 		 * branch had forked off it but before
 		 * our branch's creation.
 		 */
-		to->tailed = true;
-	    } else if (!to->dead) {
-		nlive++;
-	    } else {
+		tailed = true;
+	    } else if (to->dead) {
 		/*
 		 * See if it's recent CVS adding a file
 		 * independently added on another branch.
@@ -589,7 +1226,6 @@ collate_branches(rev_ref **branches, int nbranch,
 		    goto Kill;
 		if (to->tail && to->date == to->parent->date)
 		    goto Kill;
-		nlive++;
 	    }
 
 	    /*
@@ -598,15 +1234,25 @@ collate_branches(rev_ref **branches, int nbranch,
 	     * changeset construction.
 	     */
 	    REVISION_T_PACK(revisions[n], to);
+	    if (tailed)
+		REVISION_T_SET_TAILED(revisions[n]);
+	    else
+		live++;
+	    queue_update(&queue, n);
 	    continue;
 	Kill:
 	    REVISION_T_PACK(revisions[n], (cvs_commit *)NULL);
+	    queue_update(&queue, n);
+	    nkilled++;
 	}
+	nlive = live;
 
 	*tail = commit;
 	tail = &commit->parent;
 	prev = commit;
     }
+    queue_free(&queue);
+    free(members);
 
     /*
      * Gitspace branch construction is done. Now connect it to its
@@ -644,7 +1290,7 @@ collate_branches(rev_ref **branches, int nbranch,
 	     */
 	    *tail = NULL;
 	else if ((*tail = git_commit_locate_one(branch->parent,
-						REVISIONS(present))))
+						REVISIONS(present), &join)))
 	{
 	    if (prev && time_compare((*tail)->date, prev->date) > 0) {
 		cvs_commit *first;
@@ -654,10 +1300,10 @@ collate_branches(rev_ref **branches, int nbranch,
 		     cvstime2rfc3339(REVISIONS(present)->date),
 		     DEAD(present) ? "D" : " " );
 		if (!DEAD(present))
-		    dump_number_file(LOGFILE,
+		    dump_number_file(LOGSTREAM,
 				     REVISIONS(present)->master->name,
 				     REVISIONS(present)->number);
-		fprintf(LOGFILE, "\n");
+		fprintf(LOGSTREAM, "\n");
 		/*
 		 * The file part of the error message could be spurious for
 		 * a multi-file commit, alas.  It wasn't any better back when
@@ -671,13 +1317,14 @@ collate_branches(rev_ref **branches, int nbranch,
 		revdir_iter *ri = revdir_iter_alloc(&prev->revdir);
 		first = revdir_iter_next(ri);
 		free(ri);
-		dump_number_file(LOGFILE,
+		dump_number_file(LOGSTREAM,
 				  first->master->name,
 				  first->number);
-		fprintf(LOGFILE, "\n");
+		fprintf(LOGSTREAM, "\n");
 	    }
 	} else if ((*tail = git_commit_locate_date(branch->parent,
-						   REVISIONS(present)->date)))
+						   REVISIONS(present)->date,
+						   &join)))
 	    warn("warning - branch point %s -> %s matched by date\n",
 		     branch->ref_name, branch->parent->ref_name);
 	else {
@@ -685,9 +1332,15 @@ collate_branches(rev_ref **branches, int nbranch,
 	    warn("error - branch point %s -> %s not found.",
 		branch->ref_name, branch->parent->ref_name);
 
-	    if ((lost = git_branch_of_commit(gl, REVISIONS(present))))
+	    if (job) {
+		/* other branches may still be collating; look later */
+		fflush(job->log);
+		job->lost = REVISIONS(present);
+		job->lost_at = ftell(job->log);
+	    } else if ((lost = git_branch_of_commit(gl, REVISIONS(present),
+						    branch)))
 		warn(" Possible match on %s.", lost->ref_name);
-	    fprintf(LOGFILE, "\n");
+	    fprintf(LOGSTREAM, "\n");
 	}
 	if (*tail) {
 	    if (prev)
@@ -699,24 +1352,21 @@ collate_branches(rev_ref **branches, int nbranch,
 #ifdef GITSPACEDEBUG
 		    if (REVISIONS(n)->gitspace) {
 			warn("CVS commit allocated to multiple git commits: ");
-			dump_number_file(LOGFILE,
+			dump_number_file(LOGSTREAM,
 					 REVISIONS(n)->master->name,
 					 REVISIONS(n)->number);
 			warn("\n");
 		    } else
 #endif /* GITSPACEDEBUG */
-			REVISIONS(n)->gitspace = *tail;
+			gitspace_link(job, REVISIONS(n), *tail);
 		}
 	}
     }
 
-    for (n = 0; n < nbranch; n++)
-	if (REVISIONS(n))
-	    REVISIONS(n)->tailed = false;
-
     free(revisions);
     /* PUNNING: see the big comment in cvs.h */
     branch->commit = (cvs_commit *)head;
+    chain_build(branch, &join);
 }
 
 static bool
@@ -728,22 +1378,16 @@ git_commit_contains_revs(git_commit *g, cvs_commit **revs, size_t nrev)
     revdir_iter *it = revdir_iter_alloc(&g->revdir);
     size_t i = 0;
     cvs_commit *c = NULL;
-    static bool n_init = false;
-    static const cvs_number *n1 = NULL;
-    static const cvs_number *n2 = NULL;
-
-    if (!n_init) {
-	n1 = atom_cvs_number(lex_number("1.1"));
-	n2 = atom_cvs_number(lex_number("1.1.1.1"));
-	n_init = true;
-    }
+
     /* order of checks is important */
     while ((c = revdir_iter_next(it)) && i < nrev) {
 	if (revs[i] != c) {
 	    // seen repos where 1.1 and 1.1.1.1 are used interchangeably
 	    if (revs[i]->master != c->master
-		|| (revs[i]->number != n1 && revs[i]->number != n2)
-		|| (c->number != n1 && c->number != n2)) {
+		|| (revs[i]->number != initial_rev
+		    && revs[i]->number != initial_vendor_rev)
+		|| (c->number != initial_rev
+		    && c->number != initial_vendor_rev)) {
 		free(it);
 		return false;
 	    }
@@ -774,6 +1418,27 @@ compare_cvs_commit(const void *a, const void *b)
 /*
  * Locate position in git tree corresponding to specific tag
  */
+static bool
+fingerprint_match(cvs_commit **revisions, const size_t nrev,
+		  hash_t *fingerprint)
+/* compute a tag's fingerprint; is there any commit with its revisions? */
+{
+    git_commit *g;
+    size_t i;
+
+    *fingerprint = 0;
+    for (i = 0; i < nrev; i++)
+	*fingerprint += fingerprint_revision(revisions[i]);
+    if (fingerprint_table == NULL)
+	return false;
+    for (g = fingerprint_table[*fingerprint & (fingerprint_size - 1)];
+	 g; g = g->same_fingerprint)
+	if (g->fingerprint == *fingerprint
+	    && git_commit_contains_revs(g, revisions, nrev))
+	    return true;
+    return false;
+}
+
 static void
 rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
 {
@@ -803,6 +1468,7 @@ rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
      * Tags can point to dead commits, we ignore these as they
      * don't get backlinks to git commits. This may get revisited later.
      */
+    hash_t fingerprint;
     cvs_commit *c = cvs_commit_latest(revisions, tag->count);
     if (!c)	/* only dead revisions in the tag */
 	return;
@@ -820,7 +1486,7 @@ rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
 	/* we've seen this set of revisions before, just link tag to it */
 	tag->commit = c->gitspace;
 	return;
-    } else {
+    } else if (fingerprint_match(revisions, tag->count, &fingerprint)) {
 	/* Search to try and find a matching git commit.
 	 * We can prune if we get to c->gitspace.
          * We can prune if we get to an older commit than c->gitspace.
@@ -835,6 +1501,10 @@ rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
 	 *
 	 * Emacs has one place with 35 tags pointing to the same
 	 * revision set, so this saves 34 branches.
+	 *
+	 * We only get here if some commit has the tag's revision set,
+	 * and only commits with the same fingerprint need comparing;
+	 * the walk is still needed to pick the same one it always did.
 	 */
 	rev_ref    *h;
 	git_commit *g;
@@ -848,7 +1518,8 @@ rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
 		    break;
 		if (time_compare(g->date, c->gitspace->date) < 0)
 		    break;
-		if (git_commit_contains_revs(g, revisions, tag->count)) {
+		if (g->fingerprint == fingerprint
+		    && git_commit_contains_revs(g, revisions, tag->count)) {
 		    tag->commit = g;
 		    return;
 		}
@@ -872,8 +1543,9 @@ rev_tag_search(tag_t *tag, cvs_commit **revisions, git_repo *gl)
 	REVISION_T_PACK_INIT(revs[i], revisions[i]);
     git_commit *g = git_commit_build(revs, c, tag->count);
     free(revs);
+    fingerprint_enter(g);
     g->parent = c->gitspace;
-    rev_ref *parent_branch = git_branch_of_commit(gl, c);
+    rev_ref *parent_branch = git_branch_of_commit(gl, c, NULL);
     rev_ref *tag_branch = xcalloc(1, sizeof(rev_ref), __func__);
     tag_branch->parent = parent_branch;
     /* type punning */
@@ -924,6 +1596,194 @@ rev_ref_set_parent(git_repo *gl, rev_ref *dest, cvs_master *source, size_t nmast
 	dest->depth = 1;
 }
 
+static void
+collate_head(rev_ref *h, cvs_master *masters, const size_t nmasters,
+	     rev_ref **refs, git_repo *gl, collate_job_t *job)
+/* collate one gitspace branch from its CVS branches in every master */
+{
+    cvs_master	*cm;
+    rev_ref	*lh;
+    int		nref = 0;
+
+    /*
+     * For this imputed gitspace branch, locate the corresponding
+     * set of CVS branches from every master.
+     */
+    for (cm = masters; cm < masters + nmasters; cm++) {
+	lh = rev_find_head(cm, h->ref_name);
+	if (lh) {
+	    refs[nref++] = lh;
+	}
+    }
+    if (nref)
+	/*
+	 * Collate those branches into a single gitspace branch
+	 * and add that to the output revlist on gl.
+	 */
+	collate_branches(refs, nref, h, gl, job);
+}
+
+#ifdef THREADS
+static struct {
+    pthread_mutex_t	mutex;
+    pthread_cond_t	cond;
+    collate_job_t	**ready;	/* branches whose parents are done */
+    size_t		taken, queued, done, njobs;
+    cvs_master		*masters;
+    size_t		nmasters;
+    git_repo		*gl;
+} collation = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+collate_worker(void *arg)
+/* collate branches off the ready queue until every branch is taken */
+{
+    rev_ref **refs = xmalloc(collation.nmasters * sizeof(rev_ref *), __func__);
+    collate_job_t *job, *child;
+
+    revdir_pack_alloc(collation.nmasters);
+    for (;;) {
+	pthread_mutex_lock(&collation.mutex);
+	while (collation.taken == collation.queued
+	       && collation.taken < collation.njobs)
+	    pthread_cond_wait(&collation.cond, &collation.mutex);
+	if (collation.taken == collation.njobs) {
+	    pthread_mutex_unlock(&collation.mutex);
+	    break;
+	}
+	job = collation.ready[collation.taken++];
+	pthread_mutex_unlock(&collation.mutex);
+
+	job->log = open_memstream(&job->logbuf, &job->loglen);
+	if (job->log == NULL)
+	    fatal_system_error("cannot capture collation warnings");
+	log_capture = job->log;
+	collate_head(job->branch, collation.masters, collation.nmasters,
+		     refs, collation.gl, job);
+	log_capture = NULL;
+	fclose(job->log);
+	job->log = NULL;
+
+	pthread_mutex_lock(&collation.mutex);
+	for (child = job->children; child; child = child->sibling)
+	    collation.ready[collation.queued++] = child;
+	progress_jump(++collation.done);
+	pthread_cond_broadcast(&collation.cond);
+	pthread_mutex_unlock(&collation.mutex);
+    }
+    free(refs);
+    revdir_pack_free();
+    revdir_free_bufs();
+    stats_thread_done(PHASE_COLLATION);
+    return NULL;
+}
+
+typedef struct _job_index {
+    const rev_ref	*branch;
+    collate_job_t	*job;
+} job_index_t;
+
+static int
+job_index_compare(const void *a, const void *b)
+/* order jobs by the address of their branch, for bsearch() */
+{
+    const rev_ref *ra = ((const job_index_t *)a)->branch;
+    const rev_ref *rb = ((const job_index_t *)b)->branch;
+
+    return ra < rb ? -1 : ra > rb;
+}
+
+static collate_job_t *
+collate_parallel(cvs_master *masters, const size_t nmasters,
+		 git_repo *gl, const size_t head_count)
+/* collate all branches over the thread pool, parents before children */
+{
+    collate_job_t	*jobs = xcalloc(head_count, sizeof(collate_job_t), __func__);
+    job_index_t		*index = xmalloc(head_count * sizeof(job_index_t), __func__);
+    job_index_t		key;
+    pthread_t		*workers;
+    rev_ref		*h;
+    size_t		i, njobs = 0;
+
+    for (h = gl->heads; h && njobs < head_count; h = h->next)
+	jobs[njobs++].branch = h;
+    for (i = 0; i < njobs; i++) {
+	index[i].branch = jobs[i].branch;
+	index[i].job = &jobs[i];
+    }
+    qsort(index, njobs, sizeof(job_index_t), job_index_compare);
+
+    collation.ready = xmalloc(njobs * sizeof(collate_job_t *), __func__);
+    collation.taken = collation.queued = collation.done = 0;
+    collation.njobs = njobs;
+    collation.masters = masters;
+    collation.nmasters = nmasters;
+    collation.gl = gl;
+    /* walk backwards so children and the ready queue keep branch order */
+    for (i = njobs; i-- > 0; ) {
+	job_index_t *found = NULL;
+
+	if (jobs[i].branch->parent) {
+	    key.branch = jobs[i].branch->parent;
+	    found = bsearch(&key, index, njobs, sizeof(job_index_t),
+			    job_index_compare);
+	}
+	if (found) {
+	    jobs[i].parent = found->job;
+	    jobs[i].sibling = jobs[i].parent->children;
+	    jobs[i].parent->children = &jobs[i];
+	}
+    }
+    free(index);
+    for (i = 0; i < njobs; i++)
+	if (jobs[i].parent == NULL)
+	    collation.ready[collation.queued++] = &jobs[i];
+
+    workers = xcalloc(threads, sizeof(pthread_t), __func__);
+    for (i = 0; i < (size_t)threads; i++)
+	if (pthread_create(&workers[i], NULL, collate_worker, NULL) != 0)
+	    fatal_system_error("cannot start collation thread");
+    for (i = 0; i < (size_t)threads; i++)
+	pthread_join(workers[i], NULL);
+    free(workers);
+    free(collation.ready);
+    collation.ready = NULL;
+    return jobs;
+}
+
+static void
+collate_replay_logs(git_repo *gl, collate_job_t *jobs, const size_t head_count)
+/* make the deferred links and write the captured warnings, in branch order */
+{
+    size_t i;
+
+    for (i = 0; i < head_count; i++) {
+	collate_job_t *job = &jobs[i];
+	size_t at = 0, n;
+
+	for (n = 0; n < job->nlinks; n++)
+	    job->links[n].commit->gitspace = job->links[n].gitspace;
+	free(job->links);
+	if (job->logbuf == NULL)
+	    continue;
+	if (job->lost) {
+	    rev_ref *lost;
+
+	    at = job->lost_at;
+	    fwrite(job->logbuf, 1, at, LOGFILE);
+	    if ((lost = git_branch_of_commit(gl, job->lost, job->branch)))
+		warn(" Possible match on %s.", lost->ref_name);
+	}
+	fwrite(job->logbuf + at, 1, job->loglen - at, LOGFILE);
+	free(job->logbuf);
+    }
+    free(jobs);
+}
+#endif /* THREADS */
+
 git_repo *
 collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
 /* entry point - collate CVS revision lists to a gitspace DAG */
@@ -935,6 +1795,9 @@ collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
     rev_ref	*lh, *h;
     tag_t	*t;
     rev_ref	**refs = xcalloc(nmasters, sizeof(rev_ref *), "list collate");
+#ifdef THREADS
+    collate_job_t *jobs = NULL;
+#endif /* THREADS */
 
     /*
      * It is expected that the branch trees in all CVS masters have
@@ -1019,27 +1882,24 @@ collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
 
     progress_begin("Collate common branches...", head_count);
     revdir_pack_alloc(nmasters);
-    for (h = gl->heads; h; h = h->next) {
-	/*
-	 * For this imputed gitspace branch, locate the corresponding
-	 * set of CVS branches from every master.
-	 */
-	int nref = 0;
-	for (cm = masters; cm < masters + nmasters; cm++) {
-	    lh = rev_find_head(cm, h->ref_name);
-	    if (lh) {
-		refs[nref++] = lh;
-	    }
+    /* before any collation thread can fingerprint a revision */
+    initial_revs_init();
+    chain_index_init(gl, head_count);
+#ifdef THREADS
+    if (threads > 1)
+	jobs = collate_parallel(masters, nmasters, gl, head_count);
+    else
+#endif /* THREADS */
+	for (h = gl->heads; h; h = h->next) {
+	    collate_head(h, masters, nmasters, refs, gl, NULL);
+	    progress_step();
 	}
-	if (nref)
-	    /*
-	     * Collate those branches into a single gitspace branch
-	     * and add that to the output revlist on gl.
-	     */
-	    collate_branches(refs, nref, h, gl);
-	progress_step();
-    }
+    chain_index_free();
     progress_end(NULL);
+#ifdef THREADS
+    if (jobs)
+	collate_replay_logs(gl, jobs, head_count);
+#endif /* THREADS */
 
 
 #ifdef GITSPACEDEBUG
@@ -1074,6 +1934,7 @@ collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
      * with the right gitspace commit.
      */
     progress_begin("Find tag locations...", tag_count);
+    stats_begin(PHASE_TAGS);
     for (t = all_tags; t; t = t->next) {
 	cvs_commit **commits = tagged(t);
 	if (commits)
@@ -1083,6 +1944,8 @@ collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
 	free(commits);
 	progress_step();
     }
+    stats_end(PHASE_TAGS);
+    fingerprint_free();
     revdir_pack_free();
     revdir_free_bufs();
     progress_end(NULL);
@@ -1107,30 +1970,39 @@ collate_to_changesets(cvs_master *masters, size_t nmasters, int verbose)
     return gl;
 }
 
-/*
- * Generate a list of files in uniq that aren't in common
- */
+static void
+diff_file(cvs_commit *old, cvs_commit *new, void *arg)
+/* put a file that differs between two commits on the del and add lists */
+{
+    rev_diff	*diff = arg;
+    cvs_commit_list *fl;
+
+    if (old) {
+	fl = xcalloc(1, sizeof(cvs_commit_list), __func__);
+	fl->file = old;
+	fl->next = diff->del;
+	diff->del = fl;
+	diff->ndel++;
+    }
+    if (new) {
+	fl = xcalloc(1, sizeof(cvs_commit_list), __func__);
+	fl->file = new;
+	fl->next = diff->add;
+	diff->add = fl;
+	diff->nadd++;
+    }
+}
+
 static cvs_commit_list *
-rev_uniq_file(git_commit *uniq, git_commit *common, int *nuniqp)
+cvs_commit_list_reverse(cvs_commit_list *fl)
 {
-    int nuniq = 0;
-    cvs_commit_list   *head = NULL, **tail = &head, *fl;
-    cvs_commit *c;
+    cvs_commit_list *head = NULL, *next;
 
-    if (!uniq)
-	return NULL;
-    revdir_iter *ri = revdir_iter_alloc(&uniq->revdir);
-    while ((c = revdir_iter_next(ri))) {
-	if (c->gitspace != common) {
-	    fl = xcalloc(1, sizeof(cvs_commit_list), "rev_uniq_file");
-	    fl->file = c;
-	    *tail = fl;
-	    tail = &fl->next;
-	    ++nuniq;
-	}
+    for (; fl; fl = next) {
+	next = fl->next;
+	fl->next = head;
+	head = fl;
     }
-    free(ri);
-    *nuniqp = nuniq;
     return head;
 }
 
@@ -1142,8 +2014,19 @@ git_commit_diff(git_commit *old, git_commit *new)
 {
     rev_diff	*diff = xcalloc(1, sizeof(rev_diff), __func__);
 
-    diff->del = rev_uniq_file(old, new, &diff->ndel);
-    diff->add = rev_uniq_file(new, old, &diff->nadd);
+    if (new)
+	revdir_diff(old ? &old->revdir : NULL, &new->revdir, diff_file, diff);
+    else if (old) {
+	/* everything in old is gone */
+	revdir_diff(NULL, &old->revdir, diff_file, diff);
+	diff->del = diff->add;
+	diff->ndel = diff->nadd;
+	diff->add = NULL;
+	diff->nadd = 0;
+    }
+    /* keep the lists in path order */
+    diff->del = cvs_commit_list_reverse(diff->del);
+    diff->add = cvs_commit_list_reverse(diff->add);
     return diff;
 }
 
@@ -0,0 +1,119 @@
+/*
+ * The cvs-fast-export library interface.
+ *
+ * Programs that would rather receive a conversion as a series of calls
+ * than parse a fast-import stream can link libcvs-fast-export.a, fill
+ * in a cfe_sink_t and hand the masters to cfe_convert().  Analysis,
+ * collation and snapshot generation are the same as in the command;
+ * only the last step, writing the stream, is replaced by the sink.
+ *
+ * The sink is called from one thread at a time and in stream order:
+ * each blob before the first commit that refers to it, each commit
+ * after its parent, each reset and tag after the commit it points at.
+ * Marks are numbered as in the stream the command writes with the same
+ * options.  Pointers passed to a callback are good only until it
+ * returns.
+ *
+ * Blob data comes straight out of the snapshot buffer where it can:
+ * in fast order without threads.  In canonical order, or with threads,
+ * snapshots have to be set aside until their turn comes, and are read
+ * back into a buffer of the library's.
+ *
+ * Problems in the masters are reported on stderr, and the fatal ones
+ * end the process, as they do for the command.  The library keeps its
+ * state in globals and sets TZ to UTC, so a process can run only one
+ * conversion.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef _CVS_FAST_EXPORT_H_
+#define _CVS_FAST_EXPORT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* bumped whenever one of the structures below changes */
+#define CFE_API_VERSION	1
+
+typedef unsigned int cfe_mark_t;
+
+typedef struct _cfe_blob {
+    cfe_mark_t		mark;
+    const char		*path;		/* as in the fileops that use it */
+    const char		*revision;	/* the CVS revision, e.g. "1.4" */
+    const void		*prefix;	/* content ahead of data, or NULL */
+    size_t		prefixlen;
+    const void		*data;
+    size_t		len;
+} cfe_blob_t;
+
+typedef struct _cfe_fileop {
+    char		op;		/* 'M' for modify, 'D' for delete */
+    unsigned int	mode;		/* of a modify: 0644 or 0755 */
+    cfe_mark_t		mark;		/* blob of a modify, 0 if inline */
+    const char		*inline_data;	/* content of an inline modify */
+    size_t		inline_len;
+    const char		*path;
+} cfe_fileop_t;
+
+typedef struct _cfe_commit {
+    const char		*ref;		/* e.g. "refs/heads/master" */
+    cfe_mark_t		mark;
+    cfe_mark_t		parent;		/* 0 for a root commit */
+    const char		*from;		/* incremental: start from this ref, else NULL */
+    const char		*committer, *email, *timezone;
+    time_t		date;
+    const char		*log;
+    const char		*revisions;	/* "path rev" lines, with cfe_options_t.revisions */
+    const cfe_fileop_t	*fileops;
+    size_t		nfileops;
+} cfe_commit_t;
+
+typedef struct _cfe_sink {
+    void	*context;		/* passed to every callback */
+    /* any of these may be NULL to ignore that kind of record */
+    void	(*blob)(void *context, const cfe_blob_t *blob);
+    void	(*commit)(void *context, const cfe_commit_t *commit);
+    void	(*reset)(void *context, const char *ref, const cfe_mark_t mark);
+    void	(*tag)(void *context, const char *name, const cfe_mark_t mark);
+} cfe_sink_t;
+
+typedef enum {cfe_adaptive, cfe_fast, cfe_canonical} cfe_order_t;
+
+typedef struct _cfe_options {
+    int		version;		/* CFE_API_VERSION */
+    int		threads;		/* 0 for twice the processor count */
+    cfe_order_t	order;			/* as for --fast and --canonical */
+    const char	*branch_prefix;		/* default "refs/heads/" */
+    int		commit_time_window;	/* seconds, as for -w */
+    bool	trust_commitids;	/* false as for --content-only */
+    bool	promiscuous;		/* as for -P */
+    const char	*strip;			/* as for -s; NULL for the common prefix, "" for none */
+    const char	*expand;		/* as for -k, NULL for the masters' own */
+    const char	*authormap;		/* as for -A */
+    bool	force_dates;		/* as for -T */
+    time_t	fromtime;		/* as for -i, 0 for everything */
+    bool	revisions;		/* fill in cfe_commit_t.revisions */
+    bool	dedup_blobs;		/* as for --dedup-blobs */
+    const char	*cache_file;		/* as for --cache */
+    long	spill_budget;		/* bytes, as for --spill-budget; -1 for none */
+    size_t	prefetch;		/* as for --prefetch */
+    bool	walk;			/* as for --walk */
+    const char	*import_marks, *export_marks;
+} cfe_options_t;
+
+/* set options to the command's defaults */
+void cfe_options_init(cfe_options_t *options);
+
+/*
+ * Convert the named masters, or the masters under named directories
+ * with options->walk, feeding the result to sink.  With none named the
+ * list is read from standard input, or "." is walked, as the command
+ * does.  Returns the number of masters that could not be read.
+ */
+int cfe_convert(const cfe_options_t *options,
+		const char *const *masters, const size_t nmasters,
+		const cfe_sink_t *sink);
+
+#endif /* _CVS_FAST_EXPORT_H_ */
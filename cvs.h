@@ -63,10 +63,19 @@ typedef struct node {
 
 #define NODE_HASH_SIZE	97
 
+typedef struct _arena_block {
+    /* bump-allocated storage, released only all at once */
+    struct _arena_block *next;
+    size_t size, used;
+    void *data[];
+} arena_block_t;
+
 typedef struct nodehash {
     node_t *table[NODE_HASH_SIZE];
     int nentries;
     node_t *head_node;
+    /* holds the nodes and the versions, patches and branches they index */
+    arena_block_t *arena;
 } nodehash_t;
 
 typedef struct _cvs_symbol {
@@ -130,6 +139,7 @@ typedef struct _edit_line {
     unsigned char *ptr;
     size_t length;
     int has_stringdelim;
+    int has_keydelim;	/* a $, so keyword expansion has work to do */
 } editline_t;
 #endif
 
@@ -148,13 +158,17 @@ typedef struct _editbuffer {
     char* Gkeyval;
     char const *Gfilename;
     char *Gabspath;
+    char const *Gbasename;
     cvs_version *Gversion;
     char Gversion_number[CVS_MAX_REV_LEN];
+    const cvs_version *Gdate_version;	/* whose date Gdate_string holds */
+    char Gdate_string[25];
     struct out_buffer_type *Goutbuf;
     struct in_buffer_type in_buffer_store;
 #ifdef LINESTATS
     int line_len; /* temporary used for insertline */
     int has_stringdelim;
+    int has_keydelim;
 #endif
     enum expand_mode Gexpand;
     /*
@@ -175,7 +189,24 @@ typedef struct _editbuffer {
 	unsigned char **line;
 #endif
 	size_t gap, gapsize, linemax;
+	size_t undo_mark;	/* length of the undo journal on entry */
     } stack[CVS_MAX_DEPTH/2], *current;
+    /*
+     * A branch edits its parent's line array in place rather than a
+     * copy of it.  Edits made on branches are journaled here, with the
+     * lines they delete, and undone when the branch is left.
+     */
+    struct undo {
+	unsigned long line, nlines;
+	bool deleted;
+    } *undo;
+    size_t nundo, maxundo;
+#ifdef LINESTATS
+    editline_t *saved;
+#else
+    unsigned char **saved;
+#endif
+    size_t nsaved, maxsaved;
 #ifdef USE_MMAP
     /* A recently used list of mmapped files */
     struct text_map {
@@ -201,6 +232,11 @@ typedef struct _generator {
     cvs_patch		*patches;
     nodehash_t		nodehash;
     editbuffer_t	editbuffer;
+    /* where the metadata is parked while spilled, see spill.c */
+    off_t		spill_offset;
+    size_t		spill_length;
+    /* snapshots made by another run, see shard.c */
+    struct _shard_master *shard;
 } generator_t;
 
 typedef struct {
@@ -216,6 +252,7 @@ typedef struct {
     const cvs_number	*branch;
     cvstime_t           skew_vulnerable;
     serial_t		nversions;
+    serial_t		ntags;
     mode_t		mode;
     unsigned short	verbose;
 } cvs_file;
@@ -226,6 +263,17 @@ typedef struct _master_dir {
     const struct _master_dir *parent;
 } master_dir;
 
+#ifdef COMPACT
+/*
+ * A compact build carves all commits out of a few big slabs and names
+ * them by 32-bit index, so that packed revdirs can hold indices
+ * rather than pointers.
+ */
+typedef uint32_t	commit_index_t;
+#define COMMIT_SLAB_SHIFT	16
+#define COMMIT_SLAB_SIZE	(1 << COMMIT_SLAB_SHIFT)
+#endif /* COMPACT */
+
 typedef struct _rev_master {
     /* information shared by all revisions of a master */
     const char		*name;
@@ -233,6 +281,9 @@ typedef struct _rev_master {
     const master_dir    *dir;
     struct _cvs_commit  *commits;
     serial_t		ncommits;
+#ifdef COMPACT
+    commit_index_t	first;		/* index of commits[0] */
+#endif /* COMPACT */
     mode_t		mode;
 } rev_master;
 
@@ -308,7 +359,6 @@ typedef struct _cvs_commit {
     unsigned		dead:1;
     /* CVS-only members begin here */
     bool                emitted:1;
-    hash_t              hash;
     /* Shortcut to master->dir, more space but less dereferences
      * in the hottest inner loop in revdir
      */
@@ -318,6 +368,14 @@ typedef struct _cvs_commit {
     const cvs_number	*number;
 } cvs_commit;
 
+#ifdef COMPACT
+extern cvs_commit *commit_slabs[];
+#define COMMIT_AT(i) \
+	(commit_slabs[(i) >> COMMIT_SLAB_SHIFT] + ((i) & (COMMIT_SLAB_SIZE - 1)))
+#define COMMIT_INDEX(c) \
+	((c)->master->first + (commit_index_t)((c) - (c)->master->commits))
+#endif /* COMPACT */
+
 typedef struct _git_commit {
     /* a gitspace changeset */
     struct _git_commit	*parent;
@@ -332,6 +390,8 @@ typedef struct _git_commit {
     unsigned		dead:1;
     /* gitspace-only members begin here. */
     revdir		revdir;
+    hash_t		fingerprint;	/* of the revisions, order-independent */
+    struct _git_commit	*same_fingerprint;	/* chain in collate.c index */
 } git_commit;
 
 typedef struct _rev_ref {
@@ -452,6 +512,14 @@ lex_number(const char *);
 
 cvstime_t
 lex_date(const cvs_number *n, void *, cvs_file *cvs);
+#ifdef USE_MMAP
+
+void
+lex_map_input(void *, const char *);
+
+void
+lex_unmap_input(void *);
+#endif /* USE_MMAP */
 
 void
 atom_dir_init(void);
@@ -479,6 +547,9 @@ typedef struct _tag {
 	git_commit *commit;
 	rev_ref *parent;
 	const char *last;
+	/* where the tag was first seen, to keep tag order deterministic */
+	const rev_master *first_master;
+	serial_t first_order;
 } tag_t;
 
 typedef struct _forest {
@@ -498,12 +569,19 @@ extern const master_dir *root_dir;
 
 void tag_commit(cvs_commit *c, const char *name, cvs_file *cvsfile);
 cvs_commit **tagged(tag_t *tag);
+void sort_tags(void);
 void discard_tags(void);
 
 typedef struct _import_options {
     bool promiscuous;
     int verbose;
     ssize_t striplen;
+    const char *cache_file;
+    long spill_budget;		/* bytes of metadata to hold, -1 for all */
+    size_t prefetch;		/* masters to read ahead of the parsers */
+    bool walk;			/* walk directory arguments ourselves */
+    unsigned shard, nshards;	/* this node's part of a sharded run */
+    bool merge;			/* arguments are shards to merge */
 } import_options_t;
 
 typedef struct _export_options {
@@ -518,16 +596,67 @@ typedef struct _export_options {
     enum {adaptive, fast, canonical} reportmode;
     bool authorlist;
     bool progress;
+    size_t output_buffer;	/* stdout buffer size, 0 for the default */
+    bool dedup_blobs;
+    const char *import_marks, *export_marks;
+    const struct _cfe_sink *sink;	/* callbacks to use instead of stdout */
 } export_options_t;
 
 typedef struct _export_stats {
     long	export_total_commits;
+    long	export_total_blobs;
+    long	export_duplicate_blobs;
     double	snapsize;
 } export_stats_t;
 
 void
 analyze_masters(int argc, char *argv[0], import_options_t *options, forest_t *forest);
 
+struct stat;
+void parse_cache_load(const char *path, const size_t nfiles);
+bool parse_cache_fetch(const size_t index, const struct stat *st, cvs_file *cvs);
+bool parse_cache_fresh(const char *name, const struct stat *st);
+void parse_cache_store(const size_t index, const struct stat *st, const cvs_file *cvs,
+		       char *warnings, const size_t warnlen);
+size_t parse_cache_save(const char *path);
+void parse_cache_serialize(const cvs_file *cvs, char **data, size_t *len);
+bool parse_cache_deserialize(const char *data, const size_t len, cvs_file *cvs);
+
+typedef struct _walk_entry {
+    char	*name;
+    off_t	size;
+} walk_entry_t;
+
+size_t walk_masters(const char *root, walk_entry_t **entries);
+
+void shard_begin(const unsigned shard, const unsigned nshards, const size_t nmasters);
+void shard_add(const size_t index, const char *name, const off_t size, const bool owned);
+void shard_store(const size_t index, const cvs_file *cvs);
+void shard_write(forest_t *forest, export_options_t *opts);
+size_t shard_load(const int nfiles, char *files[]);
+const char *shard_name(const size_t index, off_t *size);
+bool shard_fetch(const size_t index, cvs_file *cvs, const rev_master *master);
+void shard_replay(generator_t *gen, export_options_t *opts,
+		  void (*hook)(node_t *node, void *buf, size_t len, export_options_t *popts));
+void shard_free(void);
+
+void spill_init(const long budget);
+void spill_generator(generator_t *gen);
+void unspill_generator(generator_t *gen);
+size_t spill_report(size_t *bytes);
+void spill_free(void);
+
+void marks_load(const char *path);
+serial_t marks_highest(void);
+void marks_open(const char *path);
+serial_t marks_find_blob(const cvs_commit *c);
+void marks_note_blob(const cvs_commit *c, const serial_t mark);
+serial_t marks_find_commit(const char *key, const size_t len);
+void marks_note_commit(const char *key, const size_t len, const serial_t mark);
+serial_t marks_find_ref(const char kind, const char *name);
+void marks_note_ref(const char kind, const char *name, const serial_t mark);
+void marks_save(void);
+
 enum expand_mode expand_override(char const *s);
 
 bool
@@ -606,6 +735,9 @@ dump_rev_head(rev_ref *h, FILE *);
 void
 dump_rev_graph(git_repo *rl, const char *title);
 
+void
+atom_reserve(size_t strings, size_t numbers);
+
 const char *
 atom(const char *string);
 
@@ -615,6 +747,9 @@ atom_cvs_number(const cvs_number n);
 unsigned long
 hash_cvs_number(const cvs_number *const key);
 
+void
+atom_stats(size_t *strings, size_t *numbers, size_t *collisions);
+
 void
 discard_atoms(void);
 
@@ -677,6 +812,12 @@ xcalloc(size_t, size_t, char const *legend) _alloclike2(1,2) _malloclike;
 void* 
 xrealloc(void *ptr, size_t size, char const *legend) _alloclike(2);
 
+void*
+arena_alloc(arena_block_t **arena, size_t size, char const *legend) _alloclike(2) _malloclike;
+
+void
+arena_free(arena_block_t **arena);
+
 void
 announce(char const *format,...) _printflike(1, 2);
 
@@ -719,6 +860,30 @@ void progress_end(const char * /*format*/, ...) _printflike(1, 2);
 extern unsigned int warncount;
 extern unsigned int natoms;
 
+/* phases reported by --stats-json; nested ones only accumulate busy time */
+typedef enum {
+    PHASE_ANALYSIS,	/* whole of analyze_masters() */
+    PHASE_PARSE,	/* lexing and parsing, summed over masters */
+    PHASE_DIGEST,	/* cvs_master_digest(), summed over masters */
+    PHASE_COLLATION,	/* whole of collate_to_changesets() */
+    PHASE_REVDIR,	/* revdir packing, summed over commits */
+    PHASE_TAGS,		/* tag placement by rev_tag_search() */
+    PHASE_SNAPSHOTS,	/* snapshot generation at export time */
+    PHASE_EMISSION,	/* the rest of the export */
+    PHASE_COUNT
+} phase_t;
+
+extern bool collect_stats;
+
+void stats_begin(const phase_t phase);
+void stats_end(const phase_t phase);
+void stats_clock(struct timespec *start);
+void stats_lap(const phase_t phase, struct timespec *start);
+void stats_thread_done(const phase_t phase);
+void stats_alloc(const char *legend, const size_t size);
+void stats_write(const char *path,
+		 const forest_t *forest, const export_stats_t *export_stats);
+
 /*
  * Global options
  */
@@ -728,6 +893,20 @@ extern int commit_time_window;
 extern bool trust_commitids;
 extern FILE *LOGFILE;
 
+/*
+ * A worker thread may point log_capture at a stream of its own to hold
+ * its warnings back, so they can be written out in a deterministic order;
+ * the parse cache uses it to keep the warnings a master's parse gave.
+ */
+#ifdef THREADS
+#define THREAD_LOCAL	__thread
+#else
+#define THREAD_LOCAL
+#endif /* THREADS */
+
+extern THREAD_LOCAL FILE *log_capture;
+#define LOGSTREAM	(log_capture ? log_capture : LOGFILE)
+
 extern bool progress;
 #define STATUS stderr
 #define NO_MAX	-1
@@ -23,48 +23,12 @@ cvs_symbol_free(cvs_symbol *symbol)
     }
 }
 
-static void
-cvs_branch_free(cvs_branch *branch)
-/* discard all master branches from this CVS context */
-{
-    cvs_branch	*b;
-
-    while ((b = branch)) {
-	branch = b->next;
-	free(b);
-    }
-}
-
-static void
-cvs_version_free(cvs_version *version)
-/* discard all master versions from this CVS context */
-{
-    cvs_version	*v;
-
-    while ((v = version)) {
-	version = v->next;
-	cvs_branch_free(v->branches);
-	free(v);
-    }
-}
-
-static void
-cvs_patch_free(cvs_patch *patch)
-/* discard all master patches from this CVS context */
-{
-    cvs_patch	*v;
-
-    while ((v = patch)) {
-	patch = v->next;
-	free(v);
-    }
-}
-
 void
 generator_free(generator_t *gen)
 {
-    cvs_version_free(gen->versions);
-    cvs_patch_free(gen->patches);
+    /* versions, patches and branches live in the node arena */
+    gen->versions = NULL;
+    gen->patches = NULL;
     clean_hash(&gen->nodehash);
 }
 
@@ -2,63 +2,80 @@
  * Designed to be included in revdir.c
  */
 
-#define REV_DIR_HASH	393241
-
 struct _file_list {
     /* a directory containing a collection of file states */
-    serial_t   nfiles;
-    cvs_commit *files[0];
+    serial_t    nfiles;
+    pack_file_t files[0];
 };
 
 typedef struct _file_list_hash {
-    struct _file_list_hash *next;
     hash_t	           hash;
     file_list		   fl;
 } file_list_hash;
 
-static file_list_hash	*buckets[REV_DIR_HASH];
+typedef struct _file_list_key {
+    const pack_file_t	*files;
+    int			nfiles;
+} file_list_key;
 
 static hash_t
-hash_files(const cvs_commit *const * const files, const int nfiles)
+hash_files(const pack_file_t * const files, const int nfiles)
 /* hash a file list so we can recognize it cheaply */
 {
-    hash_t h = 0;
+    HASH_INIT(h);
     size_t i;
-    /* Combine existing hashes rather than computing new ones */
+    /* the packed entries themselves, so no commit is dereferenced */
     for (i = 0; i < nfiles; i++)
-	h = HASH_COMBINE(h, files[i]->hash);
+	HASH_MIX_WORD(h, files[i]);
 
     return h;
 }
 
+static hash_t
+pack_entry_hash(const void *entry)
+{
+    return ((const file_list_hash *)entry)->hash;
+}
+
+static bool
+pack_entry_match(const void *entry, const void *key)
+{
+    const file_list_hash *h = entry;
+    const file_list_key *k = key;
+
+    return h->fl.nfiles == k->nfiles &&
+	!memcmp(k->files, h->fl.files, k->nfiles * sizeof(pack_file_t));
+}
+
+static void
+pack_entry_free(void *entry)
+{
+    free(entry);
+}
+
 static file_list *
-pack_file_list(const cvs_commit * const * const files, const int nfiles)
+pack_file_list(const pack_file_t * const files, const int nfiles)
 /* pack a collection of file revisions for space efficiency */
 {
     hash_t         hash = hash_files(files, nfiles);
-    file_list_hash **bucket = &buckets[hash % REV_DIR_HASH];
+    file_list_key  key = {files, nfiles};
     file_list_hash *h;
 
     /* avoid packing a file list if we've done it before */ 
-    for (h = *bucket; h; h = h->next) {
-	if (h->hash == hash && h->fl.nfiles == nfiles &&
-	    !memcmp(files, h->fl.files, nfiles * sizeof(cvs_commit *)))
-	{
-	    return &h->fl;
-	}
-    }
-    h = xmalloc(sizeof(file_list_hash) + nfiles * sizeof(cvs_commit *),
-		 __func__);
-    h->next = *bucket;
-    *bucket = h;
+    if ((h = pack_find(hash, &key)) != NULL)
+	return &h->fl;
+    h = xmalloc(sizeof(file_list_hash) + nfiles * sizeof(pack_file_t),
+		__func__);
     h->hash = hash;
     h->fl.nfiles = nfiles;
-    memcpy(h->fl.files, files, nfiles * sizeof(cvs_commit *));
+    memcpy(h->fl.files, files, nfiles * sizeof(pack_file_t));
+    h = pack_insert(hash, &key, h);
     return &h->fl;
 }
 
-static size_t    sdirs = 0;
-static file_list **dirs = NULL;
+/* pack buffers are per thread, so branches can be collated in parallel */
+static THREAD_LOCAL size_t    sdirs = 0;
+static THREAD_LOCAL file_list **dirs = NULL;
 
 static void
 fl_put(const size_t index, file_list *fl)
@@ -76,21 +93,6 @@ fl_put(const size_t index, file_list *fl)
     dirs[index] = fl;
 }
 
-void
-revdir_free(void)
-{
-    size_t i;
-    for (i = 0; i < REV_DIR_HASH; i++) {
-	file_list_hash  **bucket = &buckets[i];
-	file_list_hash	*h;
-
-	while ((h = *bucket)) {
-	    *bucket = h->next;
-	    free(h);
-	}
-    }
-}
-
 void
 revdir_free_bufs(void)
 {
@@ -104,8 +106,8 @@ revdir_free_bufs(void)
 struct _revdir_iter {
     file_list * const *dir;
     file_list * const *dirmax;
-    cvs_commit **file;
-    cvs_commit **filemax;
+    const pack_file_t *file;
+    const pack_file_t *filemax;
 } file_iter;
 
 /* Iterator interface */
@@ -114,8 +116,10 @@ revdir_iter_next(revdir_iter *it) {
     if (it->dir == it->dirmax)
         return NULL;
 again:
-    if (it->file != it->filemax)
-	return *it->file++;
+    if (it->file != it->filemax) {
+	it->file++;
+	return UNPACK_FILE(it->file[-1]);
+    }
     ++it->dir;
     if (it->dir == it->dirmax)
         return NULL;
@@ -132,8 +136,10 @@ revdir_iter_next_dir(revdir_iter *it) {
 	return NULL;
     it->file = (*it->dir)->files;
     it->filemax = it->file + (*it->dir)->nfiles;
-    if (it->file != it->filemax)
-	return *it->file++;
+    if (it->file != it->filemax) {
+	it->file++;
+	return UNPACK_FILE(it->file[-1]);
+    }
     goto again;
 }
 
@@ -163,6 +169,47 @@ revdir_iter_alloc(const revdir *revdir)
     return it;
 }
 
+void
+revdir_diff(const revdir *old, const revdir *new,
+	    revdir_diff_fn *fn, void *arg)
+/* report the files that differ between two revdirs, in path order */
+{
+    revdir_iter old_it, new_it;
+    cvs_commit *o = NULL, *n;
+
+    revdir_iter_start(&new_it, new);
+    n = revdir_iter_next(&new_it);
+    if (old) {
+	revdir_iter_start(&old_it, old);
+	o = revdir_iter_next(&old_it);
+    }
+    while (o && n) {
+	/* If we're in the same packed directory then skip it */
+	if (revdir_iter_same_dir(&new_it, &old_it)) {
+	    o = revdir_iter_next_dir(&old_it);
+	    n = revdir_iter_next_dir(&new_it);
+	} else if (o == n) {
+	    o = revdir_iter_next(&old_it);
+	    n = revdir_iter_next(&new_it);
+	} else if (o->master == n->master) {
+	    fn(o, n, arg);
+	    o = revdir_iter_next(&old_it);
+	    n = revdir_iter_next(&new_it);
+	} else if (o->master < n->master) {
+	    /* masters are sorted in fileop order */
+	    fn(o, NULL, arg);
+	    o = revdir_iter_next(&old_it);
+	} else {
+	    fn(NULL, n, arg);
+	    n = revdir_iter_next(&new_it);
+	}
+    }
+    for (; o; o = revdir_iter_next(&old_it))
+	fn(o, NULL, arg);
+    for (; n; n = revdir_iter_next(&new_it))
+	fn(NULL, n, arg);
+}
+
 serial_t
 revdir_nfiles(const revdir *revdir)
 {
@@ -172,21 +219,21 @@ revdir_nfiles(const revdir *revdir)
     return c;
 }
 
-static serial_t         nfiles = 0;
-static serial_t         sfiles = 0;
-static const cvs_commit **files = NULL;
-static const master_dir *dir;
-static const master_dir *curdir;
-static unsigned short   ndirs;
+static THREAD_LOCAL serial_t         nfiles = 0;
+static THREAD_LOCAL serial_t         sfiles = 0;
+static THREAD_LOCAL pack_file_t      *files = NULL;
+static THREAD_LOCAL const master_dir *dir;
+static THREAD_LOCAL const master_dir *curdir;
+static THREAD_LOCAL unsigned short   ndirs;
 
 void
 revdir_pack_alloc(const size_t max_size)
 {
     if (!files) {
-	files = xmalloc(max_size * sizeof(cvs_commit *), __func__);
+	files = xmalloc(max_size * sizeof(pack_file_t), __func__);
 	sfiles = max_size;
     } else if (sfiles < max_size) {
-	files = xrealloc(files, max_size * sizeof(cvs_commit *), __func__);
+	files = xrealloc(files, max_size * sizeof(pack_file_t), __func__);
 	sfiles = max_size;
     }
 }
@@ -214,7 +261,7 @@ revdir_pack_add(const cvs_commit *file, const master_dir *in_dir)
 	}
 	curdir = in_dir;
     }
-    files[nfiles++] = file;
+    files[nfiles++] = PACK_FILE(file);
 }
 
 void
@@ -239,17 +286,13 @@ revdir_pack_free()
 }
 
 void
-revdir_pack_files(const cvs_commit ** files, 
-		  const size_t nfiles, revdir *revdir)
+revdir_pack_files(const cvs_commit **files, const size_t nfiles, revdir *revdir)
 {
-    size_t           start = 0, i;
-    const master_dir *curdir = NULL, *dir = NULL;
-    file_list        *fl;
-    unsigned short   ndirs = 0;
+    size_t i;
 #ifdef ORDERDEBUG
     fputs("Packing:\n", stderr);
     {
-	cvs_commit **s;
+	const cvs_commit **s;
 	for (s = files; s < files + nfiles; s++)
 	    fprintf(stderr, "cvs_commit: %s\n", (*s)->master->name);
     }
@@ -264,28 +307,14 @@ revdir_pack_files(const cvs_commit ** files,
      * That used to be done with a qsort(3) call here, but sorting the
      * masters at the input stage causes them to come out in the right
      * order here, without multiple additional sorts.
+     *
+     * The file lists are cut at the same directory changes as
+     * revdir_pack_add() makes, so use that.
      */
-    /* pull out directories */
-    for (i = 0; i < nfiles; i++) {
-	/* avoid strncmp as much as possible */
-	if (curdir != files[i]->dir) {
-	    if (!dir_is_ancestor(files[i]->dir, dir)) {
-		if (i > start) {
-		    fl = pack_file_list(files + start, i - start);
-		    fl_put(ndirs++, fl);
-		    start = i;
-		}
-		dir = files[i]->dir;
-	    }
-	    curdir = files[i]->dir;
-	}
-    }
-    if (dir) {
-        fl = pack_file_list(files + start, nfiles - start);
-        fl_put(ndirs++, fl);
-    }
-    
-    revdir->dirs = xmalloc(ndirs * sizeof(file_list *), "rev_dir");
-    revdir->ndirs = ndirs;
-    memcpy(revdir->dirs, dirs, ndirs * sizeof(file_list *));
+    revdir_pack_alloc(nfiles);
+    revdir_pack_init();
+    for (i = 0; i < nfiles; i++)
+	revdir_pack_add(files[i], files[i]->dir);
+    revdir_pack_end(revdir);
+    revdir_pack_free();
 }
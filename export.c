@@ -10,11 +10,21 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <ftw.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif /* __linux__ */
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
 
 #include "cvs.h"
 #include "revdir.h"
+#include "hash.h"
+#include "cvs-fast-export.h"
 /*
  * If a program has ever invoked pthreads, the GNU C library does extra
  * checking during stdio operations even if the program no longer has
@@ -41,6 +51,17 @@
  */
 #define SMALL_REPOSITORY	1000000
 
+/* Blobs at least this big are copied out of the pack with sendfile(2) */
+#define BLOBPACK_SENDFILE_MIN	65536
+
+/*
+ * Fast-mode blobs at least this big bypass stdio and go to the kernel
+ * straight from the snapshot buffer with writev(2); smaller ones, and
+ * all the commit metadata, are batched through a large stdio buffer.
+ */
+#define DIRECT_WRITE_MIN	65536
+#define OUTPUT_BUFFER_DEFAULT	(1024 * 1024)
+
 /*
  * This code is somewhat complex because the natural order of operations
  * generated by the file-traversal operations in the rest of the code is
@@ -52,19 +73,127 @@
 static serial_t *markmap;
 static serial_t mark;
 static volatile int seqno;
-static char blobdir[PATH_MAX];
+
+/*
+ * In canonical mode blobs are appended to a single unlinked pack file
+ * and found again through an index by serial, so random access costs
+ * a pread() rather than creating, reopening and removing one file per
+ * blob.
+ */
+typedef struct _blob_slot {
+    off_t	offset;
+    size_t	length;
+    serial_t	dup;	/* earlier blob with the same content, or 0 */
+    serial_t	mark;	/* mark the content went out under, once it has */
+} blob_slot_t;
+
+static int blobpack = -1;
+static volatile off_t blobpack_end;
+static blob_slot_t *blobindex;
 
 static export_stats_t export_stats;
+static char *output_buffer;
+
+/*
+ * With --dedup-blobs, snapshots are fingerprinted and a snapshot whose
+ * content has been seen before is not shipped again.  In fast mode the
+ * table maps content to the mark it was first emitted under; in
+ * canonical mode it maps content to the serial of the first blob
+ * packed with it, and later ones become aliases of that slot.  The
+ * first copy is usually gone by then, so there is nothing to compare
+ * against: the fingerprint is SHA-256, as a match has to mean the
+ * content is the same even when a master was crafted to collide.
+ */
+typedef struct _dedup_entry {
+    hash_strong_t	digest;
+    size_t		length;
+    serial_t		value;		/* 0 marks an empty slot */
+} dedup_entry_t;
+
+static dedup_entry_t *dedup_table;
+static size_t dedup_size, dedup_count;
+#ifdef THREADS
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* THREADS */
+
+static dedup_entry_t *dedup_slot(const hash_strong_t *digest, const size_t length)
+/* find the slot for some content, growing the table as needed */
+{
+    dedup_entry_t *e;
+    uint64_t start;
+    size_t i;
+
+    if (dedup_count * 2 >= dedup_size) {
+	dedup_entry_t *old = dedup_table;
+	size_t oldsize = dedup_size;
+
+	dedup_size = dedup_size ? dedup_size * 2 : 4096;
+	dedup_table = xcalloc(dedup_size, sizeof(dedup_entry_t), "dedup table");
+	for (i = 0; i < oldsize; i++)
+	    if (old[i].value != 0) {
+		e = dedup_slot(&old[i].digest, old[i].length);
+		*e = old[i];
+	    }
+	free(old);
+    }
+    memcpy(&start, digest->bytes, sizeof(start));
+    for (i = start & (dedup_size - 1);; i = (i + 1) & (dedup_size - 1)) {
+	e = &dedup_table[i];
+	if (e->value == 0
+	    || (e->length == length
+		&& memcmp(e->digest.bytes, digest->bytes, sizeof(digest->bytes)) == 0))
+	    return e;
+    }
+}
+
+static serial_t dedup_lookup(const hash_strong_t *digest, const size_t length,
+			     const serial_t value)
+/* return the value recorded for this content, recording value if none */
+{
+    dedup_entry_t *e;
+    serial_t found;
+
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_lock(&dedup_mutex);
+#endif /* THREADS */
+    e = dedup_slot(digest, length);
+    if ((found = e->value) == 0) {
+	e->digest = *digest;
+	e->length = length;
+	e->value = value;
+	dedup_count++;
+    }
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_unlock(&dedup_mutex);
+#endif /* THREADS */
+    return found;
+}
+
+#ifdef THREADS
+static pthread_mutex_t seqno_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* THREADS */
 
 static int seqno_next(void)
 /* Returns next sequence number, starting with 1 */
 {
-    ++seqno;
-
-    if (seqno >= MAX_SERIAL_T)
+    int next;
+
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_lock(&seqno_mutex);
+#endif /* THREADS */
+    next = ++seqno;
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_unlock(&seqno_mutex);
+#endif /* THREADS */
+
+    if (next >= MAX_SERIAL_T)
 	fatal_error("snapshot sequence number too large, widen serial_t");
 
-    return seqno;
+    return next;
 }
 
 /*
@@ -75,118 +204,508 @@ static int seqno_next(void)
  */
 #define CVS_IGNORES "# CVS default ignores begin\ntags\nTAGS\n.make.state\n.nse_depinfo\n*~\n\\#*\n.#*\n,*\n_$*\n*$\n*.old\n*.bak\n*.BAK\n*.orig\n*.rej\n.del-*\n*.a\n*.olb\n*.o\n*.obj\n*.so\n*.exe\n*.Z\n*.elc\n*.ln\ncore\n# CVS default ignores end\n"
 
-static char *blobfile(const char *basename,
-		      const int serial,
-		      const bool create, char *path)
-/* Random-access location of the blob corresponding to the specified serial */
+static void blob_digest(const void *buf, const size_t len, const size_t extralen,
+			hash_strong_t *digest)
+/* fingerprint a blob body; the only possible prefix is CVS_IGNORES */
 {
-    int m;
+    hash_strong_ctx_t ctx;
+
+    hash_strong_init(&ctx);
+    hash_strong_update(&ctx, CVS_IGNORES, extralen);
+    hash_strong_update(&ctx, buf, len);
+    hash_strong_final(&ctx, digest);
+}
+
+static void blobpack_write(const serial_t serial,
+			   const void *prefix, const size_t prefixlen,
+			   const void *buf, const size_t len)
+/* append a formatted blob to the pack, recording where it went */
+{
+    struct iovec iov[3];
+    size_t total = prefixlen + len + 1;
+    off_t offset;
+
+#ifdef THREADS
+    if (threads > 1)
+	offset = __atomic_fetch_add(&blobpack_end, total, __ATOMIC_RELAXED);
+    else
+#endif /* THREADS */
+    {
+	offset = blobpack_end;
+	blobpack_end += total;
+    }
+    iov[0].iov_base = (void *)prefix;
+    iov[0].iov_len = prefixlen;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+    if (pwritev(blobpack, iov, 3, offset) != (ssize_t)total)
+	fatal_system_error("blob pack write");
+    blobindex[serial].offset = offset;
+    blobindex[serial].length = total;
+}
 
-#ifdef FDEBUG
-    (void)fprintf(stderr, "-> blobfile(%d, %d)...\n", serial, create);
-#endif /* FDEBUG */
-    (void)snprintf(path, PATH_MAX, "%s", blobdir);
+static void copy_out(const int fd, off_t offset, size_t left)
+/* ship a byte range of a file to standard output */
+{
+#ifdef __linux__
     /*
-     * FANOUT should be chosen to be the largest directory size that does not
-     * cause slow secondary allocations.  It's something near 256 on ext4
-     * (we think...)
+     * Big blobs go kernel-side; the stdio buffer has to be flushed
+     * first so the stream stays in order.
      */
-#define FANOUT	256
-    for (m = serial;;)
-    {
-	int digit = m % FANOUT;
-	if ((m = (m - digit) / FANOUT) == 0) {
-	    (void)snprintf(path + strlen(path), PATH_MAX - strlen(path),
-			   "/=%x", digit);
-#ifdef FDEBUG
-	    (void)fprintf(stderr, "path: %s\n", path);
-#endif /* FDEBUG */
-	    break;
+    if (left >= BLOBPACK_SENDFILE_MIN) {
+	fflush(stdout);
+	while (left > 0) {
+	    ssize_t sent = sendfile(fileno(stdout), fd, &offset, left);
+	    if (sent <= 0)
+		break;	/* e.g. EINVAL on old kernels; finish with pread */
+	    left -= sent;
 	}
-	else
-	{
-	    (void)snprintf(path + strlen(path), PATH_MAX - strlen(path),
-			   "/%x", digit);
-	    /* coverity[toctou] */
-#ifdef FDEBUG
-	    (void)fprintf(stderr, "directory: %s\n", path);
-#endif /* FDEBUG */
-	    if (create && access(path, R_OK) != 0) {
-#ifdef FDEBUG
-		(void)fprintf(stderr, "directory: %s\n", path);
-#endif /* FDEBUG */
-		errno = 0;
-		if (mkdir(path,S_IRWXU | S_IRWXG) != 0 && errno != EEXIST)
-		    fatal_error("blob subdir creation of %s failed: %s (%d)\n", path, strerror(errno), errno);
-	    }
+    }
+#endif /* __linux__ */
+    while (left > 0) {
+	char buf[BUFSIZ];
+	size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+	ssize_t got = pread(fd, buf, chunk, offset);
+	if (got <= 0)
+	    fatal_system_error("blob copy read");
+	(void)fwrite(buf, 1, got, stdout);
+	offset += got;
+	left -= got;
+    }
+}
+
+static void sink_blob(const cfe_sink_t *sink, const cvs_commit *c,
+		      const serial_t mark, const void *prefix, const size_t prefixlen,
+		      const void *data, const size_t len)
+/* hand a blob to a library consumer */
+{
+    char rev[CVS_MAX_REV_LEN + 1];
+    cfe_blob_t blob;
+
+    if (sink->blob == NULL)
+	return;
+    blob.mark = mark;
+    blob.path = c->master->fileop_name;
+    blob.revision = cvs_number_string(c->number, rev, sizeof(rev));
+    blob.prefix = prefixlen > 0 ? prefix : NULL;
+    blob.prefixlen = prefixlen;
+    blob.data = data;
+    blob.len = len;
+    sink->blob(sink->context, &blob);
+}
+
+/* a stored blob read back for a library consumer */
+static char *stored_image;
+static size_t stored_image_size;
+
+static void ship_stored(const export_options_t *opts, const cvs_commit *c,
+			const serial_t mark, const int fd, off_t offset,
+			const size_t length)
+/* ship a blob set aside as a data header, body and newline */
+{
+    const char *body;
+    size_t got, extralen = 0;
+
+    if (opts->sink == NULL) {
+	printf("blob\nmark :%d\n", mark);
+	copy_out(fd, offset, length);
+	return;
+    }
+    if (length > stored_image_size) {
+	free(stored_image);
+	stored_image = xmalloc(stored_image_size = length, "stored blob");
+    }
+    for (got = 0; got < length; ) {
+	ssize_t n = pread(fd, stored_image + got, length - got, offset + got);
+	if (n <= 0)
+	    fatal_system_error("blob copy read");
+	got += n;
+    }
+    /* split the prefix back out, as export_blob() hands it over directly */
+    if (strcmp(c->master->name, ".cvsignore") == 0)
+	extralen = sizeof(CVS_IGNORES) - 1;
+    body = (const char *)memchr(stored_image, '\n', length) + 1;
+    sink_blob(opts->sink, c, mark, body, extralen, body + extralen,
+	      stored_image + length - 1 - body - extralen);
+}
+
+static void stdout_writev(struct iovec *iov, int iovcnt)
+/* write an iovec to standard output behind anything stdio holds */
+{
+    fflush(stdout);
+    while (iovcnt > 0) {
+	ssize_t sent = writev(fileno(stdout), iov, iovcnt);
+	if (sent < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fatal_system_error("writing to standard output");
+	}
+	/* skip what went out, resuming partway into an element if need be */
+	while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+	    sent -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + sent;
+	    iov->iov_len -= sent;
 	}
     }
-#undef FANOUT
-#ifdef FDEBUG
-    (void)fprintf(stderr, "<- ...returned path for %s %d = %s\n",
-		  basename, serial, path);
-#endif /* FDEBUG */
-    return path;
 }
 
+#ifdef THREADS
+/*
+ * Threaded snapshot generation.  Each generator_t carries its own
+ * editbuffer_t, so delta playback for different masters can run
+ * concurrently; what has to be serialized is the allocation of serial
+ * numbers and marks and, in fast mode, the output stream itself.
+ *
+ * In canonical mode blobs go to per-serial files in the blob directory
+ * and marks are not assigned until export_commit() time, so workers
+ * can write them directly.  In fast mode a worker formats the blobs of
+ * its master into a spool file; the main thread drains the spools in
+ * master order, assigning serials and marks as it goes.  The output
+ * is thus identical to a sequential run.  At most SNAPSHOT_WINDOW
+ * masters can be in flight or awaiting emission at once, which bounds
+ * the number of spool files and lets them be recycled by index.
+ */
+#define SNAPSHOT_WINDOW	(4 * threads)
+
+typedef struct _snapshot_spool {
+    FILE	*fp;		/* formatted blob bodies, in generation order */
+    cvs_commit	**commits;	/* commit owning each spooled blob */
+    size_t	*lengths;	/* length of each spooled blob body */
+    hash_strong_t *digests;	/* fingerprint of each, with --dedup-blobs */
+    size_t	count, alloc;
+    double	snapsize;
+} snapshot_spool_t;
+
+typedef struct _snapshot_worker {
+    snapshot_spool_t	*spool;	/* NULL when blobs may be written directly */
+    double		snapsize;
+    export_options_t	*opts;
+} snapshot_worker_t;
+
+static pthread_key_t   worker_key;
+static pthread_mutex_t schedule_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  schedule_cond = PTHREAD_COND_INITIALIZER;
+static generator_t     *snap_generators;
+static snapshot_spool_t *snap_spools;
+static bool            *snap_done;
+static size_t          snap_next, snap_emitted, snap_n, snap_window;
+
+static void spool_blob(snapshot_spool_t *spool, cvs_commit *commit,
+		       const void *buf, const size_t len, const size_t extralen,
+		       const bool dedup)
+/* save a formatted blob body for later emission in master order */
+{
+    char header[32];
+    int hlen = snprintf(header, sizeof(header), "data %zd\n", len + extralen);
+
+    if (spool->fp == NULL && (spool->fp = tmpfile()) == NULL)
+	fatal_system_error("snapshot spool creation");
+    if (spool->count >= spool->alloc) {
+	spool->alloc += 1024;
+	spool->commits = xrealloc(spool->commits,
+				  spool->alloc * sizeof(cvs_commit *), __func__);
+	spool->lengths = xrealloc(spool->lengths,
+				  spool->alloc * sizeof(size_t), __func__);
+	if (dedup)
+	    spool->digests = xrealloc(spool->digests,
+				      spool->alloc * sizeof(hash_strong_t), __func__);
+    }
+    if (dedup)
+	blob_digest(buf, len, extralen, &spool->digests[spool->count]);
+    fwrite(header, hlen, sizeof(char), spool->fp);
+    if (extralen > 0)
+	fwrite(CVS_IGNORES, extralen, sizeof(char), spool->fp);
+    fwrite(buf, len, sizeof(char), spool->fp);
+    fputc('\n', spool->fp);
+    spool->commits[spool->count] = commit;
+    spool->lengths[spool->count++] = hlen + extralen + len + 1;
+    spool->snapsize += len;
+}
+#endif /* THREADS */
+
 static void export_blob(node_t *node, 
 			void *buf, const size_t len,
 			export_options_t *opts)
 /* output the blob, or save where it will be available for random access */
 {
     size_t extralen = 0;
+#ifdef THREADS
+    snapshot_worker_t *worker = NULL;
 
-    export_stats.snapsize += len;
+    if (threads > 1)
+	worker = pthread_getspecific(worker_key);
+#endif /* THREADS */
 
+    if (buf == NULL)
+	return;		/* a dead revision; nothing to ship */
     if (strcmp(node->commit->master->name, ".cvsignore") == 0) {
 	extralen = sizeof(CVS_IGNORES) - 1;
     }
 
+    if (opts->import_marks != NULL) {
+	serial_t known = marks_find_blob(node->commit);
+
+	/* shipped by an earlier run, so only its mark is needed */
+	if (known != 0) {
+	    node->commit->serial = seqno_next();
+	    if (opts->reportmode == fast) {
+		markmap[node->commit->serial] = known;
+		marks_note_blob(node->commit, known);
+	    } else
+		blobindex[node->commit->serial].mark = known;
+	    return;
+	}
+    }
+
+#ifdef THREADS
+    if (worker != NULL) {
+	if (worker->spool != NULL) {
+	    spool_blob(worker->spool, node->commit, buf, len, extralen,
+		       opts->dedup_blobs);
+	    return;
+	}
+	worker->snapsize += len;
+    }
+    else
+#endif /* THREADS */
+	export_stats.snapsize += len;
+
     node->commit->serial = seqno_next();
     if (opts->reportmode == fast) {
+	char header[64];
+	int hlen;
+
+	if (opts->dedup_blobs) {
+	    hash_strong_t digest;
+	    serial_t first;
+
+	    blob_digest(buf, len, extralen, &digest);
+	    if ((first = dedup_lookup(&digest, len + extralen, mark + 1)) != 0) {
+		markmap[node->commit->serial] = first;
+		marks_note_blob(node->commit, first);
+		export_stats.export_duplicate_blobs++;
+		return;
+	    }
+	}
 	markmap[node->commit->serial] = ++mark;
-	printf("blob\nmark :%d\n", mark);
-	fprintf(stdout, "data %zd\n", len + extralen);
-	if (extralen > 0)
-	    fwrite(CVS_IGNORES, extralen, sizeof(char), stdout);
-	fwrite(buf, len, sizeof(char), stdout);
-	fputc('\n', stdout);
+	marks_note_blob(node->commit, mark);
+	if (opts->sink != NULL) {
+	    /* straight from the snapshot buffer */
+	    sink_blob(opts->sink, node->commit, mark, CVS_IGNORES, extralen, buf, len);
+	    return;
+	}
+	hlen = snprintf(header, sizeof(header),
+			"blob\nmark :%d\ndata %zd\n", mark, len + extralen);
+	if (len >= DIRECT_WRITE_MIN) {
+	    struct iovec iov[4];
+
+	    iov[0].iov_base = header;
+	    iov[0].iov_len = hlen;
+	    iov[1].iov_base = CVS_IGNORES;
+	    iov[1].iov_len = extralen;
+	    iov[2].iov_base = buf;
+	    iov[2].iov_len = len;
+	    iov[3].iov_base = "\n";
+	    iov[3].iov_len = 1;
+	    stdout_writev(iov, 4);
+	} else {
+	    fwrite(header, hlen, sizeof(char), stdout);
+	    if (extralen > 0)
+		fwrite(CVS_IGNORES, extralen, sizeof(char), stdout);
+	    fwrite(buf, len, sizeof(char), stdout);
+	    fputc('\n', stdout);
+	}
     }
     else
     {
-	FILE *wfp;
+	char prefix[32 + sizeof(CVS_IGNORES)];
+	int plen;
+
+	if (opts->dedup_blobs) {
+	    hash_strong_t digest;
+	    serial_t first;
+
+	    blob_digest(buf, len, extralen, &digest);
+	    first = dedup_lookup(&digest, len + extralen, node->commit->serial);
+	    if (first != 0) {
+		/* slots are finished by emission time, so just point back */
+		blobindex[node->commit->serial].dup = first;
+		__atomic_add_fetch(&export_stats.export_duplicate_blobs, 1,
+				   __ATOMIC_RELAXED);
+		return;
+	    }
+	}
+	plen = snprintf(prefix, 32, "data %zd\n", len + extralen);
 
-	char path[PATH_MAX];
-	blobfile(node->commit->master->name, node->commit->serial, true, path);
-	wfp = fopen(path, "w");
+	memcpy(prefix + plen, CVS_IGNORES, extralen);
+	blobpack_write(node->commit->serial, prefix, plen + extralen, buf, len);
+    }
+}
 
-	if (wfp == NULL)
-	    fatal_error("blobfile open of %s: %s (%d)", 
-			path, strerror(errno), errno);
-	fprintf(wfp, "data %zd\n", len + extralen);
-	if (extralen > 0)
-	    fwrite(CVS_IGNORES, extralen, sizeof(char), wfp);
-	fwrite(buf, len, sizeof(char), wfp);
-	fputc('\n', wfp);
-	(void)fclose(wfp);
+static void generate_master(generator_t *gen, export_options_t *opts)
+/* export a master's snapshots, from its deltas or from a shard */
+{
+    if (gen->shard != NULL)
+	shard_replay(gen, opts, export_blob);
+    else {
+	unspill_generator(gen);
+	generate_files(gen, opts, export_blob);
     }
+    generator_free(gen);
 }
 
-static int unlink_cb(const char *fpath, 
-		     const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+#ifdef THREADS
+static void spool_emit(snapshot_spool_t *spool, const export_options_t *opts)
+/* ship the spooled blobs of one master, then reset the spool for reuse */
 {
-    int rv = remove(fpath);
+    off_t offset = 0;
+    size_t i;
+
+    if (spool->count == 0)
+	return;
+    if (fflush(spool->fp) != 0)
+	fatal_system_error("snapshot spool flush");
+    for (i = 0; i < spool->count; i++) {
+	spool->commits[i]->serial = seqno_next();
+	if (spool->digests != NULL) {
+	    /* the length has the data header in it, so it is as good a key */
+	    serial_t first = dedup_lookup(&spool->digests[i],
+					  spool->lengths[i], mark + 1);
+	    if (first != 0) {
+		markmap[spool->commits[i]->serial] = first;
+		marks_note_blob(spool->commits[i], first);
+		export_stats.export_duplicate_blobs++;
+		offset += spool->lengths[i];
+		continue;
+	    }
+	}
+	markmap[spool->commits[i]->serial] = ++mark;
+	marks_note_blob(spool->commits[i], mark);
+	ship_stored(opts, spool->commits[i], mark, fileno(spool->fp),
+		    offset, spool->lengths[i]);
+	offset += spool->lengths[i];
+    }
+    export_stats.snapsize += spool->snapsize;
+    spool->snapsize = 0;
+    spool->count = 0;
+    rewind(spool->fp);
+    if (ftruncate(fileno(spool->fp), 0) != 0)
+	fatal_system_error("snapshot spool truncation");
+}
 
-    if (rv)
-        perror(fpath);
+static void *snapshot_worker(void *arg)
+/* consume generators off the queue, playing back their deltas */
+{
+    snapshot_worker_t *self = (snapshot_worker_t *)arg;
+    size_t i;
+
+    pthread_setspecific(worker_key, self);
+    for (;;) {
+	pthread_mutex_lock(&schedule_mutex);
+	while (snap_next < snap_n && snap_next >= snap_emitted + snap_window)
+	    pthread_cond_wait(&schedule_cond, &schedule_mutex);
+	i = snap_next++;
+	pthread_mutex_unlock(&schedule_mutex);
+	if (i >= snap_n) {
+	    stats_thread_done(PHASE_SNAPSHOTS);
+	    return NULL;
+	}
+
+	self->spool = snap_spools ? &snap_spools[i % snap_window] : NULL;
+	generate_master(&snap_generators[i], self->opts);
+
+	pthread_mutex_lock(&schedule_mutex);
+	snap_done[i] = true;
+	pthread_cond_broadcast(&schedule_cond);
+	pthread_mutex_unlock(&schedule_mutex);
+    }
+}
+
+static void generate_snapshots_threaded(forest_t *forest, export_options_t *opts)
+/* run snapshot generation over the thread pool, shipping in master order */
+{
+    pthread_t *workers = xcalloc(threads, sizeof(pthread_t), __func__);
+    snapshot_worker_t *state = xcalloc(threads, sizeof(snapshot_worker_t), __func__);
+    size_t i;
+
+    snap_generators = forest->generators;
+    snap_n = forest->filecount;
+    snap_next = snap_emitted = 0;
+    snap_done = xcalloc(snap_n + 1, sizeof(bool), __func__);
+    if (opts->reportmode == fast) {
+	snap_window = SNAPSHOT_WINDOW;
+	snap_spools = xcalloc(snap_window, sizeof(snapshot_spool_t), __func__);
+    } else {
+	/* blobs go straight to the blob directory, nothing to bound */
+	snap_window = snap_n;
+	snap_spools = NULL;
+    }
+
+    pthread_key_create(&worker_key, NULL);
+    for (i = 0; i < threads; i++) {
+	state[i].opts = opts;
+	pthread_create(&workers[i], NULL, snapshot_worker, &state[i]);
+    }
+
+    for (i = 0; i < snap_n; i++) {
+	pthread_mutex_lock(&schedule_mutex);
+	while (!snap_done[i])
+	    pthread_cond_wait(&schedule_cond, &schedule_mutex);
+	pthread_mutex_unlock(&schedule_mutex);
 
-    return rv;
+	if (snap_spools != NULL)
+	    spool_emit(&snap_spools[i % snap_window], opts);
+
+	pthread_mutex_lock(&schedule_mutex);
+	snap_emitted = i + 1;
+	pthread_cond_broadcast(&schedule_cond);
+	pthread_mutex_unlock(&schedule_mutex);
+	progress_jump(i + 1);
+    }
+
+    for (i = 0; i < threads; i++) {
+	pthread_join(workers[i], NULL);
+	export_stats.snapsize += state[i].snapsize;
+    }
+    pthread_key_delete(worker_key);
+
+    if (snap_spools != NULL) {
+	for (i = 0; i < snap_window; i++) {
+	    if (snap_spools[i].fp != NULL)
+		fclose(snap_spools[i].fp);
+	    free(snap_spools[i].commits);
+	    free(snap_spools[i].lengths);
+	    free(snap_spools[i].digests);
+	}
+	free(snap_spools);
+	snap_spools = NULL;
+    }
+    free(snap_done);
+    free(state);
+    free(workers);
 }
+#endif /* THREADS */
 
 static void cleanup(const export_options_t *opts)
 {
-    if (opts->reportmode == canonical)
-        nftw(blobdir, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+    if (blobpack != -1) {
+	(void)close(blobpack);
+	blobpack = -1;
+    }
+    free(blobindex);
+    blobindex = NULL;
+    free(dedup_table);
+    dedup_table = NULL;
+    dedup_size = dedup_count = 0;
+    free(stored_image);
+    stored_image = NULL;
+    stored_image_size = 0;
 }
 
 static const char *utc_offset_timestamp(const time_t *timep, const char *tz)
@@ -302,22 +821,144 @@ append_revpair(cvs_commit *c, const export_options_t *opts,
     }
 }
 
-static revdir_iter *commit_iter = NULL;
-static revdir_iter *parent_iter = NULL;
-
 static void
 build_delete_op(cvs_commit *c, struct fileop *op)
 {
     op->op = 'D';
     op->path = c->master->fileop_name;
 }
+
+typedef struct _fileop_list {
+    /* fileops being gathered for a commit by add_fileop() */
+    const export_options_t *opts;
+    struct fileop *operations, *op;
+    int noperations;
+    char *revpairs;
+    size_t revpairsize;
+} fileop_list_t;
+
 static void
-export_commit(git_commit *commit, const char *branch,
+add_fileop(cvs_commit *old, cvs_commit *new, void *arg)
+/* turn a file difference between parent and child into a fileop */
+{
+    fileop_list_t *ops = arg;
+
+    if (new == NULL)
+	/* parent but no child, delete op */
+	build_delete_op(old, ops->op);
+    else {
+	/* changed or added in child, modify op */
+	build_modify_op(new, ops->op);
+	append_revpair(new, ops->opts, &ops->revpairs, &ops->revpairsize);
+    }
+    ops->op = next_op_slot(&ops->operations, ops->op, &ops->noperations);
+}
+
+static char *
+commit_key(const git_commit *commit, const char *branch,
+	   const struct fileop *operations, const struct fileop *end,
+	   size_t *keylen)
+/* what identifies a commit from one run to the next, for the marks file */
+{
+    size_t len, alloc = 256;
+    char *key = xmalloc(alloc, "commit key");
+    const struct fileop *op;
+
+    len = snprintf(key, alloc, "%s\n%u\n%u\n", branch, (unsigned)commit->date,
+		   commit->parent ? (unsigned)markmap[commit->parent->serial] : 0);
+    for (op = operations; op < end; op++) {
+	size_t need = strlen(op->path) + CVS_MAX_REV_LEN + 16;
+	char rev[CVS_MAX_REV_LEN + 1];
+
+	while (len + need >= alloc) {
+	    alloc *= 2;
+	    key = xrealloc(key, alloc, "commit key");
+	}
+	if (op->op == 'M')
+	    len += snprintf(key + len, alloc - len, "M %o %s %s\n", op->mode,
+			    cvs_number_string(op->rev->number, rev, sizeof(rev)),
+			    op->path);
+	else
+	    len += snprintf(key + len, alloc - len, "D %s\n", op->path);
+    }
+    *keylen = len;
+    return key;
+}
+
+static void
+export_reset(const export_options_t *opts, const char kind,
+	     const char *prefix, const char *name, const serial_t to)
+/* point a head or tag at a mark, unless an earlier run already did */
+{
+    char ref[PATH_MAX];
+
+    snprintf(ref, sizeof(ref), "%s%s", prefix, name);
+    if (marks_find_ref(kind, ref) != to) {
+	if (opts->sink == NULL)
+	    printf("reset %s\nfrom :%d\n\n", ref, to);
+	else if (kind == 't' && opts->sink->tag != NULL)
+	    opts->sink->tag(opts->sink->context, name, to);
+	else if (kind == 'h' && opts->sink->reset != NULL)
+	    opts->sink->reset(opts->sink->context, ref, to);
+    }
+    marks_note_ref(kind, ref, to);
+}
+
+static void
+sink_commit(const export_options_t *opts, const git_commit *commit,
+	    const char *branch, const bool from_ref, const serial_t here,
+	    const char *full, const char *email, const char *timezone,
+	    const struct fileop *operations, const struct fileop *end,
+	    const bool add_ignores, const char *revpairs)
+/* hand a commit to a library consumer */
+{
+    cfe_commit_t out;
+    cfe_fileop_t *fileops;
+    const struct fileop *op;
+    char ref[PATH_MAX];
+    size_t n = 0;
+
+    if (opts->sink->commit == NULL)
+	return;
+    fileops = xcalloc((end - operations) + 1, sizeof(cfe_fileop_t), "sink fileops");
+    for (op = operations; op < end; op++, n++) {
+	fileops[n].op = op->op;
+	fileops[n].path = op->path;
+	if (op->op == 'M') {
+	    fileops[n].mode = op->mode;
+	    fileops[n].mark = markmap[op->rev->serial];
+	}
+    }
+    if (add_ignores) {
+	fileops[n].op = 'M';
+	fileops[n].mode = 0644;
+	fileops[n].inline_data = CVS_IGNORES;
+	fileops[n].inline_len = sizeof(CVS_IGNORES) - 1;
+	fileops[n++].path = ".gitignore";
+    }
+    snprintf(ref, sizeof(ref), "%s%s", opts->branch_prefix, branch);
+    out.ref = ref;
+    out.mark = here;
+    out.parent = commit->parent ? markmap[commit->parent->serial] : 0;
+    out.from = from_ref ? ref : NULL;
+    out.committer = full;
+    out.email = email;
+    out.timezone = timezone;
+    out.date = display_date(commit, here, opts->force_dates);
+    out.log = commit->log;
+    out.revisions = revpairs;
+    out.fileops = fileops;
+    out.nfileops = n;
+    opts->sink->commit(opts->sink->context, &out);
+    free(fileops);
+}
+static void
+export_commit(git_commit *commit, const char *branch, const bool from_ref,
 	      const bool report, const export_options_t *opts)
 /* export a commit and the blobs it is the first to reference */
 {
     const git_commit *parent = commit->parent;
-    cvs_commit *cc;
+    fileop_list_t ops;
     cvs_author *author;
     const char *full;
     const char *email;
@@ -327,11 +968,19 @@ export_commit(git_commit *commit, const char *branch,
     time_t ct;
     struct fileop *operations, *op, *op2;
     int noperations;
-    serial_t here;
+    serial_t here, known = 0;
+    char *key = NULL;
+    size_t keylen = 0;
+    bool add_ignores = false;
     static const char *s_gitignore;
+    static bool need_ignores = true;
 
     if (!s_gitignore) s_gitignore = atom(".gitignore");
 
+    /* an incremental dump picks each branch up where the last one left it */
+    if (from_ref && opts->sink == NULL)
+	(void)printf("from %s%s^0\n\n", opts->branch_prefix, branch);
+
     if (opts->reposurgeon || opts->revision_map || opts->embed_ids) {
 	revpairs = xmalloc((revpairsize = 1024), "revpair allocation");
 	revpairs[0] = '\0';
@@ -340,91 +989,52 @@ export_commit(git_commit *commit, const char *branch,
     noperations = OP_CHUNK;
     op = operations = xmalloc(sizeof(struct fileop) * noperations, "fileop allocation");
 
-    /* Perform a merge join between files in commit and files in parent commit
-     * to determine modified (including new) and deleted files  between commits.
-     * This works because files are sorted by path_deep_compare order
-     * The merge join also preseves this order, removing the need to sort
-     * operations once generated.
+    /*
+     * Diff the files in commit against those in its parent to determine
+     * modified (including new) and deleted files.  The diff reports
+     * files in path_deep_compare order, so the operations need no sort
+     * once generated, and skips directories the two share unchanged.
      */
-    REVDIR_ITER_START(commit_iter, &commit->revdir);
-
-    cc = revdir_iter_next(commit_iter);
-    if (parent) {
-	REVDIR_ITER_START(parent_iter, &parent->revdir);
-
-	cvs_commit *pc = revdir_iter_next(parent_iter);
-	while (cc && pc) {
-	    /* If we're in the same packed directory then skip it */
-	    if (revdir_iter_same_dir(commit_iter, parent_iter)) {
-		pc = revdir_iter_next_dir(parent_iter);
-		cc = revdir_iter_next_dir(commit_iter);
-		continue;
-	    }
-	    if (cc == pc) {
-		/* Child and parent the same, skip. Do this check second
-		 * as we have already accessed cc and pc, so they'll be hot
-                 * plus, it's a common case.
-		 */
-		pc = revdir_iter_next(parent_iter);
-		cc = revdir_iter_next(commit_iter);
-		continue;
-	    }
-	    if (pc->master == cc->master) {
-		/* file exists in commit and parent, but different revisions, modify op */
-		build_modify_op(cc, op);
-		append_revpair(cc, opts, &revpairs, &revpairsize);
-		op = next_op_slot(&operations, op, &noperations);
-		pc = revdir_iter_next(parent_iter);
-		cc = revdir_iter_next(commit_iter);
-		continue;
-	    }
-	    /* masters are sorted in fileop order */
-	    if (pc->master < cc->master) {
-		/* parent but no child, delete op */
-		build_delete_op(pc, op);
-		op = next_op_slot(&operations, op, &noperations);
-		pc = revdir_iter_next(parent_iter);
-	    } else {
-		/* child but no parent, modify op */
-		build_modify_op(cc, op);
-		append_revpair(cc, opts, &revpairs, &revpairsize);
-		op = next_op_slot(&operations, op, &noperations);
-		cc = revdir_iter_next(commit_iter);
-	    }
-	}
-	for (; pc; pc = revdir_iter_next(parent_iter)) {
-	    /* parent but no child, delete op */
-	    build_delete_op(pc, op);
-	    op = next_op_slot(&operations, op, &noperations);
-	}
-    }
-    for (; cc; cc = revdir_iter_next(commit_iter)) {
-	/* child but no parent, modify op */
-	build_modify_op(cc, op);
-	append_revpair(cc, opts, &revpairs, &revpairsize);
-	op = next_op_slot(&operations, op, &noperations);
+    ops.opts = opts;
+    ops.operations = operations;
+    ops.op = op;
+    ops.noperations = noperations;
+    ops.revpairs = revpairs;
+    ops.revpairsize = revpairsize;
+    revdir_diff(parent ? &parent->revdir : NULL, &commit->revdir,
+		add_fileop, &ops);
+    operations = ops.operations;
+    op = ops.op;
+    revpairs = ops.revpairs;
+
+    if (opts->import_marks != NULL || opts->export_marks != NULL) {
+	key = commit_key(commit, branch, operations, op, &keylen);
+	known = marks_find_commit(key, keylen);
     }
 
     for (op2 = operations; op2 < op; op2++) {
 	if (op2->op == 'M' && !op2->rev->emitted) {
-	    if (opts->reportmode == canonical)
-		markmap[op2->rev->serial] = ++mark;
-	    if (report && opts->reportmode == canonical) {
-		char path[PATH_MAX];
-		char *fn = blobfile(op2->path, op2->rev->serial, false, path);
-		FILE *rfp = fopen(fn, "r");
-		if (rfp) {
-		    char buf[BUFSIZ];
-		    printf("blob\nmark :%d\n", mark);
-
-		    while (!feof(rfp)) {
-			size_t len = fread(buf, 1, sizeof(buf), rfp);
-			(void)fwrite(buf, 1, len, stdout);
-		    }
-		    (void) unlink(fn);
+	    serial_t src = op2->rev->serial;
+
+	    if (opts->reportmode == canonical) {
+		/* a duplicate ships its content's first blob, once */
+		if (blobindex[src].dup != 0)
+		    src = blobindex[src].dup;
+		if (blobindex[src].mark != 0) {
+		    markmap[op2->rev->serial] = blobindex[src].mark;
+		    marks_note_blob(op2->rev, blobindex[src].mark);
 		    op2->rev->emitted = true;
-		    (void)fclose(rfp);
+		    continue;
 		}
+		markmap[op2->rev->serial] = ++mark;
+	    }
+	    if (report && opts->reportmode == canonical
+		&& blobindex[src].length > 0) {
+		ship_stored(opts, op2->rev, mark, blobpack,
+			    blobindex[src].offset, blobindex[src].length);
+		blobindex[src].mark = mark;
+		marks_note_blob(op2->rev, mark);
+		op2->rev->emitted = true;
 	    }
 	}
     }
@@ -440,19 +1050,58 @@ export_commit(git_commit *commit, const char *branch,
 	timezone = author->timezone ? author->timezone : "UTC";
     }
 
-    if (report)
-	printf("commit %s%s\n", opts->branch_prefix, branch);
+    if (known != 0) {
+	/* shipped by an earlier run; its blobs were too */
+	commit->serial = ++seqno;
+	markmap[commit->serial] = known;
+	marks_note_commit(key, keylen, known);
+	need_ignores = false;
+	free(key);
+	free(revpairs);
+	free(operations);
+	return;
+    }
+
     commit->serial = ++seqno;
     here = markmap[commit->serial] = ++mark;
+    if (report && key != NULL)
+	marks_note_commit(key, keylen, here);
 #ifdef ORDERDEBUG2
     /* can't move before mark is updated */
     dump_commit(commit, stderr);
 #endif /* ORDERDEBUG2 */
-    if (report)
-	printf("mark :%d\n", mark);
     if (report) {
-	static bool need_ignores = true;
+	if (commit->parent && markmap[commit->parent->serial] == 0) {
+	    cleanup(opts);
+	    fatal_error("child commit emitted before parent exists");
+	}
+	/*
+	 * If there's a .gitignore in the first commit, don't generate one.
+	 * export_blob() will already have prepended them.
+	 */
+	if (need_ignores) {
+	    need_ignores = false;
+	    for (op2 = operations; op2 < op; op2++)
+		if (op2->path == s_gitignore)
+		    break;
+	    add_ignores = (op2 == op);
+	}
+	if (opts->revision_map && revpairs != NULL) {
+	    char *cp;
+	    for (cp = revpairs; *cp; cp++) {
+		if (*cp == '\n')
+		    fprintf(opts->revision_map, " :%d", here);
+		fputc(*cp, opts->revision_map);
+	    }
+	}
+    }
+    if (report && opts->sink != NULL)
+	sink_commit(opts, commit, branch, from_ref, here, full, email, timezone,
+		    operations, op, add_ignores, revpairs);
+    else if (report) {
 	const char *ts;
+	printf("commit %s%s\n", opts->branch_prefix, branch);
+	printf("mark :%d\n", mark);
 	ct = display_date(commit, mark, opts->force_dates);
 	ts = utc_offset_timestamp(&ct, timezone);
 	//printf("author %s <%s> %s\n", full, email, ts);
@@ -462,15 +1111,8 @@ export_commit(git_commit *commit, const char *branch,
 	else
 	    printf("data %zd\n%s\n%s\n", strlen(commit->log) + strlen(revpairs) + 1,
 		commit->log, revpairs);
-	if (commit->parent) {
-	    if (markmap[commit->parent->serial] > 0) 
-		printf("from :%d\n", markmap[commit->parent->serial]);
-	    else
-	    {
-		cleanup(opts);
-		fatal_error("child commit emitted before parent exists");
-	    }
-	}
+	if (commit->parent)
+	    printf("from :%d\n", markmap[commit->parent->serial]);
 
 	for (op2 = operations; op2 < op; op2++)
 	{
@@ -482,40 +1124,17 @@ export_commit(git_commit *commit, const char *branch,
 		       op2->path);
 	    if (op2->op == 'D')
 		printf("D %s\n", op2->path);
-	    /*
-	     * If there's a .gitignore in the first commit, don't generate one.
-	     * export_blob() will already have prepended them.
-	     */
-	    if (need_ignores && op2->path == s_gitignore)
-		need_ignores = false;
 	}
-	if (need_ignores) {
-	    need_ignores = false;
+	if (add_ignores)
 	    printf("M 100644 inline .gitignore\ndata %zd\n%s\n",
 		   sizeof(CVS_IGNORES)-1, CVS_IGNORES);
-	}
-	if (revpairs != NULL && strlen(revpairs) > 0)
-	{
-	    if (opts->revision_map) {
-		char *cp;
-		for (cp = revpairs; *cp; cp++) {
-		    if (*cp == '\n')
-			fprintf(opts->revision_map, " :%d", here);
-		    fputc(*cp, opts->revision_map);
-		}
-	    }
-	    if (opts->reposurgeon)
-	    {
-		if (report)
-		    printf("property cvs-revisions %zd %s", strlen(revpairs), revpairs);
-	    }
-	}
+	if (opts->reposurgeon && revpairs != NULL && strlen(revpairs) > 0)
+	    printf("property cvs-revisions %zd %s", strlen(revpairs), revpairs);
+	printf("\n");
     }
+    free(key);
     free(revpairs);
     free(operations);
-
-    if (report)
-	printf("\n");
 #undef OP_CHUNK
 }
 
@@ -539,11 +1158,21 @@ static int export_ncommit(const git_repo *rl)
     return n;
 }
 
-struct commit_seq {
-    git_commit *commit;
+typedef struct _commit_run {
+    /* one branch's commits, oldest first, still to be shipped */
+    git_commit **next, **end;
     rev_ref *head;
     bool realized;
-};
+} commit_run_t;
+
+typedef struct _commit_merge {
+    git_commit **commits;	/* every branch's commits, in branch order */
+    commit_run_t *runs;
+    commit_run_t **heap;	/* runs left, earliest next commit on top */
+    int nruns, nheap;
+    int current;		/* the run being handed out, unsorted */
+    bool sorted;
+} commit_merge_t;
 
 static int compare_commit(const git_commit *ac, const git_commit *bc)
 /* attempt the mathematically impossible total ordering on the DAG */
@@ -577,12 +1206,9 @@ static int compare_commit(const git_commit *ac, const git_commit *bc)
     return 0;
 }
 
-static int sort_by_date(const void *ap, const void *bp)
-/* return > 0 if ap newer than bp, < 0 if bp newer than ap */
+static int sort_by_date(const git_commit *ac, const git_commit *bc)
+/* return > 0 if ac newer than bc, < 0 if bc newer than ac */
 {
-    git_commit *ac = ((struct commit_seq *)ap)->commit;
-    git_commit *bc = ((struct commit_seq *)bp)->commit;
-
     /* older parents drag tied commits back in time (in effect) */ 
     for (;;) {
 	int cmp;
@@ -600,63 +1226,133 @@ static int sort_by_date(const void *ap, const void *bp)
     }
 }
 
-static struct commit_seq *canonicalize(git_repo *rl)
-/* copy/sort collated commits into git-fast-export order */
+static bool merge_before(const commit_run_t *a, const commit_run_t *b)
+/* should run a's next commit ship ahead of run b's? */
+{
+    int cmp = sort_by_date(*a->next, *b->next);
+
+    /* ties go to the earlier branch, as a stable sort would have it */
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void merge_down(commit_merge_t *m, int at)
+/* move the run at heap slot at down below any that should precede it */
+{
+    commit_run_t *r = m->heap[at];
+
+    for (;;) {
+	int child = 2 * at + 1;
+	if (child >= m->nheap)
+	    break;
+	if (child + 1 < m->nheap && merge_before(m->heap[child + 1], m->heap[child]))
+	    child++;
+	if (!merge_before(m->heap[child], r))
+	    break;
+	m->heap[at] = m->heap[child];
+	at = child;
+    }
+    m->heap[at] = r;
+}
+
+static bool merge_init(commit_merge_t *m, git_repo *rl, const bool sort)
+/* lay out collated commits for shipping; true if they'll come in date order */
 {
     /*
-     * Dump in canonical (strict git-fast-export) order.
-     *
      * Commits are in reverse order on per-branch lists.  The branches
      * have to ship in their current order, otherwise some marks may not 
      * be resolved.
      *
-     * Dump them all into a common array because (a) we're going to
-     * need to ship them back to front, and (b) we'd prefer to ship
-     * them in canonical order by commit date rather than ordered by
-     * branches.
-     *
-     * But there's a hitch; the branches themselves need to be dumped
-     * in forward order, otherwise not all ancestor marks will be defined.
-     * Since the branch commits need to be dumped in reverse, the easiest
-     * way to arrange this is to reverse the branches in the array, fill
-     * the array in forward order, and dump it forward order.
+     * Each branch's commits are copied, back to front, into its own
+     * span of one common array, so that it can ship oldest first.
+     * Then, if topo order is consistent with time order on every
+     * branch, the spans can be merged by commit date without danger
+     * of shipping a mark before it's defined; the merge is done
+     * lazily, one commit at a time, as the emitter asks for them.
      */
-    struct commit_seq *history;
-    int n;
-    int branchbase;
+    bool sortable = true;
+    git_commit **base;
+    int i;
     rev_ref *h;
     git_commit *c;
 
-    history = (struct commit_seq *)xcalloc(export_stats.export_total_commits, 
-					   sizeof(struct commit_seq),
-					   "export");
+    m->commits = xmalloc((export_stats.export_total_commits + 1) * sizeof(git_commit *),
+			 "export");
+    m->nruns = m->nheap = 0;
+    m->current = 0;
+    for (h = rl->heads; h; h = h->next)
+	if (!h->tail)
+	    m->nruns++;
+    m->runs = xcalloc(m->nruns + 1, sizeof(commit_run_t), "export");
+    m->heap = xmalloc((m->nruns + 1) * sizeof(commit_run_t *), "export");
 #ifdef ORDERDEBUG
     fputs("Export phase 1:\n", stderr);
 #endif /* ORDERDEBUG */
-    branchbase = 0;
+    base = m->commits;
     for (h = rl->heads; h; h = h->next) {
 	if (!h->tail) {
-	    int i = 0, branchlength = 0;
+	    commit_run_t *r = &m->runs[m->nheap];
+	    git_commit **n;
+	    int branchlength = 0;
 	    /* PUNNING: see the big comment in cvs.h */ 
 	    for (c = (git_commit *)h->commit; c; c = (c->tail ? NULL : c->parent))
 		branchlength++;
+	    r->next = base;
+	    r->end = n = base + branchlength;
+	    r->head = h;
 	    /* PUNNING: see the big comment in cvs.h */ 
 	    for (c = (git_commit *)h->commit; c; c = (c->tail ? NULL : c->parent)) {
 		/* copy commits in reverse order into this branch's span */
-		n = branchbase + branchlength - (i + 1);
-		history[n].commit = c;
-		history[n].head = h;
-		i++;
+		*--n = c;
+		if (c->parent && c->parent->date > c->date)
+		    sortable = false;
 #ifdef ORDERDEBUG
-		fprintf(stderr, "At n = %d, i = %d\n", n, i);
+		fprintf(stderr, "At n = %d\n", (int)(n - m->commits));
 		dump_commit(c, stderr);
 #endif /* ORDERDEBUG */
 	    }
-	    branchbase += branchlength;
+	    base += branchlength;
+	    if (branchlength > 0)
+		m->heap[m->nheap++] = r;
 	}
     }
+    m->sorted = sort && sortable;
+    if (m->sorted)
+	for (i = m->nheap / 2 - 1; i >= 0; i--)
+	    merge_down(m, i);
+    return m->sorted;
+}
 
-    return history;
+static git_commit *merge_next(commit_merge_t *m, commit_run_t **run)
+/* the next commit to ship and the run it came from, NULL when done */
+{
+    commit_run_t *r;
+
+    if (m->sorted) {
+	if (m->nheap == 0)
+	    return NULL;
+	r = m->heap[0];
+	*run = r;
+	if (++r->next == r->end)
+	    m->heap[0] = m->heap[--m->nheap];
+	if (m->nheap > 0)
+	    merge_down(m, 0);
+	return r->next[-1];
+    } else {
+	if (m->current >= m->nheap)
+	    return NULL;
+	r = m->heap[m->current];
+	*run = r;
+	if (++r->next == r->end)
+	    m->current++;
+	return r->next[-1];
+    }
+}
+
+static void merge_free(commit_merge_t *m)
+{
+    free(m->commits);
+    free(m->runs);
+    free(m->heap);
 }
 
 void export_authors(forest_t *forest, export_options_t *opts)
@@ -668,19 +1364,22 @@ void export_authors(forest_t *forest, export_options_t *opts)
     authors = NULL;
     alloc = 0;
     export_stats.export_total_commits = export_ncommit(forest->git);
-    struct commit_seq *hp, *history = canonicalize(forest->git);
+    commit_merge_t merge;
+    commit_run_t *run;
+    git_commit *c;
 
+    (void)merge_init(&merge, forest->git, false);
     progress_begin("Finding authors...", NO_MAX);
-    for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
+    while ((c = merge_next(&merge, &run)) != NULL) {
 	for (i = 0; i < nauthors; i++) {
-	    if (authors[i] == hp->commit->author)
+	    if (authors[i] == c->author)
 		goto duplicate;
 	}
 	if (nauthors >= alloc) {
 	    alloc += 1024;
 	    authors = xrealloc(authors, sizeof(char*) * alloc, "author list");
 	}
-	authors[nauthors++] = hp->commit->author;
+	authors[nauthors++] = c->author;
     duplicate:;
     }
     progress_end("done");
@@ -689,7 +1388,7 @@ void export_authors(forest_t *forest, export_options_t *opts)
 	printf("%s\n", authors[i]);
 
     free(authors);
-    free(history);
+    merge_free(&merge);
 }
 
 void export_commits(forest_t *forest, 
@@ -713,34 +1412,66 @@ void export_commits(forest_t *forest,
     if (opts->reportmode == canonical)
     {
 	char *tmp = getenv("TMPDIR");
+	char packname[PATH_MAX];
 	if (tmp == NULL) 
 	    tmp = "/tmp";
 	seqno = mark = 0;
-	snprintf(blobdir, sizeof(blobdir), "%s/cvs-fast-export-XXXXXX", tmp);
-	if (mkdtemp(blobdir) == NULL)
-	    fatal_error("temp dir creation failed\n");
+	snprintf(packname, sizeof(packname), "%s/cvs-fast-export-XXXXXX", tmp);
+	if ((blobpack = mkstemp(packname)) == -1)
+	    fatal_error("temp file creation failed\n");
+	/* nothing to clean up afterwards, even on a crash */
+	(void)unlink(packname);
+	blobpack_end = 0;
+    }
+
+    /* marks from an earlier run are taken, new ones go above them */
+    if (opts->import_marks != NULL) {
+	marks_load(opts->import_marks);
+	mark = marks_highest();
     }
+    if (opts->export_marks != NULL)
+	marks_open(opts->export_marks);
 
-    /* an attempt to optimize output throughput */
-    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+    /*
+     * An attempt to optimize output throughput.  The buffer is never
+     * freed, as stdio may still be using it at exit.
+     */
+    if (output_buffer == NULL && opts->sink == NULL) {
+	size_t size = opts->output_buffer ? opts->output_buffer : OUTPUT_BUFFER_DEFAULT;
+	output_buffer = xmalloc(size, "output buffer");
+	setvbuf(stdout, output_buffer, _IOFBF, size);
+    }
 
     export_stats.export_total_commits = export_ncommit(rl);
     /* the +1 is because mark indices are 1-origin, slot 0 always empty */
     markmap = (serial_t *)xcalloc(sizeof(serial_t),
 				  forest->total_revisions + export_stats.export_total_commits + 1,
 				  "markmap allocation");
+    if (opts->reportmode == canonical)
+	blobindex = xcalloc(sizeof(blob_slot_t),
+			    forest->total_revisions + export_stats.export_total_commits + 1,
+			    "blob index allocation");
 
     /* export_blob() touches markmap when in fast mode */
     progress_begin("Generating snapshots...", forest->filecount);
-    for (gp = forest->generators; 
-	 gp < forest->generators + forest->filecount;
-	 gp++) {
-	generate_files(gp, opts, export_blob);
-	generator_free(gp);
-	progress_jump(++recount);
-    }
+    stats_begin(PHASE_SNAPSHOTS);
+#ifdef THREADS
+    if (threads > 1)
+	generate_snapshots_threaded(forest, opts);
+    else
+#endif /* THREADS */
+	for (gp = forest->generators; 
+	     gp < forest->generators + forest->filecount;
+	     gp++) {
+	    generate_master(gp, opts);
+	    progress_jump(++recount);
+	}
+    export_stats.export_total_blobs = seqno;
+    stats_end(PHASE_SNAPSHOTS);
     progress_end("done");
 
+    stats_begin(PHASE_EMISSION);
+
     if (progress)
     {
 	static char msgbuf[100];
@@ -749,7 +1480,7 @@ void export_commits(forest_t *forest,
 	progress_begin(msgbuf, export_stats.export_total_commits);
     }
 
-    if (opts->reposurgeon)
+    if (opts->reposurgeon && opts->sink == NULL)
 	fputs("#reposurgeon sourcetype cvs\n", stdout);
     if (opts->reportmode == fast) {
 	/*
@@ -784,16 +1515,15 @@ void export_commits(forest_t *forest,
 		 */
 		for (i=n-1; i>=0; i--) {
 		    git_commit *gc = history[i];
+		    bool from_ref;
 		    if (opts->fromtime >= gc->date)
 			continue;
-		    if (gc->parent != NULL && display_date(gc->parent, markmap[gc->parent->serial], opts->force_dates) < opts->fromtime)
-			(void)printf("from %s%s^0\n\n",
-				     opts->branch_prefix, h->ref_name);
-		    export_commit(gc, h->ref_name, true, opts);
+		    from_ref = gc->parent != NULL && display_date(gc->parent, markmap[gc->parent->serial], opts->force_dates) < opts->fromtime;
+		    export_commit(gc, h->ref_name, from_ref, true, opts);
 		    progress_step();
 		    for (t = all_tags; t; t = t->next)
 			if (t->commit == gc && display_date(gc, markmap[gc->serial], opts->force_dates) > opts->fromtime)
-			    printf("reset refs/tags/%s\nfrom :%d\n\n", t->name, markmap[gc->serial]);
+			    export_reset(opts, 't', "refs/tags/", t->name, markmap[gc->serial]);
 		}
 
 		free(history);
@@ -802,79 +1532,58 @@ void export_commits(forest_t *forest,
     }
     else 
     {	
-	struct commit_seq *history, *hp;
-	bool sortable;
-
-	history = canonicalize(rl);
- 
-#ifdef ORDERDEBUG2
-	fputs("Export phase 2:\n", stderr);
-	for (hp = history; hp < history + export_stats.export_total_commits; hp++)
-	    dump_commit(hp->commit, stderr);
-#endif /* ORDERDEBUG2 */
+	commit_merge_t merge;
+	commit_run_t *run;
+	int shipped = 0;
 
 	/* 
-	 * Check that the topo order is consistent with time order.
-	 * If so, we can sort commits by date without worrying that
-	 * we'll try to ship a mark before it's defined.
+	 * If topo order is consistent with time order, commits ship
+	 * by date; otherwise a branch at a time.
 	 */
-	sortable = true;
-	for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
-	    if (hp->commit->parent && hp->commit->parent->date > hp->commit->date) {
-		sortable = false;
-		announce("some parent commits are younger than children.\n");
-		break;
-	    }
-	}
-	if (sortable)
-	    qsort((void *)history, 
-		  export_stats.export_total_commits, sizeof(struct commit_seq),
-		  sort_by_date);
+	if (!merge_init(&merge, rl, true))
+	    announce("some parent commits are younger than children.\n");
 
 #ifdef ORDERDEBUG2
-	fputs("Export phase 3:\n", stderr);
+	fputs("Export phase 2:\n", stderr);
+#endif /* ORDERDEBUG2 */
+	while ((c = merge_next(&merge, &run)) != NULL) {
+	    bool report = true, from_ref = false;
+#ifdef ORDERDEBUG2
+	    dump_commit(c, stderr);
 #endif /* ORDERDEBUG2 */
-	for (hp = history; hp < history + export_stats.export_total_commits; hp++) {
-	    bool report = true;
 	    if (opts->fromtime > 0) {
-		if (opts->fromtime >= display_date(hp->commit, mark+1, opts->force_dates)) {
+		if (opts->fromtime >= display_date(c, mark+1, opts->force_dates)) {
 		    report = false;
-		} else if (!hp->realized) {
-		    struct commit_seq *lp;
-		    if (hp->commit->parent != NULL && display_date(hp->commit->parent, markmap[hp->commit->parent->serial], opts->force_dates) < opts->fromtime)
-			(void)printf("from %s%s^0\n\n", opts->branch_prefix, hp->head->ref_name);
-		    for (lp = hp; lp < history + export_stats.export_total_commits; lp++) {
-			if (lp->head == hp->head) {
-			    lp->realized = true;
-			}
-		    }
+		} else if (!run->realized) {
+		    from_ref = c->parent != NULL && display_date(c->parent, markmap[c->parent->serial], opts->force_dates) < opts->fromtime;
+		    run->realized = true;
 		}
 	    }
-	    progress_jump(hp - history);
-	    export_commit(hp->commit, hp->head->ref_name, report, opts);
+	    progress_jump(shipped++);
+	    export_commit(c, run->head->ref_name, from_ref, report, opts);
 	    for (t = all_tags; t; t = t->next)
-		if (t->commit == hp->commit && display_date(hp->commit, markmap[hp->commit->serial], opts->force_dates) > opts->fromtime)
-		    printf("reset refs/tags/%s\nfrom :%d\n\n", t->name, markmap[hp->commit->serial]);
+		if (t->commit == c && display_date(c, markmap[c->serial], opts->force_dates) > opts->fromtime)
+		    export_reset(opts, 't', "refs/tags/", t->name, markmap[c->serial]);
 	}
 
-	free(history);
+	merge_free(&merge);
     }
 
     for (h = rl->heads; h; h = h->next) {
 	if (display_date(h->commit, markmap[h->commit->serial], opts->force_dates) > opts->fromtime)
-	    printf("reset %s%s\nfrom :%d\n\n",
-		   opts->branch_prefix,
-		   h->ref_name,
-		   markmap[h->commit->serial]);
+	    export_reset(opts, 'h', opts->branch_prefix, h->ref_name,
+			 markmap[h->commit->serial]);
     }
     free(markmap);
 
     progress_end("done");
 
-	if (!opts->reposurgeon) {
+	if (!opts->reposurgeon && opts->sink == NULL) {
 		fputs("done\n", stdout);
 	}
 
+    marks_save();
+
     cleanup(opts);
 
     if (forest->skew_vulnerable > 0 && forest->filecount > 1 && !opts->force_dates) {
@@ -882,6 +1591,7 @@ void export_commits(forest_t *forest,
 	warn("no commitids before %s.\n", cvstime2rfc3339(udate));
     }
 
+    stats_end(PHASE_EMISSION);
     memcpy(stats, &export_stats, sizeof(export_stats_t));
 
 }
@@ -21,6 +21,12 @@
 
 #include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "cvs.h"
 
 typedef unsigned char uchar;
@@ -52,6 +58,70 @@ enum markers { Nomatch, Author, Date, Header, Id, Locker, Log,
 	Name, RCSfile, Revision, Source, State };
 enum stringwork {ENTER, EDIT};
 
+/*
+ * Find the next string delimiter or newline at or after p.  Delta text
+ * is mostly long runs with no @ in them, so this is where the snapshot
+ * code spends its time walking lines.  The vector versions use aligned
+ * loads only, which never cross into a page the text doesn't occupy;
+ * the bytes before p in the first block are masked off.  The caller
+ * guarantees termination: every text ends with a closing @.  Which
+ * version is used is settled at compile time by -march.
+ */
+static inline uchar *scan_delim(uchar *p)
+{
+#if defined(__AVX2__)
+    const __m256i at = _mm256_set1_epi8(SDELIM), nl = _mm256_set1_epi8('\n');
+    uchar *block = (uchar *)((uintptr_t)p & ~(uintptr_t)31);
+    __m256i v = _mm256_load_si256((const __m256i *)block);
+    unsigned int mask = _mm256_movemask_epi8(
+	_mm256_or_si256(_mm256_cmpeq_epi8(v, at), _mm256_cmpeq_epi8(v, nl)));
+
+    mask &= ~0u << (p - block);
+    while (mask == 0) {
+	block += 32;
+	v = _mm256_load_si256((const __m256i *)block);
+	mask = _mm256_movemask_epi8(
+	    _mm256_or_si256(_mm256_cmpeq_epi8(v, at), _mm256_cmpeq_epi8(v, nl)));
+    }
+    return block + __builtin_ctz(mask);
+#elif defined(__SSE2__)
+    const __m128i at = _mm_set1_epi8(SDELIM), nl = _mm_set1_epi8('\n');
+    uchar *block = (uchar *)((uintptr_t)p & ~(uintptr_t)15);
+    __m128i v = _mm_load_si128((const __m128i *)block);
+    unsigned int mask = _mm_movemask_epi8(
+	_mm_or_si128(_mm_cmpeq_epi8(v, at), _mm_cmpeq_epi8(v, nl)));
+
+    mask &= ~0u << (p - block);
+    while (mask == 0) {
+	block += 16;
+	v = _mm_load_si128((const __m128i *)block);
+	mask = _mm_movemask_epi8(
+	    _mm_or_si128(_mm_cmpeq_epi8(v, at), _mm_cmpeq_epi8(v, nl)));
+    }
+    return block + __builtin_ctz(mask);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    /* no movemask on NEON; narrow to 4 bits per byte instead */
+    const uint8x16_t at = vdupq_n_u8(SDELIM), nl = vdupq_n_u8('\n');
+    uchar *block = (uchar *)((uintptr_t)p & ~(uintptr_t)15);
+    uint8x16_t v = vld1q_u8(block);
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+	vreinterpretq_u16_u8(vorrq_u8(vceqq_u8(v, at), vceqq_u8(v, nl))), 4)), 0);
+
+    mask &= ~(uint64_t)0 << ((p - block) * 4);
+    while (mask == 0) {
+	block += 16;
+	v = vld1q_u8(block);
+	mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+	    vreinterpretq_u16_u8(vorrq_u8(vceqq_u8(v, at), vceqq_u8(v, nl))), 4)), 0);
+    }
+    return block + (__builtin_ctzll(mask) >> 2);
+#else
+    while (*p != SDELIM && *p != '\n')
+	p++;
+    return p;
+#endif
+}
+
 /* backup one position in the input buffer, unless at start of buffer
  *   return character at new position, or EOF if we could not back up
  */
@@ -91,20 +161,32 @@ static int in_buffer_getc(editbuffer_t *eb)
 }
 
 static uchar *in_get_line(editbuffer_t *eb)
+/* the equivalent of in_buffer_getc() through the next newline or EOF */
 {
-    int c;
-    uchar *ptr = Ginbuf(eb)->ptr;
-#ifdef LINESTATS
-    eb->has_stringdelim = false;
-#endif
-    c=in_buffer_getc(eb);
-    if (c == EOF)
+    uchar *ptr = Ginbuf(eb)->ptr, *p = ptr;
+    int pairs = 0;
+
+    for (;;) {
+	p = scan_delim(p);
+	if (*p == '\n') {
+	    p++;
+	    break;
+	}
+	if (p[1] != SDELIM)
+	    break;	/* closing @, left unconsumed */
+	pairs++;
+	p += 2;
+    }
+    if (p == ptr)
 	return NULL;
-    while (c != EOF && c != '\n')
-	c = in_buffer_getc(eb);
 #ifdef LINESTATS
-    eb->line_len = Ginbuf(eb)->ptr - ptr;
+    eb->has_stringdelim = (pairs > 0);
+    eb->line_len = p - ptr;
+    /* looked for once here, rather than in every snapshot of the line */
+    eb->has_keydelim = eb->Gexpand < EXPANDKO && memchr(ptr, KDELIM, p - ptr) != NULL;
 #endif
+    Ginbuf(eb)->read_count += (p - ptr) - pairs;
+    Ginbuf(eb)->ptr = p;
     return ptr;
 }
 
@@ -188,16 +270,22 @@ static void out_printf(editbuffer_t *eb, const char *fmt, ...)
     }
 }
 
-static void out_fputs(editbuffer_t *eb, const char *s)
+static void out_awrite(editbuffer_t *eb, const char *s, size_t len)
 {
-    while (*s)
-	out_putc(eb, *s++);
+    struct out_buffer_type *ob = eb->Goutbuf;
+
+    /* leave room for the next out_putc(), as it expects */
+    while ((size_t)(ob->end_of_text - ob->ptr) <= len) {
+	out_buffer_enlarge(eb);
+	ob = eb->Goutbuf;
+    }
+    memcpy(ob->ptr, s, len);
+    ob->ptr += len;
 }
 
-static void out_awrite(editbuffer_t *eb, const char *s, size_t len)
+static void out_fputs(editbuffer_t *eb, const char *s)
 {
-    while (len--)
-	out_putc(eb, *s++);
+    out_awrite(eb, s, strlen(s));
 }
 
 static bool latin1_alpha(const int c)
@@ -309,86 +397,106 @@ static enum markers trymatch(char const *const string)
     return(Nomatch);
 }
 #ifdef LINESTATS
-static void insertline(editbuffer_t *eb, const unsigned long n, uchar * l)
-/* Before line N, insert line L.  N is 0-origin.  */
+typedef editline_t	gline_t;
+#else
+typedef uchar		*gline_t;
+#endif /* LINESTATS */
+
+static void gap_insert(editbuffer_t *eb, const unsigned long n, const gline_t line)
+/* Before line N, insert LINE.  N is 0-origin.  */
 {
-    if (n > Glinemax(eb) - Ggapsize(eb))
-	fatal_error("edit script tried to insert beyond eof");
     if (!Ggapsize(eb)) {
 	if (Glinemax(eb)) {
 	    Ggap(eb) = Ggapsize(eb) = Glinemax(eb); Glinemax(eb) <<= 1;
-	    Gline(eb) = xrealloc(Gline(eb), sizeof(editline_t) * Glinemax(eb), "insertline");
+	    Gline(eb) = xrealloc(Gline(eb), sizeof(gline_t) * Glinemax(eb), "insertline");
 	} else {
 	    Glinemax(eb) = Ggapsize(eb) = 1024;
-	    Gline(eb) = xmalloc(sizeof(editline_t) *  Glinemax(eb), "insertline");
+	    Gline(eb) = xmalloc(sizeof(gline_t) *  Glinemax(eb), "insertline");
 	}
     }
     if (n < Ggap(eb))
-	memmove(Gline(eb)+n+Ggapsize(eb), Gline(eb)+n, (Ggap(eb)-n) * sizeof(editline_t));
+	memmove(Gline(eb)+n+Ggapsize(eb), Gline(eb)+n, (Ggap(eb)-n) * sizeof(gline_t));
     else if (Ggap(eb) < n)
-	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(editline_t));
-    Gline(eb)[n].ptr = l;
-    Gline(eb)[n].has_stringdelim = eb->has_stringdelim;
-    Gline(eb)[n].length = eb->line_len;
+	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(gline_t));
+    Gline(eb)[n] = line;
     Ggap(eb) = n + 1;
     Ggapsize(eb)--;
-
 }
 
-static void deletelines(editbuffer_t *eb,
-			const unsigned long n, const unsigned long nlines)
+static void gap_delete(editbuffer_t *eb,
+		       const unsigned long n, const unsigned long nlines)
 /* Delete lines N through N+NLINES-1.  N is 0-origin.  */
 {
     unsigned long l = n + nlines;
-    if (Glinemax(eb)-Ggapsize(eb) < l  ||  l < n)
-	fatal_error("edit script tried to delete beyond eof");
     if (l < Ggap(eb))
-	memmove(Gline(eb)+l+Ggapsize(eb), Gline(eb)+l, (Ggap(eb)-l) * sizeof(editline_t));
+	memmove(Gline(eb)+l+Ggapsize(eb), Gline(eb)+l, (Ggap(eb)-l) * sizeof(gline_t));
     else if (Ggap(eb) < n)
-	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(editline_t));
+	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(gline_t));
     Ggap(eb) = n;
     Ggapsize(eb) += nlines;
 }
 
-#else
+static void journal(editbuffer_t *eb, const unsigned long n,
+		    const unsigned long nlines, const bool deleted)
+/* note an edit made on a branch so that leave_branch() can undo it */
+{
+    struct undo *last = eb->nundo > eb->current->undo_mark ? &eb->undo[eb->nundo - 1] : NULL;
+    unsigned long i;
+
+    if (deleted) {
+	if (eb->nsaved + nlines > eb->maxsaved) {
+	    do {
+		eb->maxsaved = eb->maxsaved ? eb->maxsaved * 2 : 1024;
+	    } while (eb->nsaved + nlines > eb->maxsaved);
+	    eb->saved = xrealloc(eb->saved, sizeof(gline_t) * eb->maxsaved, "undo journal");
+	}
+	for (i = n; i < n + nlines; i++)
+	    eb->saved[eb->nsaved++] = Gline(eb)[i < Ggap(eb) ? i : i + Ggapsize(eb)];
+    } else if (last != NULL && !last->deleted && last->line + last->nlines == n) {
+	/* the lines of an append come one after another */
+	last->nlines += nlines;
+	return;
+    }
+    if (eb->nundo == eb->maxundo) {
+	eb->maxundo = eb->maxundo ? eb->maxundo * 2 : 256;
+	eb->undo = xrealloc(eb->undo, sizeof(struct undo) * eb->maxundo, "undo journal");
+    }
+    eb->undo[eb->nundo].line = n;
+    eb->undo[eb->nundo].nlines = nlines;
+    eb->undo[eb->nundo++].deleted = deleted;
+}
+
 static void insertline(editbuffer_t *eb, const unsigned long n, uchar * l)
 /* Before line N, insert line L.  N is 0-origin.  */
 {
+#ifdef LINESTATS
+    editline_t line = {
+	.ptr = l, .length = eb->line_len, .has_stringdelim = eb->has_stringdelim,
+	.has_keydelim = eb->has_keydelim
+    };
+#else
+    gline_t line = l;
+#endif /* LINESTATS */
+
     if (n > Glinemax(eb) - Ggapsize(eb))
 	fatal_error("edit script tried to insert beyond eof");
-    if (!Ggapsize(eb)) {
-	if (Glinemax(eb)) {
-	    Ggap(eb) = Ggapsize(eb) = Glinemax(eb); Glinemax(eb) <<= 1;
-	    Gline(eb) = xrealloc(Gline(eb), sizeof(uchar *) * Glinemax(eb), "insertline");
-	} else {
-	    Glinemax(eb) = Ggapsize(eb) = 1024;
-	    Gline(eb) = xmalloc(sizeof(uchar *) *  Glinemax(eb), "insertline");
-	}
-    }
-    if (n < Ggap(eb))
-	memmove(Gline(eb)+n+Ggapsize(eb), Gline(eb)+n, (Ggap(eb)-n) * sizeof(uchar *));
-    else if (Ggap(eb) < n)
-	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(uchar *));
-    Gline(eb)[n] = l;
-    Ggap(eb) = n + 1;
-    Ggapsize(eb)--;
+    gap_insert(eb, n, line);
+    if (eb->current != eb->stack)
+	journal(eb, n, 1, false);
 }
 
-static void deletelines(editbuffer_t *eb, 
+static void deletelines(editbuffer_t *eb,
 			const unsigned long n, const unsigned long nlines)
 /* Delete lines N through N+NLINES-1.  N is 0-origin.  */
 {
     unsigned long l = n + nlines;
     if (Glinemax(eb)-Ggapsize(eb) < l  ||  l < n)
 	fatal_error("edit script tried to delete beyond eof");
-    if (l < Ggap(eb))
-	memmove(Gline(eb)+l+Ggapsize(eb), Gline(eb)+l, (Ggap(eb)-l) * sizeof(uchar *));
-    else if (Ggap(eb) < n)
-	memmove(Gline(eb)+Ggap(eb), Gline(eb)+Ggap(eb)+Ggapsize(eb), (n-Ggap(eb)) * sizeof(uchar *));
-    Ggap(eb) = n;
-    Ggapsize(eb) += nlines;
+    if (eb->current != eb->stack)
+	journal(eb, n, nlines, true);
+    gap_delete(eb, n, nlines);
 }
-#endif
+
 static long parsenum(editbuffer_t *eb)
 /* parse and return a decimal integer */
 {
@@ -478,12 +586,20 @@ static void keyreplace(editbuffer_t *eb, enum markers marker)
 /* output the appropriate keyword value(s) */
 {
     char *leader = NULL;
-    char date_string[25];
+    const char *date_string = eb->Gdate_string;
     enum expand_mode exp = eb->Gexpand;
     char const *kw = Keyword[(int)marker];
-    time_t utime = RCS_EPOCH + eb->Gversion->date;
 
-    strftime(date_string, 25, "%Y/%m/%d %H:%M:%S", localtime(&utime));
+    /* made once per revision, however many keywords it has */
+    if (eb->Gdate_version != eb->Gversion) {
+	time_t utime = RCS_EPOCH + eb->Gversion->date;
+	struct tm tm;
+
+	/* localtime_r() because snapshots may be generated concurrently */
+	strftime(eb->Gdate_string, sizeof(eb->Gdate_string),
+		 "%Y/%m/%d %H:%M:%S", localtime_r(&utime, &tm));
+	eb->Gdate_version = eb->Gversion;
+    }
 
     out_printf(eb, "%c%s", KDELIM, kw);
 
@@ -506,7 +622,7 @@ static void keyreplace(editbuffer_t *eb, enum markers marker)
 	case Id:
 	case Header:
 	    if (marker == Id )
-		escape_string(eb, basefilename(eb->Gfilename));
+		escape_string(eb, eb->Gbasename);
 	    else
 		escape_string(eb, getfullRCSname(eb));
 	    out_printf(eb, " %s %s %s %s",
@@ -525,7 +641,7 @@ static void keyreplace(editbuffer_t *eb, enum markers marker)
 	    break;
 	case Log:
 	case RCSfile:
-	    escape_string(eb, basefilename(eb->Gfilename));
+	    escape_string(eb, eb->Gbasename);
 	    break;
 	case Revision:
 	    out_fputs(eb, eb->Gversion_number);
@@ -653,6 +769,20 @@ static void keyreplace(editbuffer_t *eb, enum markers marker)
     }
 }
 
+static void expand_copy_plain(editbuffer_t *eb)
+/* copy input up to the next $, @ or newline straight to the output */
+{
+    uchar *p = Ginbuf(eb)->ptr, *q = scan_delim(p), *k;
+
+    if ((k = memchr(p, KDELIM, q - p)) != NULL)
+	q = k;
+    if (q > p) {
+	out_awrite(eb, (const char *)p, q - p);
+	Ginbuf(eb)->ptr = q;
+	Ginbuf(eb)->read_count += q - p;
+    }
+}
+
 static int expandline(editbuffer_t *eb)
 {
     register int c = 0;
@@ -670,6 +800,7 @@ static int expandline(editbuffer_t *eb)
     r = -1;
 
     for (;;) {
+	expand_copy_plain(eb);
 	c = in_buffer_getc(eb);
 	for (;;) {
 	    switch(c) {
@@ -794,6 +925,10 @@ load_text(editbuffer_t *eb, const cvs_text *text)
     if (base == MAP_FAILED)
         fatal_system_error("mmap: %s %zu", text->filename, size);
     close(fd);
+#ifdef MADV_SEQUENTIAL
+    /* deltas are mostly replayed in file order; read ahead, drop behind */
+    (void)madvise(base, size, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
 
     munmap(eb->text_map.base, eb->text_map.size);
     eb->text_map.filename = text->filename;
@@ -896,32 +1031,6 @@ static void process_delta(editbuffer_t *eb,
     }
 }
 
-static void expandedit(editbuffer_t *eb)
-{
-#ifdef LINESTATS
-    editline_t *p, *lim, *l = Gline(eb);
-
-    for (p=l, lim=l+Ggap(eb);  p<lim;  ) {
-	in_buffer_init(eb, (*p++).ptr, false);
-	expandline(eb);
-    }
-    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  ) {
-	in_buffer_init(eb, (*p++).ptr, false);
-	expandline(eb);
-    }
-#else
-    uchar **p, **lim, **l = Gline(eb);
-
-    for (p=l, lim=l+Ggap(eb);  p<lim;  ) {
-	in_buffer_init(eb, *p++, false);
-	expandline(eb);
-    }
-    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  ) {
-	in_buffer_init(eb, *p++, false);
-	expandline(eb);
-    }
-#endif
-}
 /*
  * The FASTOUT code is a shameless micro-optimization addressing the
  * fact that without it this out_putc() loop consistently shows up as
@@ -936,34 +1045,37 @@ static void expandedit(editbuffer_t *eb)
 #define FASTOUT
 static void snapshotline(editbuffer_t *eb, register uchar * l)
 {
+#ifndef FASTOUT
     register int c;
-#ifdef FASTOUT
-    struct out_buffer_type *ob = eb->Goutbuf;
-    uchar * start = l;
-#endif
+
     do {
-#ifndef FASTOUT
 	if ((c = *l++) == SDELIM  &&  *l++ != SDELIM)
 	    return;
 	out_putc(eb, c);
+    } while (c != '\n');
 #else
-	if ((c = *l++) == SDELIM  &&  *l++ != SDELIM) {
-	    l = l - 2;
+    struct out_buffer_type *ob = eb->Goutbuf;
+    uchar * start = l;
+
+    for (;;) {
+	l = scan_delim(l);
+	if (*l == '\n') {
+	    l++;
 	    break;
 	}
-	if (c == SDELIM) {
-	    // @@ is a memcpy barrier as we're unescaping it
-	    // -1 because if we get here we skipped a SDELIM
-	    while (ob->end_of_text - ob->ptr < l - start - 1) {
-	    	out_buffer_enlarge(eb);
-		ob = eb->Goutbuf;
-	    }
-	    memcpy(ob->ptr, start, l - start - 1);
-	    ob->ptr += l - start - 1;
-	    start = l;
+	if (l[1] != SDELIM)
+	    break;
+	// @@ is a memcpy barrier as we're unescaping it
+	// +1 to keep one of the pair
+	while (ob->end_of_text - ob->ptr < l - start + 1) {
+	    out_buffer_enlarge(eb);
+	    ob = eb->Goutbuf;
 	}
+	memcpy(ob->ptr, start, l - start + 1);
+	ob->ptr += l - start + 1;
+	start = l = l + 2;
+    }
 #endif
-    } while (c != '\n');
 
 #ifdef FASTOUT
     if (l - start != 0) {
@@ -1019,23 +1131,73 @@ static void snapshotedit(editbuffer_t *eb)
 }
 #endif
 
+#ifdef LINESTATS
+static void expandline_at(editbuffer_t *eb, editline_t *l)
+/* expand keywords in a line, or just copy it if it can have none */
+{
+    if (l->has_keydelim) {
+	in_buffer_init(eb, l->ptr, false);
+	expandline(eb);
+    } else if (l->has_stringdelim)
+	snapshotline(eb, l->ptr);
+    else
+	snapshotline_nodelim(eb, l);
+}
+
+static void expandedit(editbuffer_t *eb)
+{
+    editline_t *p, *lim, *l = Gline(eb);
+
+    for (p=l, lim=l+Ggap(eb);  p<lim;  )
+	expandline_at(eb, p++);
+    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  )
+	expandline_at(eb, p++);
+}
+#else
+static void expandedit(editbuffer_t *eb)
+{
+    uchar **p, **lim, **l = Gline(eb);
+
+    for (p=l, lim=l+Ggap(eb);  p<lim;  ) {
+	in_buffer_init(eb, *p++, false);
+	expandline(eb);
+    }
+    for (p+=Ggapsize(eb), lim=l+Glinemax(eb);  p<lim;  ) {
+	in_buffer_init(eb, *p++, false);
+	expandline(eb);
+    }
+}
+#endif /* LINESTATS */
+
 static void enter_branch(editbuffer_t *eb, const node_t *const node)
+/* start down a branch, editing the line array of the revision it sprouts from */
 {
-#ifdef LINESTATS
-    editline_t *p = xmalloc(sizeof(editline_t) * eb->current->linemax, "enter branch");
-    memcpy(p, eb->current->line, sizeof(editline_t) * eb->current->linemax);
     ++eb->current;
     eb->current[0] = eb->current[-1];
     eb->current->next_branch = node->sib;
-    eb->current->line = p;
-#else
-    uchar **p = xmalloc(sizeof(uchar *) * eb->current->linemax, "enter branch");
-	memcpy(p, eb->current->line, sizeof(uchar *) * eb->current->linemax);
-	++eb->current;
-	eb->current[0] = eb->current[-1];
-	eb->current->next_branch = node->sib;
-	eb->current->line = p;
-#endif
+    eb->current->undo_mark = eb->nundo;
+}
+
+static void leave_branch(editbuffer_t *eb)
+/* undo a branch's edits, to get back the revision it sprouted from */
+{
+    while (eb->nundo > eb->current->undo_mark) {
+	const struct undo *u = &eb->undo[--eb->nundo];
+	unsigned long i;
+
+	if (u->deleted) {
+	    eb->nsaved -= u->nlines;
+	    for (i = 0; i < u->nlines; i++)
+		gap_insert(eb, u->line + i, eb->saved[eb->nsaved + i]);
+	} else
+	    gap_delete(eb, u->line, u->nlines);
+    }
+    /* the array may have moved, and its gap certainly has */
+    eb->current[-1].line = eb->current->line;
+    eb->current[-1].gap = eb->current->gap;
+    eb->current[-1].gapsize = eb->current->gapsize;
+    eb->current[-1].linemax = eb->current->linemax;
+    --eb->current;
 }
 
 static node_t *generate_setup(generator_t *gen, enum expand_mode id_token_expand)
@@ -1058,7 +1220,10 @@ static node_t *generate_setup(generator_t *gen, enum expand_mode id_token_expand
 	else
 	    eb->Gexpand = EXPANDKB;
 	eb->Gabspath = NULL;
+	eb->Gbasename = basefilename(eb->Gfilename);
+	eb->Gdate_version = NULL;
 	Gline(eb) = NULL; Ggap(eb) = Ggapsize(eb) = Glinemax(eb) = 0;
+	eb->nundo = eb->nsaved = 0;
     }
 
     return gen->nodehash.head_node;
@@ -1072,6 +1237,12 @@ static void generate_wrap(generator_t *gen)
     eb->Gkeyval = NULL;
     eb->Gkvlen = 0;
     free(eb->Gabspath);
+    free(eb->undo);
+    eb->undo = NULL;
+    eb->maxundo = 0;
+    free(eb->saved);
+    eb->saved = NULL;
+    eb->maxsaved = 0;
     unload_all_text(eb);
 }
 
@@ -1105,7 +1276,8 @@ void generate_files(generator_t *gen,
 		snapshotedit(eb);
 	    hook(node, out_buffer_text(eb), out_buffer_count(eb), opts);
 	    out_buffer_cleanup(eb);
-	}
+	} else if (node->commit != NULL)
+	    hook(node, NULL, 0, opts);	/* so a hook can see the walk */
 	node = node->down;
 	if (node) {
 	    enter_branch(eb, node);
@@ -1114,11 +1286,10 @@ void generate_files(generator_t *gen,
 	while ((node = eb->current->node->to) == NULL) {
 	    unload_text(eb, &eb->current->node->patch->text,
 	                eb->current->node_text);
-	    free(eb->current->line);
 	    if (eb->current == eb->stack)
 		goto Done;
 	    node = (node_t *)eb->current->next_branch;
-	    --eb->current;
+	    leave_branch(eb);
 	    if (node) {
 		enter_branch(eb, node);
 		break;
@@ -1130,6 +1301,8 @@ void generate_files(generator_t *gen,
 	process_delta(eb, node, EDIT);
     }
 Done:
+    /* all the frames share one line array */
+    free(eb->current->line);
     generate_wrap(gen);
 }
 
@@ -189,8 +189,8 @@ ignored         : owner | group | deltatype | kopt |
 
 revision	: NUMBER date author state branches next revtrailer
 		  {
-		    $$ = xcalloc (1, sizeof (cvs_version),
-				    "gram.y::revision");
+		    $$ = arena_alloc (&cvsfile->gen.nodehash.arena,
+				      sizeof (cvs_version), "gram.y::revision");
 		    $$->number = atom_cvs_number($1);
 		    $$->date = $2;
 		    $$->author = $3;
@@ -231,8 +231,8 @@ branches	: BRANCHES numbers SEMI
 		;
 numbers		: NUMBER numbers
 		  {
-			$$ = xcalloc (1, sizeof (cvs_branch),
-				    "gram.y::numbers");
+			$$ = arena_alloc (&cvsfile->gen.nodehash.arena,
+					  sizeof (cvs_branch), "gram.y::numbers");
 			$$->next = $2;
 			$$->number = atom_cvs_number($1);
 			hash_branch(&cvsfile->gen.nodehash, $$);
@@ -260,7 +260,8 @@ patches		: patches patch
 		  { $$ = &cvsfile->gen.patches; }
 		;
 patch		: NUMBER log text
-		  { $$ = xcalloc (1, sizeof (cvs_patch), "gram.y::patch");
+		  { $$ = arena_alloc (&cvsfile->gen.nodehash.arena,
+				    sizeof (cvs_patch), "gram.y::patch");
 		    $$->number = atom_cvs_number($1);
 		    if (!strcmp($2, "Initial revision\n")) {
 			    /* description is available because the
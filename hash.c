@@ -2,115 +2,236 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <string.h>
 #include "hash.h"
 
-/* FNV Hash Constants from http://isthe.com/chongo/tech/comp/fnv/ */
-
-//#if UINT_MAX == UINT32_MAX
-#define HASH_FNV_INITIAL 2166136261U
-#define HASH_FNV_MIXVAL 16777619U
 /*
-#elif UINT_MAX == UINT64_MAX
-#define HASH_FNV_INITIAL 14695981039346656037UL
-#define HASH_FNV_MIXVAL  1099511628211UL
+ * Table hashes go over their keys eight bytes at a time.  When the
+ * compiler is allowed CRC32C instructions (SSE4.2 on x86, the CRC
+ * extension on ARMv8, as under the Makefile's -march=native) each word
+ * is folded in with one of those; otherwise with a multiply-rotate
+ * step.  The total length goes in last, so keys differing only in
+ * trailing NULs hash apart.  Results are for in-memory tables only:
+ * they differ between builds, so nothing that outlives the process
+ * may depend on them.
+ */
+#define HASH_K1		0x87c37b91114253d5ULL
+#define HASH_K2		0x4cf5ad432745937fULL
+#define ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define HASH_STEP(h, w)	((h) = _mm_crc32_u64((h), (w)))
+#define HASH_FINISH(h)	((hash_t)(h))
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HASH_STEP(h, w)	((h) = __crc32cd((uint32_t)(h), (w)))
+#define HASH_FINISH(h)	((hash_t)(h))
+#else
+#define HASH_STEP(h, w)	((h) = ROTL64((h) ^ ((w) * HASH_K1), 31) * HASH_K2)
+#define HASH_FINISH(h)	((hash_t)(((h) ^ ((h) >> 29)) * HASH_K1 >> 32))
 #endif
-*/
-#define HASH_MIX_FNV1A(hash, val) hash = (hash ^ (uint8_t)(val)) * HASH_FNV_MIXVAL
 
-static hash_t
-fnv1a_hash_init(void)
+#define HASH_INITIAL	2166136261U
+
+static inline hash_t
+wide_hash(uint64_t h, const char *val, size_t len)
 {
-    return HASH_FNV_INITIAL;
+    uint64_t	w;
+    size_t	i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+	memcpy(&w, val + i, sizeof(w));
+	HASH_STEP(h, w);
+    }
+    if (i < len) {
+	w = 0;
+	memcpy(&w, val + i, len - i);
+	HASH_STEP(h, w);
+    }
+    HASH_STEP(h, (uint64_t)len);
+    return HASH_FINISH(h);
 }
 
-static hash_t
-fnv1a_hash_mix_string(hash_t seed, const char *val) 
+hash_t
+hash_init(void)
 {
-    uint8_t c;
-    while ((c = (uint8_t)*val++))
-	HASH_MIX_FNV1A(seed, c);
-    return seed;
+    return HASH_INITIAL;
 }
 
-static hash_t
-fnv1a_hash_string(const char *val)
+hash_t
+hash_string(const char *val)
 {
-    return fnv1a_hash_mix_string(HASH_FNV_INITIAL, val);
+    return wide_hash(HASH_INITIAL, val, strlen(val));
 }
 
-static hash_t
-fnv1a_hash_mix(hash_t seed, const char *val, size_t len)
+hash_t
+hash_mix(hash_t seed, const char *val, size_t len)
 {
-    size_t i;
-    for (i = 0; i < len; i++)
-	HASH_MIX_FNV1A(seed, val[i]);
-    return seed;
+    return wide_hash(seed, val, len);
 }
 
-static hash_t
-fnv1a_hash_value(const char *val, size_t len)
+hash_t
+hash_value(const char *val, size_t len)
 {
-    return fnv1a_hash_mix(HASH_FNV_INITIAL, val, len);
+    return wide_hash(HASH_INITIAL, val, len);
 }
 
-
-static hash_t crc32_table[256];
-
-static void
-generate_crc32_table(void)
+hash_t
+hash_mix_string(hash_t seed, const char *val)
 {
-    hash_t	c, p;
-    int		n, m;
-
-    p = 0xedb88320;
-    for (n = 0; n < 256; n++) {
-	c = n;
-	for (m = 0; m < 8; m++)
-	    c = (c >> 1) ^ ((c & 1) ? p : 0);
-	crc32_table[n] = c;
-    }
+    return wide_hash(seed, val, strlen(val));
 }
 
-static hash_t
-crc32(const char *string)
+/*
+ * Two independent 64-bit multiply-rotate lanes over the text a word at
+ * a time, each finished with the MurmurHash3 64-bit mixer.  Nothing
+ * like a cryptographic digest, but 128 well-mixed bits make an
+ * accidental collision between two snapshots vanishingly unlikely.
+ */
+
+static uint64_t
+fmix64(uint64_t k)
 {
-    hash_t		crc32 = ~0;
-    unsigned char	c;
-
-    if (crc32_table[1] == 0) generate_crc32_table();
-    while ((c = (unsigned char) *string++))
-	crc32 = (crc32 >> 8) ^ crc32_table[(crc32 ^ c) & 0xff];
-    return ~crc32;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
 }
 
-hash_t
-hash_init(void)
+void
+hash_digest(const char *val, size_t len, hash_digest_t *digest)
 {
-    return fnv1a_hash_init();
+    uint64_t	lo = 0x9e3779b97f4a7c15ULL, hi = 0x6a09e667f3bcc908ULL, w;
+    size_t	i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+	memcpy(&w, val + i, sizeof(w));
+	lo = ROTL64(lo ^ (w * HASH_K1), 31) * HASH_K2;
+	hi = ROTL64(hi + (w * HASH_K2), 33) * HASH_K1 + lo;
+    }
+    if (i < len) {
+	w = 0;
+	memcpy(&w, val + i, len - i);
+	lo = ROTL64(lo ^ (w * HASH_K1), 31) * HASH_K2;
+	hi = ROTL64(hi + (w * HASH_K2), 33) * HASH_K1 + lo;
+    }
+    digest->lo = fmix64(lo ^ len);
+    digest->hi = fmix64(hi + digest->lo);
 }
 
-hash_t
-hash_string(const char *val)
+/*
+ * SHA-256 (FIPS 180-4), for fingerprints that have to hold up against
+ * content crafted to collide, where a match is taken as proof that two
+ * texts are the same.  Fed incrementally, so a text can be digested in
+ * pieces without copying it together first.
+ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, r)	(((x) >> (r)) | ((x) << (32 - (r))))
+
+static void
+sha256_block(uint32_t *state, const unsigned char *block)
+/* fold one 64-byte block into the state */
 {
-    return fnv1a_hash_string(val);
+    uint32_t	w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int		i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+	    | (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    for (; i < 64; i++)
+	w[i] = w[i - 16]
+	    + (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3))
+	    + w[i - 7]
+	    + (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+	t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25))
+	    + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22))
+	    + ((a & b) ^ (a & c) ^ (b & c));
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
 }
 
-hash_t
-hash_mix(hash_t seed, const char *val, size_t len)
+void
+hash_strong_init(hash_strong_ctx_t *ctx)
 {
-    return fnv1a_hash_mix(seed, val, len);
+    static const uint32_t iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
 }
 
-hash_t
-hash_value(const char *val, size_t len)
+void
+hash_strong_update(hash_strong_ctx_t *ctx, const char *val, size_t len)
 {
-    return fnv1a_hash_value(val, len);
+    const unsigned char *p = (const unsigned char *)val;
+    size_t used = ctx->length % sizeof(ctx->block);
+
+    ctx->length += len;
+    if (used > 0) {
+	size_t take = sizeof(ctx->block) - used;
+
+	if (take > len)
+	    take = len;
+	memcpy(ctx->block + used, p, take);
+	p += take;
+	len -= take;
+	if (used + take < sizeof(ctx->block))
+	    return;
+	sha256_block(ctx->state, ctx->block);
+    }
+    for (; len >= sizeof(ctx->block); p += sizeof(ctx->block), len -= sizeof(ctx->block))
+	sha256_block(ctx->state, p);
+    memcpy(ctx->block, p, len);
 }
 
-hash_t
-hash_mix_string(hash_t seed, const char *val)
+void
+hash_strong_final(hash_strong_ctx_t *ctx, hash_strong_t *digest)
 {
-    return fnv1a_hash_mix_string(seed, val);
+    unsigned char pad[sizeof(ctx->block) + 8] = {0x80};
+    uint64_t bits = ctx->length * 8;
+    size_t used = ctx->length % sizeof(ctx->block), padlen, i;
+
+    padlen = (used < 56 ? 56 : 120) - used;
+    for (i = 0; i < 8; i++)
+	pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    hash_strong_update(ctx, (const char *)pad, padlen + 8);
+    for (i = 0; i < 8; i++) {
+	digest->bytes[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+	digest->bytes[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+	digest->bytes[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+	digest->bytes[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
 }
 
 //end
@@ -18,6 +18,34 @@ hash_mix(hash_t seed, const char *val, size_t len);
 hash_t
 hash_mix_string(hash_t seed, const char *val);
 
+/* a wide, non-cryptographic fingerprint for telling whole texts apart */
+typedef struct _hash_digest {
+    uint64_t	lo, hi;
+} hash_digest_t;
+
+void
+hash_digest(const char *val, size_t len, hash_digest_t *digest);
+
+/* a cryptographic (SHA-256) fingerprint, for when a match must mean equal */
+typedef struct _hash_strong {
+    unsigned char	bytes[32];
+} hash_strong_t;
+
+typedef struct _hash_strong_ctx {
+    uint32_t		state[8];
+    uint64_t		length;
+    unsigned char	block[64];
+} hash_strong_ctx_t;
+
+void
+hash_strong_init(hash_strong_ctx_t *ctx);
+
+void
+hash_strong_update(hash_strong_ctx_t *ctx, const char *val, size_t len);
+
+void
+hash_strong_final(hash_strong_ctx_t *ctx, hash_strong_t *digest);
+
 
 #define HASH_INIT(hash) hash_t hash = hash_init()
 #define HASH_MIX_SEED(hash, seed, val) hash = hash_mix((seed), (const char *)&(val), sizeof(val))
@@ -25,4 +53,13 @@ hash_mix_string(hash_t seed, const char *val);
 #define HASH_MIX(hash, val) hash = hash_mix((hash), (const char *)&(val), sizeof(val))
 #define HASH_COMBINE(h1, h2) ((h1) ^ (h2))
 
+/*
+ * Mix one pointer or small integer into a running hash, for keys that
+ * are arrays of them such as revdir file lists.  All of its bits count,
+ * and unlike HASH_COMBINE the order does too.
+ */
+#define HASH_WORD_K	0x9e3779b97f4a7c15ULL
+#define HASH_MIX_WORD(hash, word) \
+	hash = (hash_t)((((uint64_t)(hash) ^ (uint64_t)(uintptr_t)(word)) * HASH_WORD_K) >> 32)
+
 #endif /* _HASH_H_ */
@@ -4,6 +4,7 @@
  *  SPDX-License-Identifier: GPL-2.0+
  */
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #ifdef THREADS
@@ -22,11 +23,14 @@
 typedef struct _rev_filename {
     struct _rev_filename	*next;
     const char			*file;
+    off_t			size;
 } rev_filename;
 
 typedef struct _rev_file {
     const char *name;
     const char *rectified;
+    char *key;		/* sort key for rectified, see deep_sort_key() */
+    off_t size;
 } rev_file;
 /*
  * Ugh...least painful way to make some stuff that isn't thread-local
@@ -35,20 +39,30 @@ typedef struct _rev_file {
 static rev_filename         *fn_head = NULL, **fn_tail = &fn_head, *fn;
 /* Slabs to be sorted in path_deep_compare order */
 static rev_file             *sorted_files;
+/* Indices into sorted_files, biggest master first */
+static size_t               *schedule;
 static cvs_master           *cvs_masters;
 static rev_master           *rev_masters;
 static volatile size_t      fn_i = 0, fn_n;
+static volatile size_t      prefetch_i;
 static volatile cvstime_t   skew_vulnerable;
 static volatile size_t      total_revisions, load_current_file;
 static volatile generator_t *generators;
 static volatile int         err;
 
+/* Atom table sizing guesses; overestimates only cost empty buckets */
+#define ATOMS_PER_MASTER	16
+#define BYTES_PER_ATOM		1024
+#define BYTES_PER_NUMBER	65536
+
 static int total_files, striplen;
 static int verbose;
+static const char *cache_file;
+static size_t prefetch_ahead;
+static bool sharding, merging;
 
 #ifdef THREADS
 static pthread_mutex_t revlist_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t enqueue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t *workers;
 #endif /* THREADS */
 
@@ -116,13 +130,36 @@ atom_rectify_name(const char *raw)
 }
 
 static void
-rev_list_file(rev_file *file, analysis_t *out, cvs_master *cm, rev_master *rm) 
+skew_report(const cvs_file *cvs)
+/* the -v skew notes gram.y gives, remade from the revisions in file order */
+{
+    cvs_version *v;
+    cvstime_t skew = 0;
+    char buf[33];
+
+    for (v = cvs->gen.versions; v; v = v->next)
+	if (v->commitid == NULL && skew < v->date) {
+	    skew = v->date;
+	    warn("skew_vulnerable in file %s rev %s set to %s\n",
+		 cvs->export_name,
+		 cvs_number_string(v->number, buf, sizeof(buf) - 1),
+		 cvstime2rfc3339(v->date));
+	}
+}
+
+static void
+rev_list_file(size_t index, rev_file *file, analysis_t *out, cvs_master *cm, rev_master *rm) 
 {
     struct stat	buf;
+    struct timespec lap;
     yyscan_t scanner;
     FILE *in;
     cvs_file *cvs;
+    char *warnings = NULL;
+    size_t warnlen = 0;
 
+    /* out is reused across masters; one we give up on must not inherit */
+    memset(out, '\0', sizeof(analysis_t));
     in = fopen(file->name, "r");
     if (!in) {
 	perror(file->name);
@@ -140,12 +177,43 @@ rev_list_file(rev_file *file, analysis_t *out, cvs_master *cm, rev_master *rm)
     cvs->mode = buf.st_mode;
     cvs->verbose = verbose;
 
+    stats_clock(&lap);
+    if (cache_file != NULL && parse_cache_fetch(index, &buf, cvs)) {
+	fclose(in);
+	goto digest;
+    }
+
+    if (cache_file != NULL) {
+	/* keep the parse's warnings for the cache to give again on a hit */
+	if ((log_capture = open_memstream(&warnings, &warnlen)) == NULL)
+	    fatal_system_error("cannot capture parse warnings");
+	cvs->verbose = false;
+    }
     yylex_init(&scanner);
     yyset_in(in, scanner);
+#ifdef USE_MMAP
+    lex_map_input(scanner, file->name);
+#endif /* USE_MMAP */
     yyparse(scanner, cvs);
+#ifdef USE_MMAP
+    lex_unmap_input(scanner);
+#endif /* USE_MMAP */
     yylex_destroy(scanner);
 
     fclose(in);
+    if (cache_file != NULL) {
+	fclose(log_capture);
+	log_capture = NULL;
+	cvs->verbose = verbose;
+	fwrite(warnings, 1, warnlen, LOGFILE);
+	parse_cache_store(index, &buf, cvs, warnings, warnlen);
+    }
+digest:
+    if (cache_file != NULL && cvs->verbose)
+	skew_report(cvs);
+    if (sharding)
+	shard_store(index, cvs);
+    stats_lap(PHASE_PARSE, &lap);
     if (cvs_master_digest(cvs, cm, rm) == NULL) {
 	warn("warning - master file %s has no revision number - ignore file\n", file->name);
 	cvs->gen.master_name = NULL;	/* blank out data of previous file */
@@ -153,6 +221,44 @@ rev_list_file(rev_file *file, analysis_t *out, cvs_master *cm, rev_master *rm)
 	out->total_revisions = cvs->nversions;
 	out->skew_vulnerable = cvs->skew_vulnerable;
     }
+    stats_lap(PHASE_DIGEST, &lap);
+    spill_generator(&cvs->gen);
+    out->generator = cvs->gen;
+    cvs_file_free(cvs);
+}
+
+static void
+rev_list_shard(size_t index, rev_file *file, analysis_t *out, cvs_master *cm, rev_master *rm)
+/* rebuild a master from the parse results a shard carries */
+{
+    struct timespec lap;
+    cvs_file *cvs;
+
+    memset(out, '\0', sizeof(analysis_t));
+    cvs = xcalloc(1, sizeof(cvs_file), __func__);
+    cvs->gen.master_name = file->name;
+    cvs->gen.expand = EXPANDUNSPEC;
+    cvs->export_name = file->rectified;
+    cvs->verbose = verbose;
+
+    stats_clock(&lap);
+    if (!shard_fetch(index, cvs, rm)) {
+	warn("%s: could not be read where it was sharded\n", file->name);
+	++err;
+	cvs_file_free(cvs);
+	return;
+    }
+    stats_lap(PHASE_PARSE, &lap);
+    if (cvs_master_digest(cvs, cm, rm) == NULL) {
+	warn("warning - master file %s has no revision number - ignore file\n", file->name);
+	cvs->gen.master_name = NULL;
+    } else {
+	out->total_revisions = cvs->nversions;
+	out->skew_vulnerable = cvs->skew_vulnerable;
+    }
+    stats_lap(PHASE_DIGEST, &lap);
+    /* the snapshots are in the shard, so the deltas are not needed again */
+    generator_free(&cvs->gen);
     out->generator = cvs->gen;
     cvs_file_free(cvs);
 }
@@ -177,6 +283,49 @@ strcommonendingwith(const char *a, const char *b, char endc)
     return d;
 }
 
+static void
+prefetch_master(const rev_file *file)
+/* start the kernel reading in a master we will be parsing shortly */
+{
+#ifdef POSIX_FADV_WILLNEED
+    struct stat st;
+    int fd = open(file->name, O_RDONLY);
+
+    if (fd == -1)
+	return;		/* rev_list_file() will report it */
+    /* a master the parse cache will supply needn't be read now */
+    if (cache_file == NULL || fstat(fd, &st) == -1
+	|| !parse_cache_fresh(file->name, &st))
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif /* POSIX_FADV_WILLNEED */
+}
+
+static void
+prefetch_through(const size_t next)
+/* make sure the masters up to prefetch_ahead past queue slot next are requested */
+{
+    size_t limit = next + 1 + prefetch_ahead, p;
+
+    if (limit > fn_n)
+	limit = fn_n;
+#ifdef THREADS
+    if (threads > 1) {
+	/* each slot is claimed by exactly one worker */
+	p = __atomic_load_n(&prefetch_i, __ATOMIC_RELAXED);
+	while (p < limit)
+	    if (__atomic_compare_exchange_n(&prefetch_i, &p, p + 1, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		prefetch_master(&sorted_files[schedule[p++]]);
+    }
+    else
+#endif /* THREADS */
+	while ((p = prefetch_i) < limit) {
+	    prefetch_i = p + 1;
+	    prefetch_master(&sorted_files[schedule[p]]);
+	}
+}
+
 static void *worker(void *arg)
 /* consume masters off the queue */
 {
@@ -187,18 +336,23 @@ static void *worker(void *arg)
 	/* pop a master off the queue, terminating if none left */
 #ifdef THREADS
 	if (threads > 1)
-	    pthread_mutex_lock(&enqueue_mutex);
+	    i = __atomic_fetch_add(&fn_i, 1, __ATOMIC_RELAXED);
+	else
 #endif /* THREADS */
-	i = fn_i++;
-#ifdef THREADS
-	if (threads > 1)
-	    pthread_mutex_unlock(&enqueue_mutex);
-#endif /* THREADS */
-	if (i >= fn_n)
+	    i = fn_i++;
+	if (i >= fn_n) {
+	    stats_thread_done(PHASE_ANALYSIS);
 	    return(NULL);
+	}
+	if (prefetch_ahead > 0)
+	    prefetch_through(i);
+	i = schedule[i];
 
 	/* process it */
-	rev_list_file(&sorted_files[i], &out, &cvs_masters[i], &rev_masters[i]);
+	if (merging)
+	    rev_list_shard(i, &sorted_files[i], &out, &cvs_masters[i], &rev_masters[i]);
+	else
+	    rev_list_file(i, &sorted_files[i], &out, &cvs_masters[i], &rev_masters[i]);
 
 	/* pass it to the next stage */
 #ifdef THREADS
@@ -292,12 +446,88 @@ path_deep_compare(const void *a, const void *b)
     return compar;
 }
 
+static char *
+deep_sort_key(const char *path)
+/* a key whose strcmp() order is the path_deep_compare() order of path */
+{
+    /*
+     * path_deep_compare() is strcmp() except that a file sorts after
+     * everything below its own directory.  Putting a byte above any
+     * that can start a name in front of the final component gets
+     * that from plain strcmp(), with no strrchr() on every comparison.
+     */
+    const char *base = strrchr(path, '/');
+    size_t dirlen = base ? base + 1 - path : 0;
+    size_t len = strlen(path);
+    char *key = xmalloc(len + 2, __func__);
+
+    memcpy(key, path, dirlen);
+    key[dirlen] = '\xff';
+    memcpy(key + dirlen + 1, path + dirlen, len - dirlen + 1);
+    return key;
+}
+
 static int 
 file_compare(const void *f1, const void *f2)
 {
-    rev_file r1 = *(rev_file *)f1;
-    rev_file r2 = *(rev_file *)f2;
-    return path_deep_compare(r1.rectified, r2.rectified);
+    const rev_file *r1 = f1, *r2 = f2;
+    int compar = strcmp(r1->key, r2->key);
+
+    /* a master and its Attic twin: keep the result independent of input order */
+    if (compar == 0)
+	compar = strcmp(r1->name, r2->name);
+    return compar;
+}
+
+static int
+schedule_compare(const void *s1, const void *s2)
+/* biggest masters first, so no big one gets started late */
+{
+    size_t i1 = *(size_t *)s1, i2 = *(size_t *)s2;
+
+    if (sorted_files[i1].size != sorted_files[i2].size)
+	return (sorted_files[i1].size < sorted_files[i2].size) ? 1 : -1;
+    return (i1 < i2) ? -1 : (i1 > i2);
+}
+
+static void
+add_master(const char *file, const off_t size, const bool promiscuous,
+	   forest_t *forest)
+/* queue a file for analysis if it looks like a master */
+{
+    static const char *last;
+    size_t i;
+    int c;
+
+    if (!promiscuous)
+    {
+	const char *end = file + strlen(file);
+	if (end - file < 2 || end[-1] != 'v' || end[-2] != ',')
+	    return;
+	if (strstr(file, "CVSROOT") != NULL)
+	    return;
+    }
+    forest->textsize += size;
+
+    fn = xcalloc(1, sizeof(rev_filename), "filename gathering");
+    fn->size = size;
+    *fn_tail = fn;
+    fn_tail = (rev_filename **)&fn->next;
+    if (striplen > 0 && last != NULL) {
+	c = strcommonendingwith(file, last, '/');
+	if (c < striplen)
+	    striplen = c;
+    } else if (striplen < 0) {
+	striplen = 0;
+	for (i = 0; i < strlen(file); i++)
+	    if (file[i] == '/')
+		striplen = i + 1;
+    }
+    fn->file = atom(file);
+    last = fn->file;
+    total_files++;
+    if (progress && total_files % 100 == 0)
+	progress_jump(total_files);
 }
 
 void analyze_masters(int argc, char *argv[], 
@@ -306,10 +536,8 @@ void analyze_masters(int argc, char *argv[],
 /* main entry point; collect and parse CVS masters */
 {
     char	    name[PATH_MAX];
-    const char      *last = NULL;
-    char	    *file;
+    char	    *file, *dot[3] = {NULL, ".", NULL};
     size_t	    i, j = 1;
-    int		    c;
 #ifdef THREADS
     pthread_attr_t  attr;
 
@@ -321,10 +549,32 @@ void analyze_masters(int argc, char *argv[],
 #endif /* THREADS */
 
     striplen = analyzer->striplen;
+    sharding = analyzer->nshards > 0;
+    merging = analyzer->merge;
+
+    /* with nothing named, walk the current directory as "find ." would */
+    if (argc < 2 && analyzer->walk && !merging) {
+	dot[0] = argv[0];
+	argv = dot;
+	argc = 2;
+    }
 
     forest->textsize = forest->filecount = 0;
     progress_begin("Reading file list...", NO_MAX);
-    for (;;)
+    if (merging) {
+	/* the list comes from the shards; they have done the filtering */
+	size_t n;
+
+	if (argc < 2)
+	    fatal_error("--merge needs the shard files as arguments\n");
+	n = shard_load(argc - 1, argv + 1);
+	for (i = 0; i < n; i++) {
+	    off_t size;
+	    const char *name = shard_name(i, &size);
+	    add_master(name, size, true, forest);
+	}
+    }
+    else for (;;)
     {
 	struct stat stb;
 	int l;
@@ -344,36 +594,21 @@ void analyze_masters(int argc, char *argv[],
 
 	if (stat(file, &stb) != 0)
 	    continue;
-	else if (S_ISDIR(stb.st_mode) != 0)
+	else if (S_ISDIR(stb.st_mode) != 0) {
+	    if (analyzer->walk) {
+		walk_entry_t *found;
+		size_t nfound = walk_masters(file, &found);
+
+		for (i = 0; i < nfound; i++) {
+		    add_master(found[i].name, found[i].size,
+			       analyzer->promiscuous, forest);
+		    free(found[i].name);
+		}
+		free(found);
+	    }
 	    continue;
-	else if (!analyzer->promiscuous)
-	{
-	    char *end = file + strlen(file);
-	    if (end - file < 2 || end[-1] != 'v' || end[-2] != ',')
-		continue;
-	    if (strstr(file, "CVSROOT") != NULL)
-		continue;
-	}
-	forest->textsize += stb.st_size;
-
-	fn = xcalloc(1, sizeof(rev_filename), "filename gathering");
-	*fn_tail = fn;
-	fn_tail = (rev_filename **)&fn->next;
-	if (striplen > 0 && last != NULL) {
-	    c = strcommonendingwith(file, last, '/');
-	    if (c < striplen)
-		striplen = c;
-	} else if (striplen < 0) {
-	    striplen = 0;
-	    for (i = 0; i < strlen(file); i++)
-		if (file[i] == '/')
-		    striplen = i + 1;
 	}
-	fn->file = atom(file);
-	last = fn->file;
-	total_files++;
-	if (progress && total_files % 100 == 0)
-	    progress_jump(total_files);
+	add_master(file, stb.st_size, analyzer->promiscuous, forest);
     }
     forest->filecount = total_files;
 
@@ -387,7 +622,10 @@ void analyze_masters(int argc, char *argv[],
     for (fn = fn_head; fn; fn = tn) {
 	tn = fn->next;
 	sorted_files[i].name = fn->file;
-	sorted_files[i++].rectified = atom_rectify_name(fn->file);
+	sorted_files[i].size = fn->size;
+	sorted_files[i].rectified = atom_rectify_name(fn->file);
+	sorted_files[i].key = deep_sort_key(sorted_files[i].rectified);
+	i++;
 	free(fn);
     }
     /*
@@ -399,13 +637,65 @@ void analyze_masters(int argc, char *argv[],
      * e.g. .cvsignore becomes .gitignore
      */
     qsort(sorted_files, total_files, sizeof(rev_file), file_compare);
-	
+    for (i = 0; i < (size_t)total_files; i++)
+	free(sorted_files[i].key);
+
+    /*
+     * Hand out work in descending order of master size.  Parse time is
+     * roughly proportional to size, so starting the biggest masters
+     * first keeps one huge file picked up near the end from becoming
+     * the critical path while the other threads sit idle.  Results are
+     * still stored by sorted_files index, so output order is unaffected.
+     */
+    schedule = xmalloc(sizeof(size_t) * total_files, "schedule");
+    for (i = 0; i < (size_t)total_files; i++)
+	schedule[i] = i;
+#ifdef THREADS
+    if (threads > 1 && !sharding)
+	qsort(schedule, total_files, sizeof(size_t), schedule_compare);
+#endif /* THREADS */
+
+    /*
+     * A node of a sharded run deals the masters out by size, the same
+     * way whatever its thread count, and keeps only its own hand.
+     */
+    if (sharding) {
+	size_t owned = 0;
+
+	qsort(schedule, total_files, sizeof(size_t), schedule_compare);
+	shard_begin(analyzer->shard, analyzer->nshards, total_files);
+	for (i = 0; i < (size_t)total_files; i++) {
+	    bool mine = i % analyzer->nshards == analyzer->shard;
+
+	    shard_add(schedule[i], sorted_files[schedule[i]].name,
+		      sorted_files[schedule[i]].size, mine);
+	    if (mine)
+		schedule[owned++] = schedule[i];
+	}
+	fn_n = owned;
+    }
+
     progress_end("done, %.3fKB in %d files",
 		 (forest->textsize/1024.0), forest->filecount);
 
+    /*
+     * The atom tables can't grow while workers are interning into them,
+     * so size them now from rough per-file and per-byte yields.
+     */
+    atom_reserve((size_t)total_files * ATOMS_PER_MASTER
+		     + forest->textsize / BYTES_PER_ATOM,
+		 forest->textsize / BYTES_PER_NUMBER);
+
     /* things that must be visible to inner functions */
     load_current_file = 0;
     verbose = analyzer->verbose;
+    /* a merge reads no masters, so it has nothing to prefetch or cache */
+    prefetch_ahead = merging ? 0 : analyzer->prefetch;
+    prefetch_i = 0;
+    if ((cache_file = merging ? NULL : analyzer->cache_file) != NULL)
+	parse_cache_load(cache_file, total_files);
+    if (analyzer->spill_budget >= 0)
+	spill_init(analyzer->spill_budget);
 
     /*
      * Analyze the files for CVS revision structure.
@@ -422,7 +712,7 @@ void analyze_masters(int argc, char *argv[],
     else
 #endif /* THREADS */
 	strcpy(name, "Analyzing masters...");
-    progress_begin(name, total_files);
+    progress_begin(name, fn_n);
 #ifdef THREADS
     if (threads > 1)
     {
@@ -436,14 +726,27 @@ void analyze_masters(int argc, char *argv[],
 	for (i = 0; i < threads; i++)
           pthread_join(workers[i], NULL);
         
-	pthread_mutex_destroy(&enqueue_mutex);
 	pthread_mutex_destroy(&revlist_mutex);
     }
     else
 #endif /* THREADS */
 	worker(NULL);
 
-    progress_end("done, %d revisions", (int)total_revisions);
+    /* gather tags from the shards of the tag table, in path order */
+    sort_tags();
+
+    if (cache_file != NULL) {
+	size_t hits = parse_cache_save(cache_file);
+	progress_end("done, %d revisions, %d masters from cache",
+		     (int)total_revisions, (int)hits);
+    } else
+	progress_end("done, %d revisions", (int)total_revisions);
+    if (verbose && analyzer->spill_budget >= 0) {
+	size_t bytes, spilled = spill_report(&bytes);
+	announce("%zu masters spilled, %.3fKB of metadata\n",
+		 spilled, bytes / 1024.0);
+    }
+    free(schedule);
     free(sorted_files);
 
     forest->errcount = err;
@@ -0,0 +1,141 @@
+/*
+ * The library entry points, and the globals the command and the library
+ * share.  cfe_convert() runs the same phases main() does, with options
+ * taken from a structure rather than the command line and the export
+ * delivered to a sink rather than to standard output.  See
+ * cvs-fast-export.h for the interface itself.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <unistd.h>
+#include <time.h>
+
+#include "cvs.h"
+#include "revdir.h"
+#include "cvs-fast-export.h"
+
+/* options */
+int commit_time_window = 300;
+bool trust_commitids = true;
+bool progress = false;
+FILE *LOGFILE;
+#ifdef THREADS
+int threads = NO_MAX;
+#endif /* THREADS */
+
+void cfe_options_init(cfe_options_t *options)
+/* set options to the command's defaults */
+{
+    memset(options, '\0', sizeof(cfe_options_t));
+    options->version = CFE_API_VERSION;
+    options->order = cfe_adaptive;
+    options->branch_prefix = "refs/heads/";
+    options->commit_time_window = 300;
+    options->trust_commitids = true;
+    options->spill_budget = -1;
+    options->prefetch = 16;
+}
+
+int cfe_convert(const cfe_options_t *options,
+		const char *const *masters, const size_t nmasters,
+		const cfe_sink_t *sink)
+/* convert the named masters, feeding the result to sink */
+{
+    static bool converted;
+    forest_t forest;
+    export_stats_t export_stats;
+    export_options_t export_options = {
+	.id_token_expand = EXPANDUNSPEC,
+    };
+    import_options_t import_options = {
+	.striplen = -1,
+    };
+    char **argv;
+    size_t i;
+
+    if (options->version != CFE_API_VERSION)
+	fatal_error("library interface version %d requested, %d provided\n",
+		    options->version, CFE_API_VERSION);
+    /* the phases below keep their state in globals */
+    if (converted)
+	fatal_error("only one conversion can be run per process\n");
+    converted = true;
+
+    /* force times using mktime to be interpreted in UTC */
+    setenv("TZ", "UTC", 1);
+    if (LOGFILE == NULL)
+	LOGFILE = stderr;
+
+#ifdef THREADS
+    threads = options->threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    if (threads <= 0)
+	threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+#endif /*  _SC_NPROCESSORS_ONLN */
+#endif /* THREADS */
+    commit_time_window = options->commit_time_window;
+    trust_commitids = options->trust_commitids;
+    if (options->authormap != NULL && !load_author_map(options->authormap))
+	fatal_error("cannot load author map %s\n", options->authormap);
+
+    import_options.promiscuous = options->promiscuous;
+    /* as for -s: "" strips nothing, while NULL leaves the common prefix */
+    if (options->strip != NULL) {
+	import_options.striplen = strlen(options->strip);
+	if (import_options.striplen != 0)
+	    import_options.striplen++;
+    }
+    import_options.cache_file = options->cache_file;
+    import_options.spill_budget = options->spill_budget;
+    import_options.prefetch = options->prefetch;
+    import_options.walk = options->walk;
+
+    clock_gettime(CLOCK_REALTIME, &export_options.start_time);
+    if (options->expand != NULL)
+	export_options.id_token_expand = expand_override(options->expand);
+    export_options.branch_prefix = (char *)(options->branch_prefix ?
+					    options->branch_prefix : "refs/heads/");
+    export_options.fromtime = options->fromtime;
+    export_options.reposurgeon = options->revisions;
+    export_options.force_dates = options->force_dates;
+    switch (options->order) {
+    case cfe_fast:
+	export_options.reportmode = fast;
+	break;
+    case cfe_canonical:
+	export_options.reportmode = canonical;
+	break;
+    default:
+	export_options.reportmode = adaptive;
+	break;
+    }
+    export_options.dedup_blobs = options->dedup_blobs;
+    export_options.import_marks = options->import_marks;
+    export_options.export_marks = options->export_marks;
+    export_options.sink = sink;
+    memset(&export_stats, '\0', sizeof(export_stats_t));
+
+    /* analyze_masters() takes its list the way main() gets it */
+    argv = xcalloc(nmasters + 2, sizeof(char *), __func__);
+    argv[0] = "cvs-fast-export";
+    for (i = 0; i < nmasters; i++)
+	argv[i + 1] = (char *)masters[i];
+
+    analyze_masters(nmasters + 1, argv, &import_options, &forest);
+    /* about one packed directory per revision; the table grows if not */
+    revdir_reserve(forest.total_revisions);
+    forest.git = collate_to_changesets(forest.cvs, forest.filecount, 0);
+    if (forest.git)
+	export_commits(&forest, &export_options, &export_stats);
+
+    free(argv);
+    discard_atoms();
+    discard_tags();
+    revdir_free();
+    spill_free();
+    free_author_map();
+    return forest.errcount;
+}
+
+/* end */
@@ -15,15 +15,6 @@
 #include <malloc.h>
 #endif /* __GLIBC__ */
 
-/* options */
-int commit_time_window = 300;
-bool trust_commitids = true;
-bool progress = false;
-FILE *LOGFILE;
-#ifdef THREADS
-int threads = NO_MAX;
-#endif /* THREADS */
-
 static int get_int_substr(const char * str, const regmatch_t * p)
 {
     char buff[256];
@@ -182,6 +173,8 @@ main(int argc, char **argv)
 
     import_options_t import_options = {
 	.striplen = -1,
+	.spill_budget = -1,
+	.prefetch = 16,
     };
 
 #if defined(__GLIBC__)
@@ -201,6 +194,12 @@ main(int argc, char **argv)
 
     LOGFILE = stderr;
 
+    /* codes for options that have no short form */
+    enum { LONG_CACHE = 256, LONG_STATS_JSON, LONG_SPILL_BUDGET, LONG_OUTPUT_BUFFER,
+	   LONG_DEDUP_BLOBS, LONG_IMPORT_MARKS, LONG_EXPORT_MARKS, LONG_PREFETCH,
+	   LONG_WALK, LONG_SHARD, LONG_MERGE };
+    const char *stats_file = NULL;
+
     while (1) {
 	static const struct option options[] = {
 	    { "help",		    0, 0, 'h' },
@@ -225,6 +224,17 @@ main(int argc, char **argv)
             { "canonical",          0, 0, 'C' },
             { "fast",               0, 0, 'F' },
             { "embed-id",           0, 0, 'E' },
+            { "cache",              1, 0, LONG_CACHE },
+            { "stats-json",         1, 0, LONG_STATS_JSON },
+            { "spill-budget",       1, 0, LONG_SPILL_BUDGET },
+            { "output-buffer",      1, 0, LONG_OUTPUT_BUFFER },
+            { "dedup-blobs",        0, 0, LONG_DEDUP_BLOBS },
+            { "import-marks",       1, 0, LONG_IMPORT_MARKS },
+            { "export-marks",       1, 0, LONG_EXPORT_MARKS },
+            { "prefetch",           1, 0, LONG_PREFETCH },
+            { "walk",               0, 0, LONG_WALK },
+            { "shard",              1, 0, LONG_SHARD },
+            { "merge",              0, 0, LONG_MERGE },
 	    { "sizes",              0, 0, 'S' },	/* undocumented */
 	    { NULL,                 0, 0, '\0'}, 
 	};
@@ -256,8 +266,20 @@ main(int argc, char **argv)
 		   " -v --verbose                    Show verbose progress messages\n"
 		   " -q --quiet                      Suppress normal warnings\n"
 		   " -i --incremental=TIME           Incremental dump beginning after specified RFC3339-format TIME.\n"
-		   " -t --threads=N                  Use threaded scheduler with N threads for CVS master analyses.\n"
+		   " -t --threads=N                  Use threaded scheduler with N threads for CVS master analyses\n"
+		   "                                 and snapshot generation.\n"
 		   " -E --embed-id                   Embed CVS revisions in the commit messages.\n"
+		   "    --cache=CACHE_FILE           Reuse parses of unchanged masters saved in CACHE_FILE\n"
+		   "    --stats-json=STATS_FILE      Write per-phase timing and resource statistics as JSON\n"
+		   "    --spill-budget=MB            Spill delta metadata beyond MB megabytes to a temporary file\n"
+		   "    --output-buffer=KB           Size of the standard output buffer (default 1024)\n"
+		   "    --dedup-blobs                Emit each distinct file content only once\n"
+		   "    --import-marks=MARKS_FILE    Skip blobs, commits and resets shipped by an earlier run\n"
+		   "    --export-marks=MARKS_FILE    Save marks and branch tips for a later --import-marks\n"
+		   "    --prefetch=N                 Read N masters ahead of the parsers (default 16, 0 for none)\n"
+		   "    --walk                       Find masters under directory arguments (default .) ourselves\n"
+		   "    --shard=K/N                  Write shard K of N for a later --merge, not a stream\n"
+		   "    --merge                      Export from the shard files named as arguments\n"
 		   "\n"
 		   "Example: find | cvs-fast-export\n");
 	    return 0;
@@ -351,6 +373,49 @@ main(int argc, char **argv)
 	case 'S':
 	    print_sizes();
 	    return 0;
+	case LONG_CACHE:
+	    import_options.cache_file = optarg;
+	    break;
+	case LONG_STATS_JSON:
+	    stats_file = optarg;
+	    collect_stats = true;
+	    break;
+	case LONG_SPILL_BUDGET:
+	    if (atol(optarg) < 0)
+		fatal_error("--spill-budget must be non-negative\n");
+	    import_options.spill_budget = atol(optarg) * 1024 * 1024;
+	    break;
+	case LONG_OUTPUT_BUFFER:
+	    if (atol(optarg) <= 0)
+		fatal_error("--output-buffer must be positive\n");
+	    export_options.output_buffer = atol(optarg) * 1024;
+	    break;
+	case LONG_PREFETCH:
+	    if (atol(optarg) < 0)
+		fatal_error("--prefetch must be non-negative\n");
+	    import_options.prefetch = atol(optarg);
+	    break;
+	case LONG_WALK:
+	    import_options.walk = true;
+	    break;
+	case LONG_SHARD:
+	    if (sscanf(optarg, "%u/%u", &import_options.shard,
+		       &import_options.nshards) != 2
+		|| import_options.shard >= import_options.nshards)
+		fatal_error("--shard takes K/N, with K from 0 to N-1\n");
+	    break;
+	case LONG_MERGE:
+	    import_options.merge = true;
+	    break;
+	case LONG_DEDUP_BLOBS:
+	    export_options.dedup_blobs = true;
+	    break;
+	case LONG_IMPORT_MARKS:
+	    export_options.import_marks = optarg;
+	    break;
+	case LONG_EXPORT_MARKS:
+	    export_options.export_marks = optarg;
+	    break;
 	default: /* error message already emitted */
 	    announce("try `%s --help' for more information.\n", argv[0]);
 	    return 1;
@@ -361,6 +426,8 @@ main(int argc, char **argv)
 	if (export_options.embed_ids)
 	    fatal_error("The options --reposurgeon and --embed-id cannot be combined.\n");
     }
+    if (import_options.nshards > 0 && import_options.merge)
+	fatal_error("The options --shard and --merge cannot be combined.\n");
 
     argv[optind-1] = argv[0];
     argv += optind-1;
@@ -376,16 +443,30 @@ main(int argc, char **argv)
     gather_stats("before parsing");
 
     /* build CVS structures by parsing masters; may read stdin */
+    stats_begin(PHASE_ANALYSIS);
     analyze_masters(argc, argv, &import_options, &forest);
+    stats_end(PHASE_ANALYSIS);
 
     gather_stats("after parsing");
 
-    /* commit set coalescence happens here */
-    forest.git = collate_to_changesets(forest.cvs, 
-				     forest.filecount,
-				     import_options.verbose);
-
-    gather_stats("after branch collation");
+    if (import_options.nshards > 0) {
+	/* a node of a sharded run stops short of collation */
+	stats_begin(PHASE_SNAPSHOTS);
+	shard_write(&forest, &export_options);
+	stats_end(PHASE_SNAPSHOTS);
+	forest.git = NULL;
+    } else {
+	/* commit set coalescence happens here */
+	stats_begin(PHASE_COLLATION);
+	/* about one packed directory per revision; the table grows if not */
+	revdir_reserve(forest.total_revisions);
+	forest.git = collate_to_changesets(forest.cvs, 
+					 forest.filecount,
+					 import_options.verbose);
+	stats_end(PHASE_COLLATION);
+
+	gather_stats("after branch collation");
+    }
 
     /* report on the DAG */
     if (forest.git) {
@@ -426,6 +507,9 @@ main(int argc, char **argv)
 		(int)(export_stats.export_total_commits / elapsed));
     }
 
+    if (stats_file != NULL)
+	stats_write(stats_file, &forest, &export_stats);
+
     if (LOGFILE != stderr) {
 	if (warncount > 0)
 	    fprintf(STATUS, "cvs-fast-export: %u warning(s).\n", warncount);
@@ -435,6 +519,8 @@ main(int argc, char **argv)
     discard_atoms();
     discard_tags();
     revdir_free();
+    spill_free();
+    shard_free();
     free_author_map();
     return forest.errcount > 0;
 }
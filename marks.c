@@ -0,0 +1,292 @@
+/*
+ * Persistent export state for resumable conversions.
+ *
+ * --export-marks writes down, as a run ships them, the mark of every
+ * blob (keyed by path and CVS revision), of every commit (keyed by a
+ * digest of its branch, date, parent mark and fileops) and the mark
+ * every branch head and tag was last reset to.  --import-marks reads
+ * such a file back, so that a later run over the same repository can
+ * skip everything that already went out: known blobs and commits take
+ * their old marks without being emitted again, resets are emitted
+ * only for refs that moved, and new marks are numbered above the old
+ * ones.  The stream then only makes sense to a git fast-import that
+ * has the marks of the earlier runs loaded, e.g. with
+ * --import-marks-if-exists and --export-marks on the same file.
+ *
+ * The file is plain text, one record per line:
+ *
+ *	blob :MARK REVISION PATH
+ *	commit :MARK DIGEST
+ *	head :MARK REF
+ *	tag :MARK NAME
+ *
+ * It is written to a temporary name while the export runs and renamed
+ * into place only when the export finishes, so a failed run leaves the
+ * previous state intact.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
+
+#include "cvs.h"
+#include "hash.h"
+
+#define MARKS_MAGIC	"# cvs-fast-export marks 1\n"
+
+typedef struct _mark_entry {
+    hash_digest_t	key;
+    serial_t		mark;		/* 0 marks an empty slot */
+} mark_entry_t;
+
+static mark_entry_t	*known;
+static size_t		known_size, known_count;
+static serial_t		known_highest;
+
+static FILE		*marks_fp;
+static char		marks_path[PATH_MAX], marks_tmp[PATH_MAX];
+#ifdef THREADS
+static pthread_mutex_t	marks_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* THREADS */
+
+static void key_digest(const char kind, const char *a, const char *b,
+		       hash_digest_t *digest)
+/* digest a record key: its kind and one or two strings */
+{
+    char buf[BUFSIZ], *spill = NULL, *key = buf;
+    size_t alen = strlen(a), blen = b ? strlen(b) : 0;
+    size_t len = 1 + alen + 1 + blen;
+
+    if (len > sizeof(buf))
+	key = spill = xmalloc(len, "marks key");
+    key[0] = kind;
+    memcpy(key + 1, a, alen + 1);
+    if (b)
+	memcpy(key + 1 + alen + 1, b, blen);
+    hash_digest(key, len, digest);
+    free(spill);
+}
+
+static mark_entry_t *known_slot(const hash_digest_t *key)
+/* find the slot for a key, growing the table as needed */
+{
+    mark_entry_t *e;
+    size_t i;
+
+    if (known_count * 2 >= known_size) {
+	mark_entry_t *old = known;
+	size_t oldsize = known_size;
+
+	known_size = known_size ? known_size * 2 : 4096;
+	known = xcalloc(known_size, sizeof(mark_entry_t), "marks table");
+	for (i = 0; i < oldsize; i++)
+	    if (old[i].mark != 0)
+		*known_slot(&old[i].key) = old[i];
+	free(old);
+    }
+    for (i = key->lo & (known_size - 1);; i = (i + 1) & (known_size - 1)) {
+	e = &known[i];
+	if (e->mark == 0 || (e->key.lo == key->lo && e->key.hi == key->hi))
+	    return e;
+    }
+}
+
+static void known_enter(const hash_digest_t *key, const serial_t mark)
+{
+    mark_entry_t *e = known_slot(key);
+
+    if (e->mark == 0)
+	known_count++;
+    e->key = *key;
+    e->mark = mark;
+    if (mark > known_highest)
+	known_highest = mark;
+}
+
+static serial_t known_find(const hash_digest_t *key)
+{
+    size_t i;
+
+    if (known_count == 0)
+	return 0;
+    for (i = key->lo & (known_size - 1);; i = (i + 1) & (known_size - 1)) {
+	if (known[i].mark == 0)
+	    return 0;
+	if (known[i].key.lo == key->lo && known[i].key.hi == key->hi)
+	    return known[i].mark;
+    }
+}
+
+static bool parse_digest(const char *text, hash_digest_t *digest)
+{
+    return sscanf(text, "%16" SCNx64 "%16" SCNx64, &digest->hi, &digest->lo) == 2;
+}
+
+void marks_load(const char *path)
+/* read the state left by an earlier run with --export-marks */
+{
+    FILE *fp;
+    char line[PATH_MAX + CVS_MAX_REV_LEN + 64];
+    unsigned lineno = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	fatal_system_error("cannot open marks file %s", path);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	char kind[16], *rest, *nl;
+	unsigned mark;
+	int used;
+	hash_digest_t key;
+
+	lineno++;
+	if (line[0] == '#' || line[0] == '\n')
+	    continue;
+	if ((nl = strchr(line, '\n')) != NULL)
+	    *nl = '\0';
+	if (sscanf(line, "%15s :%u %n", kind, &mark, &used) != 2 || mark == 0)
+	    fatal_error("%s:%u: malformed marks record\n", path, lineno);
+	rest = line + used;
+	if (strcmp(kind, "blob") == 0) {
+	    char *path_part = strchr(rest, ' ');
+	    if (path_part == NULL)
+		fatal_error("%s:%u: malformed blob record\n", path, lineno);
+	    *path_part++ = '\0';
+	    key_digest('b', path_part, rest, &key);
+	} else if (strcmp(kind, "commit") == 0) {
+	    if (!parse_digest(rest, &key))
+		fatal_error("%s:%u: malformed commit record\n", path, lineno);
+	} else if (strcmp(kind, "head") == 0)
+	    key_digest('h', rest, NULL, &key);
+	else if (strcmp(kind, "tag") == 0)
+	    key_digest('t', rest, NULL, &key);
+	else
+	    fatal_error("%s:%u: unknown marks record '%s'\n", path, lineno, kind);
+	known_enter(&key, mark);
+    }
+    if (ferror(fp))
+	fatal_system_error("reading marks file %s", path);
+    fclose(fp);
+}
+
+serial_t marks_highest(void)
+/* the highest mark an earlier run used; new ones must go above it */
+{
+    return known_highest;
+}
+
+void marks_open(const char *path)
+/* start recording this run's state, to replace path when export ends */
+{
+    snprintf(marks_path, sizeof(marks_path), "%s", path);
+    snprintf(marks_tmp, sizeof(marks_tmp), "%s.tmp", path);
+    if ((marks_fp = fopen(marks_tmp, "w")) == NULL)
+	fatal_system_error("cannot write marks file %s", marks_tmp);
+    fputs(MARKS_MAGIC, marks_fp);
+}
+
+static void note(const char *format, ...)
+/* append one record to the marks file being written */
+{
+    va_list args;
+
+    if (marks_fp == NULL)
+	return;
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_lock(&marks_mutex);
+#endif /* THREADS */
+    va_start(args, format);
+    vfprintf(marks_fp, format, args);
+    va_end(args);
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_unlock(&marks_mutex);
+#endif /* THREADS */
+}
+
+serial_t marks_find_blob(const cvs_commit *c)
+/* the mark an earlier run shipped this revision's content under, or 0 */
+{
+    char rev[CVS_MAX_REV_LEN + 1];
+    hash_digest_t key;
+
+    if (known_count == 0)
+	return 0;
+    cvs_number_string(c->number, rev, sizeof(rev));
+    key_digest('b', c->master->fileop_name, rev, &key);
+    return known_find(&key);
+}
+
+void marks_note_blob(const cvs_commit *c, const serial_t mark)
+/* record the mark this revision's content went out under */
+{
+    char rev[CVS_MAX_REV_LEN + 1];
+
+    if (marks_fp == NULL)
+	return;
+    note("blob :%u %s %s\n", (unsigned)mark,
+	 cvs_number_string(c->number, rev, sizeof(rev)), c->master->fileop_name);
+}
+
+serial_t marks_find_commit(const char *key, const size_t len)
+/* the mark an earlier run gave the commit with this key, or 0 */
+{
+    hash_digest_t digest;
+
+    if (known_count == 0)
+	return 0;
+    hash_digest(key, len, &digest);
+    return known_find(&digest);
+}
+
+void marks_note_commit(const char *key, const size_t len, const serial_t mark)
+/* record the mark of a commit */
+{
+    hash_digest_t digest;
+
+    if (marks_fp == NULL)
+	return;
+    hash_digest(key, len, &digest);
+    note("commit :%u %016" PRIx64 "%016" PRIx64 "\n", (unsigned)mark,
+	 digest.hi, digest.lo);
+}
+
+serial_t marks_find_ref(const char kind, const char *name)
+/* the mark an earlier run left a head ('h') or tag ('t') at, or 0 */
+{
+    hash_digest_t key;
+
+    if (known_count == 0)
+	return 0;
+    key_digest(kind, name, NULL, &key);
+    return known_find(&key);
+}
+
+void marks_note_ref(const char kind, const char *name, const serial_t mark)
+/* record where a head ('h') or tag ('t') now points */
+{
+    if (marks_fp == NULL)
+	return;
+    note("%s :%u %s\n", kind == 'h' ? "head" : "tag", (unsigned)mark, name);
+}
+
+void marks_save(void)
+/* finish this run's marks file, replacing the old one */
+{
+    if (marks_fp != NULL) {
+	if (fclose(marks_fp) != 0 || rename(marks_tmp, marks_path) != 0) {
+	    (void)unlink(marks_tmp);
+	    fatal_system_error("cannot write marks file %s", marks_path);
+	}
+	marks_fp = NULL;
+    }
+    free(known);
+    known = NULL;
+    known_size = known_count = 0;
+    known_highest = 0;
+}
+
+/* end */
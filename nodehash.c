@@ -28,12 +28,13 @@ node_for_cvs_number(nodehash_t *context, const cvs_number *const n)
 	    return p;
 
     /*
-     * While it looks like a good idea, an attempt at slab allocation
-     * failed miserably here.  Noted because the regression-test
-     * suite didn't catch it.  Attempting to convert groff did.  The
-     * problem shows as difficult-to-interpret errors under valgrind.
+     * An earlier attempt at slab allocation failed miserably here.
+     * Noted because the regression-test suite didn't catch it.
+     * Attempting to convert groff did.  The problem showed as
+     * difficult-to-interpret errors under valgrind.  The arena never
+     * moves or reuses storage, so nodes stay put until clean_hash().
      */
-    p = xcalloc(1, sizeof(node_t), "hash number generation");
+    p = arena_alloc(&context->arena, sizeof(node_t), "hash number generation");
     p->number = k;
     p->hash_next = context->table[hash];
     context->table[hash] = p;
@@ -104,18 +105,10 @@ void hash_branch(nodehash_t *context, cvs_branch *b)
 }
 
 void clean_hash(nodehash_t *context)
-/* discard the node list */
+/* discard the node list, and the versions, patches and branches with it */
 {
-    int i;
-    for (i = 0; i < NODE_HASH_SIZE; i++) {
-	node_t *p = context->table[i];
-	context->table[i] = NULL;
-	while (p) {
-	    node_t *q = p->hash_next;
-	    free(p);
-	    p = q;
-	}
-    }
+    memset(context->table, 0, sizeof(context->table));
+    arena_free(&context->arena);
     context->nentries = 0;
     context->head_node = NULL;
 }
@@ -0,0 +1,571 @@
+/*
+ * Persistent cache of parsed CVS masters.
+ *
+ * Lexing and parsing every master dominates analysis time, but on a
+ * live repository that is converted over and over, almost all masters
+ * are unchanged between runs.  This module saves what the grammar
+ * extracts from each master - the header, symbols, delta metadata and
+ * the offsets of the delta texts, but not the texts themselves - keyed
+ * by path, modification time, size and inode.  A master whose key still
+ * matches is rebuilt from the cache and never goes through lex.l and
+ * gram.y.  cvs_master_digest() runs on the result as usual, since what
+ * it builds is full of pointers to shared structures.
+ *
+ * The warnings a master's parse gave are kept in its entry and issued
+ * again on a hit, so a warm run says what a cold one did.  An entry
+ * filled under -q has none, and a run that is not quiet parses the
+ * master again rather than trust it.  The skew notes of -v depend on
+ * the run rather than the master, so the caller remakes those from the
+ * revisions either way.
+ *
+ * The file format is a byte dump in host order; it is not meant to be
+ * moved between machines.  A cache written by a different version of
+ * the format, or any entry that fails its checksum or does not decode,
+ * is simply ignored and the master parsed again.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "cvs.h"
+#include "hash.h"
+
+#define CACHE_MAGIC	"cvs-fast-export parse cache 4\n"
+#define NO_STRING	UINT32_MAX
+
+typedef struct _cache_buf {
+    char	*data;
+    size_t	len, alloc;
+} cache_buf_t;
+
+typedef struct _cache_key {
+    int64_t	mtime_sec, mtime_nsec;
+    int64_t	size;
+    uint64_t	ino;
+} cache_key_t;
+
+typedef struct _cache_entry {
+    const char	*name;		/* an atom, so the pointer is the key */
+    cache_key_t	key;
+    const char	*payload;
+    size_t	length;
+    const char	*warnings;	/* as captured from the parse */
+    size_t	warnlen;
+    uint32_t	quiet;		/* filled under -q, so warnings unknown */
+    hash_t	sum;		/* of the payload and warnings, to catch damage */
+    bool	owned;		/* payload and warnings allocated this run */
+} cache_entry_t;
+
+static char		*old_image;	/* contents of the cache file */
+static cache_entry_t	*old_entries;
+static size_t		old_count;
+static cache_entry_t	*new_entries;	/* one per master this run */
+static size_t		new_count;
+static volatile size_t	cache_hits;
+
+static hash_t payload_sum(const char *data, const size_t len)
+/* checksum an entry with a hash that is the same in every build */
+{
+    hash_digest_t digest;
+
+    hash_digest(data, len, &digest);
+    return (hash_t)digest.lo;
+}
+
+static hash_t entry_sum(const cache_entry_t *e)
+{
+    return HASH_COMBINE(payload_sum(e->payload, e->length),
+			payload_sum(e->warnings, e->warnlen));
+}
+
+static void key_from_stat(cache_key_t *key, const struct stat *st)
+{
+    memset(key, '\0', sizeof(cache_key_t));
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->size = st->st_size;
+    key->ino = st->st_ino;
+}
+
+/* serialization */
+
+static void put(cache_buf_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->alloc) {
+	b->alloc = (b->alloc + len) * 2;
+	b->data = xrealloc(b->data, b->alloc, __func__);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+#define PUT(b, v)	put((b), &(v), sizeof(v))
+
+static void put_string(cache_buf_t *b, const char *s)
+{
+    uint32_t len = s ? strlen(s) : NO_STRING;
+
+    PUT(b, len);
+    if (s)
+	put(b, s, len);
+}
+
+static void put_number(cache_buf_t *b, const cvs_number *n)
+{
+    short c = n ? n->c : -1;
+
+    PUT(b, c);
+    if (n)
+	put(b, n->n, c * sizeof(short));
+}
+
+static void cache_serialize(cache_buf_t *b, const cvs_file *cvs)
+/* dump the parse results held in a cvs_file */
+{
+    cvs_symbol *s;
+    cvs_version *v;
+    cvs_branch *br;
+    cvs_patch *p;
+    uint32_t count, expand = cvs->gen.expand;
+
+    PUT(b, expand);
+    PUT(b, cvs->skew_vulnerable);
+    PUT(b, cvs->nversions);
+    put_number(b, cvs->head);
+    put_number(b, cvs->branch);
+
+    for (count = 0, s = cvs->symbols; s; s = s->next)
+	count++;
+    PUT(b, count);
+    for (s = cvs->symbols; s; s = s->next) {
+	put_string(b, s->symbol_name);
+	put_number(b, s->number);
+    }
+
+    for (count = 0, v = cvs->gen.versions; v; v = v->next)
+	count++;
+    PUT(b, count);
+    for (v = cvs->gen.versions; v; v = v->next) {
+	put_number(b, v->number);
+	PUT(b, v->date);
+	put_string(b, v->author);
+	put_string(b, v->state);
+	put_string(b, v->commitid);
+	PUT(b, v->dead);
+	put_number(b, v->parent);
+	for (count = 0, br = v->branches; br; br = br->next)
+	    count++;
+	PUT(b, count);
+	for (br = v->branches; br; br = br->next)
+	    put_number(b, br->number);
+    }
+
+    for (count = 0, p = cvs->gen.patches; p; p = p->next)
+	count++;
+    PUT(b, count);
+    for (p = cvs->gen.patches; p; p = p->next) {
+	int64_t offset = p->text.offset;
+	uint64_t length = p->text.length;
+	put_number(b, p->number);
+	put_string(b, p->log);
+	PUT(b, offset);
+	PUT(b, length);
+    }
+}
+
+/* deserialization */
+
+typedef struct _cache_cursor {
+    const char	*ptr, *end;
+    bool	bad;
+} cache_cursor_t;
+
+static bool get(cache_cursor_t *c, void *data, size_t len)
+{
+    if (c->bad || (size_t)(c->end - c->ptr) < len) {
+	c->bad = true;
+	memset(data, '\0', len);
+	return false;
+    }
+    memcpy(data, c->ptr, len);
+    c->ptr += len;
+    return true;
+}
+
+#define GET(c, v)	get((c), &(v), sizeof(v))
+
+static const char *get_string(cache_cursor_t *c)
+{
+    uint32_t len;
+    char buf[BUFSIZ], *s;
+    const char *ret;
+
+    if (!GET(c, len) || len == NO_STRING)
+	return NULL;
+    if ((size_t)(c->end - c->ptr) < len) {
+	c->bad = true;
+	return NULL;
+    }
+    s = (len < sizeof(buf)) ? buf : xmalloc(len + 1, __func__);
+    memcpy(s, c->ptr, len);
+    s[len] = '\0';
+    c->ptr += len;
+    ret = atom(s);
+    if (s != buf)
+	free(s);
+    return ret;
+}
+
+static const cvs_number *get_number(cache_cursor_t *c)
+{
+    cvs_number n;
+
+    if (!GET(c, n.c) || n.c < 0)
+	return NULL;
+    if (n.c > CVS_MAX_DEPTH || !get(c, n.n, n.c * sizeof(short))) {
+	c->bad = true;
+	return NULL;
+    }
+    return atom_cvs_number(n);
+}
+
+static bool cache_deserialize(cache_cursor_t *c, cvs_file *cvs)
+/* rebuild a cvs_file as the grammar would have left it */
+{
+    cvs_symbol **sp = &cvs->symbols, *s;
+    cvs_version **vp = &cvs->gen.versions, *v;
+    cvs_patch **pp = &cvs->gen.patches, *p;
+    uint32_t count, i, expand;
+    int64_t offset;
+    uint64_t length;
+
+    GET(c, expand);
+    cvs->gen.expand = expand;
+    GET(c, cvs->skew_vulnerable);
+    GET(c, cvs->nversions);
+    cvs->head = get_number(c);
+    cvs->branch = get_number(c);
+
+    for (GET(c, count); count > 0 && !c->bad; count--) {
+	s = xcalloc(1, sizeof(cvs_symbol), "making symbol");
+	s->symbol_name = get_string(c);
+	s->number = get_number(c);
+	*sp = s;
+	sp = &s->next;
+    }
+
+    for (GET(c, count); count > 0 && !c->bad; count--) {
+	cvs_branch *branches[CVS_MAX_BRANCHWIDTH], **bp;
+	uint32_t nbranches;
+
+	v = arena_alloc(&cvs->gen.nodehash.arena,
+			sizeof(cvs_version), "gram.y::revision");
+	v->number = get_number(c);
+	GET(c, v->date);
+	v->author = get_string(c);
+	v->state = get_string(c);
+	v->commitid = get_string(c);
+	GET(c, v->dead);
+	v->parent = get_number(c);
+	GET(c, nbranches);
+	if (c->bad || nbranches > CVS_MAX_BRANCHWIDTH || v->number == NULL) {
+	    c->bad = true;
+	    break;
+	}
+	bp = &v->branches;
+	for (i = 0; i < nbranches; i++) {
+	    branches[i] = *bp = arena_alloc(&cvs->gen.nodehash.arena,
+					    sizeof(cvs_branch), "gram.y::numbers");
+	    (*bp)->number = get_number(c);
+	    if ((*bp)->number == NULL) {
+		c->bad = true;
+		break;
+	    }
+	    bp = &(*bp)->next;
+	}
+	if (c->bad)
+	    break;
+	/* the grammar reduces branch lists right to left */
+	while (i-- > 0)
+	    hash_branch(&cvs->gen.nodehash, branches[i]);
+	hash_version(&cvs->gen.nodehash, v);
+	*vp = v;
+	vp = &v->next;
+    }
+
+    for (GET(c, count); count > 0 && !c->bad; count--) {
+	p = arena_alloc(&cvs->gen.nodehash.arena,
+			sizeof(cvs_patch), "gram.y::patch");
+	p->number = get_number(c);
+	p->log = get_string(c);
+	GET(c, offset);
+	GET(c, length);
+	if (c->bad || p->number == NULL) {
+	    c->bad = true;
+	    break;
+	}
+	p->text.filename = cvs->gen.master_name;
+	p->text.offset = offset;
+	p->text.length = length;
+	hash_patch(&cvs->gen.nodehash, p);
+	*pp = p;
+	pp = &p->next;
+    }
+
+    return !c->bad && c->ptr == c->end;
+}
+
+void parse_cache_serialize(const cvs_file *cvs, char **data, size_t *len)
+/* the parse results of a master, in the form the cache keeps them */
+{
+    cache_buf_t b = {NULL, 0, 0};
+
+    cache_serialize(&b, cvs);
+    *data = b.data;
+    *len = b.len;
+}
+
+bool parse_cache_deserialize(const char *data, const size_t len, cvs_file *cvs)
+/* rebuild parse results from parse_cache_serialize() output */
+{
+    cache_cursor_t c;
+
+    c.ptr = data;
+    c.end = data + len;
+    c.bad = false;
+    return cache_deserialize(&c, cvs);
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const cache_entry_t *ea = a, *eb = b;
+
+    if (ea->name != eb->name)
+	return (ea->name < eb->name) ? -1 : 1;
+    return 0;
+}
+
+void parse_cache_load(const char *path, const size_t nfiles)
+/* read a cache file, if there is one, and prepare to record nfiles masters */
+{
+    FILE *fp;
+    struct stat st;
+    size_t alloc = 0;
+    cache_cursor_t c;
+
+    new_count = nfiles;
+    new_entries = xcalloc(nfiles + 1, sizeof(cache_entry_t), __func__);
+    cache_hits = 0;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	return;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size < (off_t)strlen(CACHE_MAGIC)) {
+	fclose(fp);
+	return;
+    }
+    old_image = xmalloc(st.st_size, __func__);
+    if (fread(old_image, 1, st.st_size, fp) != (size_t)st.st_size
+	|| memcmp(old_image, CACHE_MAGIC, strlen(CACHE_MAGIC)) != 0) {
+	announce("ignoring unreadable parse cache %s\n", path);
+	fclose(fp);
+	free(old_image);
+	old_image = NULL;
+	return;
+    }
+    fclose(fp);
+
+    c.ptr = old_image + strlen(CACHE_MAGIC);
+    c.end = old_image + st.st_size;
+    c.bad = false;
+    while (c.ptr < c.end) {
+	cache_entry_t *e;
+	uint64_t length, warnlen;
+
+	if (old_count >= alloc) {
+	    alloc += 1024;
+	    old_entries = xrealloc(old_entries,
+				   alloc * sizeof(cache_entry_t), __func__);
+	}
+	e = &old_entries[old_count];
+	e->name = get_string(&c);
+	GET(&c, e->key);
+	GET(&c, length);
+	GET(&c, warnlen);
+	GET(&c, e->quiet);
+	GET(&c, e->sum);
+	if (c.bad || e->name == NULL || (uint64_t)(c.end - c.ptr) < length
+	    || (uint64_t)(c.end - c.ptr) - length < warnlen) {
+	    announce("parse cache %s is truncated, ignoring the rest\n", path);
+	    break;
+	}
+	e->payload = c.ptr;
+	e->length = length;
+	c.ptr += length;
+	e->warnings = c.ptr;
+	e->warnlen = warnlen;
+	c.ptr += warnlen;
+	e->owned = false;
+	old_count++;
+    }
+    qsort(old_entries, old_count, sizeof(cache_entry_t), entry_compare);
+}
+
+static cache_entry_t *cache_lookup(const char *name, const struct stat *st)
+/* the saved entry for a master, if its stat says it is unchanged */
+{
+    cache_entry_t probe, *e;
+
+    if (old_count == 0)
+	return NULL;
+    probe.name = name;
+    e = bsearch(&probe, old_entries, old_count,
+		sizeof(cache_entry_t), entry_compare);
+    if (e == NULL)
+	return NULL;
+    key_from_stat(&probe.key, st);
+    if (memcmp(&probe.key, &e->key, sizeof(cache_key_t)) != 0)
+	return NULL;
+    return e;
+}
+
+bool parse_cache_fresh(const char *name, const struct stat *st)
+/* will the cache be able to supply this master without reading it? */
+{
+    return cache_lookup(name, st) != NULL;
+}
+
+static void replay_warnings(const char *text, const size_t len)
+/* issue captured warnings again, so they count and obey -q as before */
+{
+    static const char prefix[] = "cvs-fast-export: ";
+    const size_t plen = sizeof(prefix) - 1;
+    const char *p = text, *end = text + len, *next;
+
+    while (p < end) {
+	if ((size_t)(end - p) >= plen && memcmp(p, prefix, plen) == 0)
+	    p += plen;
+	/* a message runs to the next line that starts with the prefix */
+	for (next = p; (next = memchr(next, '\n', end - next)) != NULL; )
+	    if (++next == end
+		|| ((size_t)(end - next) >= plen && memcmp(next, prefix, plen) == 0))
+		break;
+	if (next == NULL)
+	    next = end;
+	warn("%.*s", (int)(next - p), p);
+	p = next;
+    }
+}
+
+bool parse_cache_fetch(const size_t index, const struct stat *st, cvs_file *cvs)
+/* try to fill in a master's parse results from the cache */
+{
+    cache_entry_t *e;
+
+    if ((e = cache_lookup(cvs->gen.master_name, st)) == NULL)
+	return false;
+    /* warnings nobody kept may be wanted now */
+    if (e->quiet && !nowarn)
+	return false;
+
+    if (entry_sum(e) != e->sum
+	|| !parse_cache_deserialize(e->payload, e->length, cvs)) {
+	cvs_symbol *s;
+	while ((s = cvs->symbols)) {
+	    cvs->symbols = s->next;
+	    free(s);
+	}
+	cvs->gen.versions = NULL;
+	cvs->gen.patches = NULL;
+	clean_hash(&cvs->gen.nodehash);
+	cvs->head = cvs->branch = NULL;
+	cvs->nversions = 0;
+	cvs->skew_vulnerable = 0;
+	warn("%s: bad parse cache entry, reparsing\n", cvs->gen.master_name);
+	return false;
+    }
+
+    replay_warnings(e->warnings, e->warnlen);
+    /* no copy needed, the old image outlives the save */
+    new_entries[index] = *e;
+#ifdef THREADS
+    if (threads > 1)
+	__atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+    else
+#endif /* THREADS */
+	cache_hits++;
+    return true;
+}
+
+void parse_cache_store(const size_t index, const struct stat *st, const cvs_file *cvs,
+		       char *warnings, const size_t warnlen)
+/* record a freshly parsed master and its warnings, which the cache then owns */
+{
+    cache_entry_t *e = &new_entries[index];
+    char *payload;
+
+    parse_cache_serialize(cvs, &payload, &e->length);
+    e->name = cvs->gen.master_name;
+    key_from_stat(&e->key, st);
+    e->payload = payload;
+    e->warnings = warnings;
+    e->warnlen = warnlen;
+    e->quiet = nowarn;
+    e->sum = entry_sum(e);
+    e->owned = true;
+}
+
+size_t parse_cache_save(const char *path)
+/* write the cache for the masters seen this run; return the hit count */
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    size_t i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+	warn("cannot write parse cache %s: %s\n", tmp, strerror(errno));
+    } else {
+	bool ok = fputs(CACHE_MAGIC, fp) >= 0;
+
+	for (i = 0; i < new_count && ok; i++) {
+	    cache_entry_t *e = &new_entries[i];
+	    cache_buf_t b = {NULL, 0, 0};
+	    uint64_t length = e->length, warnlen = e->warnlen;
+
+	    if (e->name == NULL)
+		continue;	/* unreadable master */
+	    put_string(&b, e->name);
+	    PUT(&b, e->key);
+	    PUT(&b, length);
+	    PUT(&b, warnlen);
+	    PUT(&b, e->quiet);
+	    PUT(&b, e->sum);
+	    ok = fwrite(b.data, 1, b.len, fp) == b.len
+		&& fwrite(e->payload, 1, e->length, fp) == e->length
+		&& fwrite(e->warnings, 1, e->warnlen, fp) == e->warnlen;
+	    free(b.data);
+	}
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+	    warn("cannot write parse cache %s: %s\n", path, strerror(errno));
+	    (void)unlink(tmp);
+	}
+    }
+
+    for (i = 0; i < new_count; i++)
+	if (new_entries[i].owned) {
+	    free((void *)new_entries[i].payload);
+	    free((void *)new_entries[i].warnings);
+	}
+    free(new_entries);
+    new_entries = NULL;
+    free(old_entries);
+    old_entries = NULL;
+    old_count = 0;
+    free(old_image);
+    old_image = NULL;
+    return cache_hits;
+}
+
+/* end */
@@ -140,6 +140,57 @@ cvs_master_find_revision(cvs_master *cm, const cvs_number *number)
     return NULL;
 }
 
+#ifdef COMPACT
+/* room for 2^32 commits; only the first few slab pointers are ever touched */
+cvs_commit *commit_slabs[1 << (32 - COMMIT_SLAB_SHIFT)];
+static size_t commit_nslabs;
+/* the slab small masters are being packed into, and how full it is */
+static size_t commit_slab_last, commit_slab_used = COMMIT_SLAB_SIZE;
+#ifdef THREADS
+static pthread_mutex_t commit_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* THREADS */
+
+static cvs_commit *
+commit_slab_alloc(const size_t n, commit_index_t *first)
+/* zeroed storage for n commits with consecutive indices */
+{
+    size_t nslabs = (n + COMMIT_SLAB_SIZE - 1) / COMMIT_SLAB_SIZE, i;
+    cvs_commit *ret;
+
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_lock(&commit_slab_mutex);
+#endif /* THREADS */
+    if (n > COMMIT_SLAB_SIZE) {
+	/* a master too big for one slab gets a run of its own */
+	if (commit_nslabs + nslabs > sizeof(commit_slabs) / sizeof(commit_slabs[0]))
+	    fatal_error("too many revisions for a compact build\n");
+	ret = xcalloc(n, sizeof(cvs_commit), "commit slab alloc");
+	for (i = 0; i < nslabs; i++)
+	    commit_slabs[commit_nslabs + i] = ret + i * COMMIT_SLAB_SIZE;
+	*first = commit_nslabs << COMMIT_SLAB_SHIFT;
+	commit_nslabs += nslabs;
+    } else {
+	if (n > COMMIT_SLAB_SIZE - commit_slab_used) {
+	    if (commit_nslabs == sizeof(commit_slabs) / sizeof(commit_slabs[0]))
+		fatal_error("too many revisions for a compact build\n");
+	    commit_slabs[commit_nslabs] = xcalloc(COMMIT_SLAB_SIZE, sizeof(cvs_commit),
+						  "commit slab alloc");
+	    commit_slab_last = commit_nslabs++;
+	    commit_slab_used = 0;
+	}
+	ret = commit_slabs[commit_slab_last] + commit_slab_used;
+	*first = (commit_slab_last << COMMIT_SLAB_SHIFT) + commit_slab_used;
+	commit_slab_used += n;
+    }
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_unlock(&commit_slab_mutex);
+#endif /* THREADS */
+    return ret;
+}
+#endif /* COMPACT */
+
 static rev_master *
 build_rev_master(cvs_file *cvs, rev_master *master)
 {
@@ -147,7 +198,11 @@ build_rev_master(cvs_file *cvs, rev_master *master)
     master->fileop_name = fileop_name(cvs->export_name);
     master->dir = atom_dir(dir_name(master->name));
     master->mode = cvs->mode;
+#ifdef COMPACT
+    master->commits = commit_slab_alloc(cvs->nversions, &master->first);
+#else
     master->commits = xcalloc(cvs->nversions, sizeof(cvs_commit), "commit slab alloc");
+#endif /* COMPACT */
     master->ncommits = 0;
     return master;
 }
@@ -196,8 +251,6 @@ cvs_master_branch_build(cvs_file *cvs, rev_master *master, const cvs_number *bra
 	    node->commit = c;
 	}
 	c->parent = head;
-	/* commits are already interned, these hashes build up revdir hashes */
-	c->hash = HASH_VALUE(c);
 	head = c;
     }
 
@@ -9,6 +9,10 @@
  * which directories are coalesced.
  */
 
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
+
 #include "cvs.h"
 #include "hash.h"
 #include "revdir.h"
@@ -23,6 +27,287 @@ dir_is_ancestor(const master_dir *child, const master_dir *ancestor)
     return false;
 }
 
+/*
+ * What a packed file list holds for each file: a commit pointer, or in
+ * a compact build the commit's 32-bit index, which halves the size of
+ * the lists and of the buffers they are compared against.
+ */
+#ifdef COMPACT
+typedef commit_index_t	pack_file_t;
+#define PACK_FILE(c)	COMMIT_INDEX(c)
+#define UNPACK_FILE(f)	COMMIT_AT(f)
+#else
+typedef const cvs_commit *pack_file_t;
+#define PACK_FILE(c)	(c)
+#define UNPACK_FILE(f)	((cvs_commit *)(f))
+#endif /* COMPACT */
+
+/*
+ * Both packers intern what they pack in one open-addressed table of
+ * entry pointers, probed linearly, with a copy of each entry's hash
+ * alongside so most probes need not touch the entry.  It starts small,
+ * or at the size revdir_reserve() asks for, and doubles whenever it
+ * gets two thirds full.
+ *
+ * The table is insert-only, so lookups take no locks.  A new entry is
+ * placed by compare-and-swap on an empty slot; a thread that loses the
+ * race checks the winner and probes on.  Growth is serialized by
+ * a mutex: the grower marks the old table frozen, copies it and then
+ * publishes the new one.  The old table stays readable until
+ * revdir_free(), and anything placed in it after it froze is placed
+ * again in its successor, so no entry is lost to a concurrent resize.
+ */
+#define PACK_TABLE_MIN	1024
+
+typedef struct _pack_table {
+    void		**entries;
+    hash_t		*hashes;	/* 0 until written, which forces a check */
+    size_t		size;		/* a power of two */
+    size_t		count;
+    bool		frozen;		/* being copied into next */
+    struct _pack_table	*next;		/* the table that replaced this one */
+    struct _pack_table	*retired;	/* link on the list kept for readers */
+} pack_table_t;
+
+static pack_table_t	*pack_table, *pack_retired;
+static void		**pack_orphans;
+static size_t		pack_norphans;
+#ifdef THREADS
+static pthread_mutex_t	pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* THREADS */
+
+/* supplied by the packer */
+static hash_t pack_entry_hash(const void *entry);
+static bool pack_entry_match(const void *entry, const void *key);
+static void pack_entry_free(void *entry);
+
+static pack_table_t *
+pack_table_alloc(const size_t size)
+{
+    pack_table_t *t = xcalloc(1, sizeof(pack_table_t), __func__);
+
+    t->entries = xcalloc(size, sizeof(void *), __func__);
+    t->hashes = xcalloc(size, sizeof(hash_t), __func__);
+    t->size = size;
+    return t;
+}
+
+static void
+pack_table_copy(pack_table_t *to, pack_table_t *from)
+/* rehash every entry of a table into an empty bigger one */
+{
+    size_t i, j;
+
+    for (i = 0; i < from->size; i++) {
+	void *e = __atomic_load_n(&from->entries[i], __ATOMIC_SEQ_CST);
+	hash_t hash;
+
+	if (e == NULL)
+	    continue;
+	hash = pack_entry_hash(e);
+	for (j = hash & (to->size - 1); to->entries[j]; j = (j + 1) & (to->size - 1))
+	    continue;
+	to->entries[j] = e;
+	to->hashes[j] = hash;
+	to->count++;
+    }
+}
+
+static void
+pack_table_grow(pack_table_t *t, size_t size)
+/* replace table t, which is current, by one of at least size slots */
+{
+    pack_table_t *bigger;
+
+    while (size & (size - 1))
+	size &= size - 1;
+    if (t != NULL && size <= t->size)
+	size = t->size * 2;
+    bigger = pack_table_alloc(size);
+#ifdef THREADS
+    if (threads > 1) {
+	pthread_mutex_lock(&pack_mutex);
+	if (__atomic_load_n(&pack_table, __ATOMIC_ACQUIRE) != t) {
+	    /* somebody else got there first */
+	    pthread_mutex_unlock(&pack_mutex);
+	    free(bigger->entries);
+	    free(bigger->hashes);
+	    free(bigger);
+	    return;
+	}
+	if (t != NULL) {
+	    __atomic_store_n(&t->frozen, true, __ATOMIC_SEQ_CST);
+	    pack_table_copy(bigger, t);
+	    /* other threads may still be reading it */
+	    t->retired = pack_retired;
+	    pack_retired = t;
+	    __atomic_store_n(&t->next, bigger, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&pack_table, bigger, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pack_mutex);
+	return;
+    }
+#endif /* THREADS */
+    if (t != NULL) {
+	pack_table_copy(bigger, t);
+	free(t->entries);
+	free(t->hashes);
+	free(t);
+    }
+    pack_table = bigger;
+}
+
+static pack_table_t *
+pack_table_current(void)
+/* the table to insert into, grown first if it is getting full */
+{
+    pack_table_t *t = __atomic_load_n(&pack_table, __ATOMIC_ACQUIRE);
+
+    while (t == NULL || __atomic_load_n(&t->count, __ATOMIC_RELAXED) * 3 >= t->size * 2) {
+	pack_table_grow(t, PACK_TABLE_MIN);
+	t = __atomic_load_n(&pack_table, __ATOMIC_ACQUIRE);
+    }
+    return t;
+}
+
+static inline bool
+pack_hash_may_match(const pack_table_t *t, const size_t i, const hash_t hash)
+/* could slot i hold a match? A hash not yet written can't rule it out */
+{
+    hash_t h = __atomic_load_n(&t->hashes[i], __ATOMIC_RELAXED);
+
+    return h == hash || h == 0;
+}
+
+static void *
+pack_find(const hash_t hash, const void *key)
+/* look up a packed entry matching key, NULL if there is none yet */
+{
+    pack_table_t *t = __atomic_load_n(&pack_table, __ATOMIC_ACQUIRE);
+    size_t i;
+    void *e;
+
+    if (t == NULL)
+	return NULL;
+    for (i = hash & (t->size - 1);; i = (i + 1) & (t->size - 1)) {
+	if ((e = __atomic_load_n(&t->entries[i], __ATOMIC_ACQUIRE)) == NULL)
+	    return NULL;
+	if (pack_hash_may_match(t, i, hash) && pack_entry_match(e, key))
+	    return e;
+    }
+}
+
+static void *
+pack_place(pack_table_t *t, const hash_t hash, const void *key, void *entry)
+/* put entry in table t, unless an entry matching key got there first */
+{
+    size_t i;
+
+    for (i = hash & (t->size - 1);; i = (i + 1) & (t->size - 1)) {
+	void *e = __atomic_load_n(&t->entries[i], __ATOMIC_ACQUIRE);
+
+	if (e == NULL) {
+#ifdef THREADS
+	    if (threads > 1) {
+		if (__atomic_compare_exchange_n(&t->entries[i], &e, entry, false,
+						__ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+		    __atomic_store_n(&t->hashes[i], hash, __ATOMIC_RELAXED);
+		    __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+		    return entry;
+		}
+		/* lost the slot; see whether the winner is what we want */
+	    } else
+#endif /* THREADS */
+	    {
+		t->entries[i] = entry;
+		t->hashes[i] = hash;
+		t->count++;
+		return entry;
+	    }
+	}
+	if (e == entry)
+	    return entry;
+	if (pack_hash_may_match(t, i, hash) && pack_entry_match(e, key))
+	    return e;
+    }
+}
+
+static void *
+pack_insert(const hash_t hash, const void *key, void *entry)
+/* intern an entry matching key; return it, or the one that won a race */
+{
+    pack_table_t *t = pack_table_current();
+    void *got = pack_place(t, hash, key, entry);
+#ifdef THREADS
+    bool placed = (got == entry);
+
+    /* if the table froze under us, the new one must have it too */
+    while (threads > 1 && __atomic_load_n(&t->frozen, __ATOMIC_SEQ_CST)) {
+	pack_table_t *next;
+
+	pthread_mutex_lock(&pack_mutex);
+	next = t->next;
+	pthread_mutex_unlock(&pack_mutex);
+	t = next;
+	got = pack_place(t, hash, key, got);
+    }
+    if (got != entry && placed) {
+	/* stranded in a retired table, where a reader may have found it */
+	pthread_mutex_lock(&pack_mutex);
+	pack_orphans = xrealloc(pack_orphans,
+				(pack_norphans + 1) * sizeof(void *), __func__);
+	pack_orphans[pack_norphans++] = entry;
+	pthread_mutex_unlock(&pack_mutex);
+	return got;
+    }
+#endif /* THREADS */
+    if (got != entry)
+	pack_entry_free(entry);
+    return got;
+}
+
+void
+revdir_reserve(const size_t expected)
+/* size the table for about expected packed entries */
+{
+    pack_table_t *t = __atomic_load_n(&pack_table, __ATOMIC_ACQUIRE);
+    size_t size = PACK_TABLE_MIN;
+
+    while (size * 2 < expected * 3)
+	size *= 2;
+    if (t == NULL || t->size < size)
+	pack_table_grow(t, size);
+}
+
+void
+revdir_free(void)
+/* free every packed entry, and the tables */
+{
+    pack_table_t *t;
+    size_t i;
+
+    if ((t = pack_table) != NULL) {
+	for (i = 0; i < t->size; i++)
+	    if (t->entries[i])
+		pack_entry_free(t->entries[i]);
+	free(t->entries);
+	free(t->hashes);
+	free(t);
+	pack_table = NULL;
+    }
+    while ((t = pack_retired) != NULL) {
+	pack_retired = t->retired;
+	free(t->entries);
+	free(t->hashes);
+	free(t);
+    }
+    for (i = 0; i < pack_norphans; i++)
+	pack_entry_free(pack_orphans[i]);
+    free(pack_orphans);
+    pack_orphans = NULL;
+    pack_norphans = 0;
+}
+
 #ifdef TREEPACK
 #include "treepack.c"
 #else
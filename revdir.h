@@ -52,9 +52,23 @@ revdir_iter_next_dir(revdir_iter *it);
 bool
 revdir_iter_same_dir(const revdir_iter *it1, const revdir_iter *it2);
 
+/*
+ * Report each file that differs between two revdirs, in path order:
+ * old and new revisions of a changed file, or NULL for the missing
+ * side of an added or deleted one.  old may be NULL.
+ */
+typedef void revdir_diff_fn(cvs_commit *old, cvs_commit *new, void *arg);
+
+void
+revdir_diff(const revdir *old, const revdir *new, revdir_diff_fn *fn, void *arg);
+
 void
 revdir_free_bufs(void);
 
+/* size the packed-entry table for about this many entries */
+void
+revdir_reserve(const size_t expected);
+
 void
 revdir_free(void);
 
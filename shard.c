@@ -0,0 +1,407 @@
+/*
+ * Sharded conversion: parsing and snapshot generation spread over hosts.
+ *
+ * Parsing masters and playing back their deltas are the phases that
+ * grow with the archive, and both go one master at a time.  With
+ * --shard=K/N a run takes the full master list as usual, but parses,
+ * digests and generates snapshots only for its own share of the
+ * masters, and writes what it found to standard output in place of a
+ * fast-import stream.  A --merge run takes the N shard files in place
+ * of masters, rebuilds every master from the parse results in them,
+ * collates and exports as usual, and copies each blob out of the shard
+ * that made it rather than playing back deltas.  The stream comes out
+ * as it would from a single run over the masters.
+ *
+ * Shares are dealt out round robin, biggest master first, so that they
+ * come out about even.  What ties a record to a master is its index in
+ * path order, so every node must be given the same master list and -s;
+ * keywords are expanded when snapshots are made, so the nodes and the
+ * merge must agree on -k.  Each shard header carries a digest of the
+ * list and the -k mode so that --merge can check.  The masters need
+ * not be readable where the merge runs.
+ *
+ * The file is a byte dump in host order, as the parse cache is, so the
+ * nodes and the merging host must have the same byte order and word
+ * sizes:
+ *
+ *	magic, header
+ *	for each master of the shard, in path order:
+ *	    record, name, parse results (see parsecache.c)
+ *	    for each revision, in generation order:
+ *		commit index in the master, length, content
+ *	    SHARD_END
+ *
+ * A dead revision the walk passes gets an empty record.  It has no
+ * snapshot, but -i stops at the first revision too old whether it is
+ * dead or not, and the merge has to stop where a single run would.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "cvs.h"
+#include "hash.h"
+
+#define SHARD_MAGIC	"cvs-fast-export shard 2\n"
+#define SHARD_ORDER	0x01020304	/* catches a foreign byte order */
+#define SHARD_END	UINT32_MAX
+
+typedef struct _shard_header {
+    uint32_t		order;
+    uint32_t		shard, nshards;
+    int32_t		expand;		/* -k mode the snapshots were made with */
+    uint64_t		nmasters;	/* in the whole list */
+    hash_digest_t	list;		/* of the names in path order */
+} shard_header_t;
+
+typedef struct _shard_record {
+    uint64_t	index;
+    int64_t	size;
+    uint32_t	mode;
+    uint32_t	readable;	/* 0 if the node could not open the master */
+    uint64_t	length;		/* of the parse results */
+} shard_record_t;
+
+typedef struct _shard_snapshot {
+    uint32_t	commit;		/* index into the rev_master's commits */
+    off_t	offset;
+    size_t	length;
+} shard_snapshot_t;
+
+typedef struct _shard_master {
+    const char		*name;
+    off_t		size;
+    mode_t		mode;
+    bool		owned, readable;
+    char		*payload;	/* parse results */
+    size_t		length;
+    /* on the merging side */
+    int			fd;		/* shard holding the snapshots */
+    shard_snapshot_t	*snapshots;
+    size_t		nsnapshots;
+    const rev_master	*master;
+} shard_master_t;
+
+static shard_master_t	*masters;
+static size_t		nmasters;
+static shard_header_t	header;
+static FILE		**shard_fps;
+static int		nshard_fps;
+
+static void list_digest(hash_digest_t *digest)
+/* fingerprint the master list, so shards of different lists don't mix */
+{
+    size_t i, len = 0;
+    char *names, *p;
+
+    for (i = 0; i < nmasters; i++)
+	len += strlen(masters[i].name) + 1;
+    p = names = xmalloc(len + 1, __func__);
+    for (i = 0; i < nmasters; i++) {
+	size_t n = strlen(masters[i].name);
+	memcpy(p, masters[i].name, n);
+	p += n;
+	*p++ = '\n';
+    }
+    hash_digest(names, len, digest);
+    free(names);
+}
+
+/* the node side */
+
+void shard_begin(const unsigned shard, const unsigned nshards, const size_t count)
+/* prepare to make shard number shard of nshards over count masters */
+{
+    header.order = SHARD_ORDER;
+    header.shard = shard;
+    header.nshards = nshards;
+    header.nmasters = count;
+    nmasters = count;
+    masters = xcalloc(count + 1, sizeof(shard_master_t), __func__);
+}
+
+void shard_add(const size_t index, const char *name, const off_t size,
+	       const bool owned)
+/* note a master of the list, and whether this node makes its record */
+{
+    masters[index].name = name;
+    masters[index].size = size;
+    masters[index].owned = owned;
+}
+
+void shard_store(const size_t index, const cvs_file *cvs)
+/* keep the parse results of a master this node owns */
+{
+    masters[index].mode = cvs->mode;
+    masters[index].readable = true;
+    parse_cache_serialize(cvs, &masters[index].payload, &masters[index].length);
+}
+
+static void shard_put(const void *data, const size_t len)
+{
+    if (fwrite(data, 1, len, stdout) != len)
+	fatal_system_error("writing shard");
+}
+
+static void snapshot_hook(node_t *node, void *buf, size_t len,
+			  export_options_t *opts)
+/* write one generated snapshot, or a dead revision's marker, into the shard */
+{
+    uint32_t commit = node->commit - node->commit->master->commits;
+    uint64_t length = len;
+
+    shard_put(&commit, sizeof(commit));
+    shard_put(&length, sizeof(length));
+    if (len > 0)
+	shard_put(buf, len);
+}
+
+void shard_write(forest_t *forest, export_options_t *opts)
+/* write this node's masters and their snapshots to standard output */
+{
+    export_options_t node_opts = *opts;
+    uint32_t end = SHARD_END;
+    size_t i, owned = 0, done = 0;
+
+    /* the merge applies -i; every snapshot goes into the shard */
+    node_opts.fromtime = 0;
+    header.expand = opts->id_token_expand;
+    list_digest(&header.list);
+    shard_put(SHARD_MAGIC, strlen(SHARD_MAGIC));
+    shard_put(&header, sizeof(header));
+
+    for (i = 0; i < nmasters; i++)
+	owned += masters[i].owned;
+    progress_begin("Generating snapshots...", owned);
+    for (i = 0; i < nmasters; i++) {
+	shard_master_t *sm = &masters[i];
+	generator_t *gen = &forest->generators[i];
+	shard_record_t record;
+	uint32_t namelen = strlen(sm->name);
+
+	if (!sm->owned)
+	    continue;
+	memset(&record, '\0', sizeof(record));
+	record.index = i;
+	record.size = sm->size;
+	record.mode = sm->mode;
+	record.readable = sm->readable;
+	record.length = sm->length;
+	shard_put(&record, sizeof(record));
+	shard_put(&namelen, sizeof(namelen));
+	shard_put(sm->name, namelen);
+	if (sm->length > 0)
+	    shard_put(sm->payload, sm->length);
+	free(sm->payload);
+	sm->payload = NULL;
+	if (gen->master_name != NULL) {
+	    unspill_generator(gen);
+	    generate_files(gen, &node_opts, snapshot_hook);
+	    generator_free(gen);
+	}
+	shard_put(&end, sizeof(end));
+	progress_jump(++done);
+    }
+    if (fflush(stdout) != 0)
+	fatal_system_error("writing shard");
+    progress_end("done, %zu masters", done);
+}
+
+/* the merging side */
+
+static void shard_get(FILE *fp, const char *path, void *data, const size_t len)
+{
+    if (fread(data, 1, len, fp) != len)
+	fatal_error("shard %s is truncated\n", path);
+}
+
+static void shard_read(const char *path, const shard_header_t *first)
+/* index the records of one shard file */
+{
+    FILE *fp;
+    char magic[sizeof(SHARD_MAGIC) - 1];
+    shard_header_t h;
+    shard_record_t record;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	fatal_system_error("cannot open shard %s", path);
+    shard_fps[nshard_fps++] = fp;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+	|| memcmp(magic, SHARD_MAGIC, sizeof(magic)) != 0)
+	fatal_error("%s is not a shard\n", path);
+    shard_get(fp, path, &h, sizeof(h));
+    if (h.order != SHARD_ORDER)
+	fatal_error("shard %s was written with a different byte order\n", path);
+    if (first != NULL
+	&& (h.nshards != first->nshards || h.nmasters != first->nmasters
+	    || memcmp(&h.list, &first->list, sizeof(hash_digest_t)) != 0))
+	fatal_error("shard %s was made from a different master list\n", path);
+    if (first != NULL && h.expand != first->expand)
+	fatal_error("shard %s was made with a different -k\n", path);
+    header = h;
+    if (masters == NULL) {
+	nmasters = h.nmasters;
+	masters = xcalloc(nmasters + 1, sizeof(shard_master_t), __func__);
+    }
+
+    while (fread(&record, 1, sizeof(record), fp) == sizeof(record)) {
+	shard_master_t *sm;
+	uint32_t namelen, commit;
+	char name[PATH_MAX];
+	size_t alloc = 0;
+
+	if (record.index >= nmasters)
+	    fatal_error("shard %s has a record out of range\n", path);
+	sm = &masters[record.index];
+	if (sm->name != NULL)
+	    fatal_error("shard %s repeats a master another shard has\n", path);
+	shard_get(fp, path, &namelen, sizeof(namelen));
+	if (namelen >= sizeof(name))
+	    fatal_error("shard %s has a record out of range\n", path);
+	shard_get(fp, path, name, namelen);
+	name[namelen] = '\0';
+	sm->name = atom(name);
+	sm->size = record.size;
+	sm->mode = record.mode;
+	sm->readable = record.readable;
+	sm->length = record.length;
+	sm->payload = xmalloc(record.length + 1, __func__);
+	shard_get(fp, path, sm->payload, record.length);
+	sm->fd = fileno(fp);
+
+	for (;;) {
+	    uint64_t length;
+
+	    shard_get(fp, path, &commit, sizeof(commit));
+	    if (commit == SHARD_END)
+		break;
+	    shard_get(fp, path, &length, sizeof(length));
+	    if (sm->nsnapshots >= alloc) {
+		alloc = alloc ? alloc * 2 : 16;
+		sm->snapshots = xrealloc(sm->snapshots,
+					 alloc * sizeof(shard_snapshot_t), __func__);
+	    }
+	    sm->snapshots[sm->nsnapshots].commit = commit;
+	    sm->snapshots[sm->nsnapshots].offset = ftello(fp);
+	    sm->snapshots[sm->nsnapshots++].length = length;
+	    if (fseeko(fp, length, SEEK_CUR) != 0)
+		fatal_system_error("reading shard %s", path);
+	}
+    }
+    if (ferror(fp))
+	fatal_system_error("reading shard %s", path);
+}
+
+size_t shard_load(const int nfiles, char *files[])
+/* read the shards to be merged; return the number of masters */
+{
+    shard_header_t first;
+    int i;
+    size_t j;
+
+    shard_fps = xcalloc(nfiles, sizeof(FILE *), __func__);
+    for (i = 0; i < nfiles; i++) {
+	shard_read(files[i], i > 0 ? &first : NULL);
+	if (i == 0)
+	    first = header;
+    }
+    for (j = 0; j < nmasters; j++)
+	if (masters[j].name == NULL)
+	    fatal_error("no shard has master %zu of %zu; "
+			"are all %u shards given?\n",
+			j + 1, nmasters, (unsigned)header.nshards);
+    return nmasters;
+}
+
+const char *shard_name(const size_t index, off_t *size)
+/* a master of the merged list, with its size */
+{
+    *size = masters[index].size;
+    return masters[index].name;
+}
+
+bool shard_fetch(const size_t index, cvs_file *cvs, const rev_master *master)
+/* rebuild a master's parse results; false if its node couldn't read it */
+{
+    shard_master_t *sm = &masters[index];
+
+    if (cvs->gen.master_name != sm->name)
+	fatal_error("%s: masters sort differently than on the nodes; "
+		    "was -s the same?\n", cvs->gen.master_name);
+    if (!sm->readable)
+	return false;
+    cvs->mode = sm->mode;
+    if (!parse_cache_deserialize(sm->payload, sm->length, cvs))
+	fatal_error("%s: damaged shard record\n", sm->name);
+    free(sm->payload);
+    sm->payload = NULL;
+    sm->master = master;
+    cvs->gen.shard = sm;
+    return true;
+}
+
+void shard_replay(generator_t *gen, export_options_t *opts,
+		  void (*hook)(node_t *node, void *buf, size_t len, export_options_t *popts))
+/* hand a master's stored snapshots to hook, as generate_files() would */
+{
+    shard_master_t *sm = gen->shard;
+    size_t i, biggest = 0;
+    char *buf;
+
+    if (opts->id_token_expand != header.expand)
+	fatal_error("the shards were made with a different -k\n");
+    for (i = 0; i < sm->nsnapshots; i++)
+	if (sm->snapshots[i].length > biggest)
+	    biggest = sm->snapshots[i].length;
+    buf = xmalloc(biggest + 1, __func__);
+    for (i = 0; i < sm->nsnapshots; i++) {
+	shard_snapshot_t *s = &sm->snapshots[i];
+	size_t got;
+	node_t node;
+
+	if (s->commit >= sm->master->ncommits)
+	    fatal_error("%s: shard snapshot of an unknown revision\n", sm->name);
+	memset(&node, '\0', sizeof(node));
+	node.commit = &sm->master->commits[s->commit];
+	/* as in generate_files(), newest first, so stop at the first too old */
+	if (opts->fromtime >= node.commit->date)
+	    break;
+	if (node.commit->dead)
+	    continue;	/* only there to stop at */
+	for (got = 0; got < s->length; ) {
+	    ssize_t n = pread(sm->fd, buf + got, s->length - got, s->offset + got);
+	    if (n <= 0)
+		fatal_system_error("reading shard for %s", sm->name);
+	    got += n;
+	}
+	hook(&node, buf, s->length, opts);
+    }
+    free(buf);
+    free(sm->snapshots);
+    sm->snapshots = NULL;
+    sm->nsnapshots = 0;
+}
+
+void shard_free(void)
+/* close the shards and drop the master table */
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < nmasters; i++) {
+	free(masters[i].payload);
+	free(masters[i].snapshots);
+    }
+    free(masters);
+    masters = NULL;
+    nmasters = 0;
+    for (j = 0; j < nshard_fps; j++)
+	fclose(shard_fps[j]);
+    free(shard_fps);
+    shard_fps = NULL;
+    nshard_fps = 0;
+}
+
+/* end */
@@ -0,0 +1,270 @@
+/*
+ * Spill per-master delta metadata to disk between analysis and export.
+ *
+ * Every master's generator_t - its versions, patches, branches and the
+ * node tree over them - stays in memory from the time the master is
+ * parsed until its snapshots are generated at export time.  On very
+ * large repositories that is the bulk of the working set.  With
+ * --spill-budget, masters are held in memory until their metadata
+ * adds up to the budget; after that, each master's metadata is written
+ * to a temporary file as soon as it has been digested, its arena is
+ * freed, and it is read back just before snapshot generation needs it.
+ *
+ * All of a master's metadata lives in its node arena, so a spill image
+ * is simply the arena's blocks laid end to end, with the pointers
+ * between objects in it rewritten as offsets into the image.  Pointers
+ * out of the arena - atoms, cvs_commits, the master name - are left as
+ * they are, since all of those outlive export.  Reading an image back
+ * is one allocation, one read and a pass to turn offsets into pointers.
+ *
+ * The spill file is unlinked as soon as it is created, as the blob
+ * pack is, so nothing is left behind even on a crash.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "cvs.h"
+
+typedef struct _spill_header {
+    uint64_t	length;		/* of the image following */
+    uintptr_t	versions, patches, head_node;
+    uintptr_t	table[NODE_HASH_SIZE];
+    int64_t	nentries;
+} spill_header_t;
+
+typedef struct _spill_block {
+    const char	*data;
+    size_t	used;
+    size_t	offset;		/* where the block starts within the image */
+} spill_block_t;
+
+static int	spill_fd = -1;
+static long	spill_budget;
+static size_t	held;		/* metadata bytes still in memory */
+static off_t	spill_end;
+static size_t	spilled_masters, spilled_bytes;
+
+void spill_init(const long budget)
+/* start spilling once about budget bytes of metadata are held */
+{
+    char *tmp = getenv("TMPDIR");
+    char spillname[PATH_MAX];
+
+    if (tmp == NULL)
+	tmp = "/tmp";
+    snprintf(spillname, sizeof(spillname), "%s/cvs-fast-export-XXXXXX", tmp);
+    if ((spill_fd = mkstemp(spillname)) == -1)
+	fatal_system_error("spill file creation failed");
+    /* nothing to clean up afterwards, even on a crash */
+    (void)unlink(spillname);
+    spill_budget = budget;
+    held = spilled_masters = spilled_bytes = 0;
+    spill_end = 0;
+}
+
+static int block_compare(const void *a, const void *b)
+{
+    const spill_block_t *ba = a, *bb = b;
+
+    return ba->data < bb->data ? -1 : ba->data > bb->data;
+}
+
+static uintptr_t spill_offset(const spill_block_t *blocks, const size_t nblocks,
+			      const void *ptr)
+/* translate a pointer into the arena to an image offset, 0 for NULL */
+{
+    const char *p = ptr;
+    size_t lo = 0, hi = nblocks;
+
+    if (p == NULL)
+	return 0;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (blocks[mid].data <= p)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == 0 || p >= blocks[lo - 1].data + blocks[lo - 1].used)
+	fatal_error("internal error - pointer outside arena while spilling\n");
+    return blocks[lo - 1].offset + (p - blocks[lo - 1].data) + 1;
+}
+
+/* where an arena object's copy sits in the image */
+#define IMAGE(type, ptr) \
+	((type *)(image + spill_offset(blocks, nblocks, (ptr)) - 1))
+/* an arena pointer, as stored in the image */
+#define OFFSET(ptr)	((void *)spill_offset(blocks, nblocks, (ptr)))
+
+void spill_generator(generator_t *gen)
+/* after digestion, spill a master's metadata if the budget is used up */
+{
+    arena_block_t	*b;
+    spill_block_t	*blocks;
+    spill_header_t	header;
+    size_t		nblocks = 0, size = 0, i;
+    char		*image;
+    cvs_version		*v;
+    cvs_branch		*br;
+    cvs_patch		*p;
+    node_t		*n;
+    off_t		where;
+
+    if (spill_fd == -1 || gen->master_name == NULL)
+	return;
+    for (b = gen->nodehash.arena; b; b = b->next) {
+	nblocks++;
+	size += b->used;
+    }
+    if (nblocks == 0)
+	return;
+    if (__atomic_add_fetch(&held, size, __ATOMIC_RELAXED) <= (size_t)spill_budget)
+	return;
+    __atomic_sub_fetch(&held, size, __ATOMIC_RELAXED);
+
+    /* lay the blocks out in address order so pointers can be looked up */
+    blocks = xmalloc(nblocks * sizeof(spill_block_t), __func__);
+    for (i = 0, b = gen->nodehash.arena; b; b = b->next, i++) {
+	blocks[i].data = (const char *)b->data;
+	blocks[i].used = b->used;
+    }
+    qsort(blocks, nblocks, sizeof(spill_block_t), block_compare);
+    image = xmalloc(size, __func__);
+    for (i = 0, size = 0; i < nblocks; i++) {
+	blocks[i].offset = size;
+	memcpy(image + size, blocks[i].data, blocks[i].used);
+	size += blocks[i].used;
+    }
+
+    /* rewrite the links between arena objects in the copy */
+    for (v = gen->versions; v; v = v->next) {
+	cvs_version *cv = IMAGE(cvs_version, v);
+	cv->next = OFFSET(v->next);
+	cv->branches = OFFSET(v->branches);
+	cv->node = OFFSET(v->node);
+	for (br = v->branches; br; br = br->next) {
+	    cvs_branch *cb = IMAGE(cvs_branch, br);
+	    cb->next = OFFSET(br->next);
+	    cb->node = OFFSET(br->node);
+	}
+    }
+    for (p = gen->patches; p; p = p->next) {
+	cvs_patch *cp = IMAGE(cvs_patch, p);
+	cp->next = OFFSET(p->next);
+	cp->node = OFFSET(p->node);
+    }
+    for (i = 0; i < NODE_HASH_SIZE; i++) {
+	header.table[i] = spill_offset(blocks, nblocks, gen->nodehash.table[i]);
+	for (n = gen->nodehash.table[i]; n; n = n->hash_next) {
+	    node_t *cn = IMAGE(node_t, n);
+	    cn->hash_next = OFFSET(n->hash_next);
+	    cn->version = OFFSET(n->version);
+	    cn->patch = OFFSET(n->patch);
+	    cn->next = OFFSET(n->next);
+	    cn->to = OFFSET(n->to);
+	    cn->down = OFFSET(n->down);
+	    cn->sib = OFFSET(n->sib);
+	}
+    }
+    header.length = size;
+    header.versions = spill_offset(blocks, nblocks, gen->versions);
+    header.patches = spill_offset(blocks, nblocks, gen->patches);
+    header.head_node = spill_offset(blocks, nblocks, gen->nodehash.head_node);
+    header.nentries = gen->nodehash.nentries;
+    free(blocks);
+
+    where = __atomic_fetch_add(&spill_end, sizeof(header) + size, __ATOMIC_RELAXED);
+    if (pwrite(spill_fd, &header, sizeof(header), where) != sizeof(header)
+	|| pwrite(spill_fd, image, size, where + sizeof(header)) != (ssize_t)size)
+	fatal_system_error("writing spill file");
+    free(image);
+
+    generator_free(gen);
+    gen->spill_offset = where;
+    gen->spill_length = sizeof(header) + size;
+    __atomic_add_fetch(&spilled_masters, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&spilled_bytes, sizeof(header) + size, __ATOMIC_RELAXED);
+}
+
+/* turn an image offset back into a pointer */
+#define RELOCATE(ptr) \
+	((ptr) = (void *)((uintptr_t)(ptr) ? base + (uintptr_t)(ptr) - 1 : NULL))
+
+void unspill_generator(generator_t *gen)
+/* read a spilled master's metadata back in for snapshot generation */
+{
+    spill_header_t	header;
+    char		*base;
+    cvs_version		*v;
+    cvs_branch		*br;
+    cvs_patch		*p;
+    node_t		*n;
+    size_t		i;
+
+    if (gen->spill_length == 0)
+	return;
+    if (pread(spill_fd, &header, sizeof(header), gen->spill_offset) != sizeof(header))
+	fatal_system_error("reading spill file");
+    base = arena_alloc(&gen->nodehash.arena, header.length, "spill reload");
+    if (pread(spill_fd, base, header.length,
+	      gen->spill_offset + sizeof(header)) != (ssize_t)header.length)
+	fatal_system_error("reading spill file");
+
+    gen->versions = (cvs_version *)header.versions;
+    RELOCATE(gen->versions);
+    for (v = gen->versions; v; v = v->next) {
+	RELOCATE(v->next);
+	RELOCATE(v->branches);
+	RELOCATE(v->node);
+	for (br = v->branches; br; br = br->next) {
+	    RELOCATE(br->next);
+	    RELOCATE(br->node);
+	}
+    }
+    gen->patches = (cvs_patch *)header.patches;
+    RELOCATE(gen->patches);
+    for (p = gen->patches; p; p = p->next) {
+	RELOCATE(p->next);
+	RELOCATE(p->node);
+    }
+    for (i = 0; i < NODE_HASH_SIZE; i++) {
+	gen->nodehash.table[i] = (node_t *)header.table[i];
+	RELOCATE(gen->nodehash.table[i]);
+	for (n = gen->nodehash.table[i]; n; n = n->hash_next) {
+	    RELOCATE(n->hash_next);
+	    RELOCATE(n->version);
+	    RELOCATE(n->patch);
+	    RELOCATE(n->next);
+	    RELOCATE(n->to);
+	    RELOCATE(n->down);
+	    RELOCATE(n->sib);
+	}
+    }
+    gen->nodehash.head_node = (node_t *)header.head_node;
+    RELOCATE(gen->nodehash.head_node);
+    gen->nodehash.nentries = header.nentries;
+    gen->spill_length = 0;
+}
+
+size_t spill_report(size_t *bytes)
+/* how many masters were spilled, and how many bytes that took */
+{
+    if (bytes)
+	*bytes = spilled_bytes;
+    return spilled_masters;
+}
+
+void spill_free(void)
+/* close the spill file */
+{
+    if (spill_fd != -1) {
+	close(spill_fd);
+	spill_fd = -1;
+    }
+}
+
+/* end */
@@ -0,0 +1,299 @@
+/*
+ * Per-phase resource statistics, dumped as JSON by --stats-json.
+ *
+ * Top-level phases are bracketed by stats_begin()/stats_end() and get
+ * wall-clock time, process CPU time, peak RSS and allocation counts.
+ * Phases that are interleaved with others (parsing and digestion of
+ * each master, revdir packing of each commit) are timed piecewise with
+ * stats_clock()/stats_lap() and report the busy time summed over all
+ * threads.  Worker threads call stats_thread_done() as they exit to
+ * record their own CPU time against the phase they worked in.
+ *
+ * Everything here is a no-op unless collect_stats is set, and that is
+ * set before any threads start.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "cvs.h"
+
+bool collect_stats;
+
+typedef struct _phase_stats {
+    bool		timed;		/* saw begin and end */
+    struct timespec	start;
+    struct rusage	rusage;		/* at start, then at end */
+    double		wall, user, system;
+    long		maxrss;
+    size_t		allocations, allocated;
+    uint64_t		busy;		/* nanoseconds, nested phases */
+    double		*thread_cpu;
+    size_t		nthreads, maxthreads;
+} phase_stats_t;
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_ANALYSIS] = "analysis",
+    [PHASE_PARSE] = "parse",
+    [PHASE_DIGEST] = "digest",
+    [PHASE_COLLATION] = "collation",
+    [PHASE_REVDIR] = "revdir-pack",
+    [PHASE_TAGS] = "tag-placement",
+    [PHASE_SNAPSHOTS] = "snapshots",
+    [PHASE_EMISSION] = "emission",
+};
+
+static phase_stats_t phases[PHASE_COUNT];
+
+/*
+ * Allocation counts are keyed by the legend pointer passed to xmalloc()
+ * and friends.  Legends are nearly always string literals or __func__,
+ * so there are only a few hundred distinct ones; slots are claimed by
+ * compare-and-swap so the table needs no lock.
+ */
+#define ALLOC_SLOTS	2048
+
+typedef struct _alloc_slot {
+    const char	*legend;
+    size_t	count, bytes;
+} alloc_slot_t;
+
+static alloc_slot_t alloc_slots[ALLOC_SLOTS];
+static size_t alloc_count, alloc_bytes, alloc_lost;
+
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double timespec_seconds(const struct timespec *ts)
+{
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void stats_begin(const phase_t phase)
+/* start timing a top-level phase */
+{
+    phase_stats_t *ps = &phases[phase];
+
+    if (!collect_stats)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &ps->start);
+    getrusage(RUSAGE_SELF, &ps->rusage);
+    ps->allocations = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    ps->allocated = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+#ifdef THREADS
+    if (threads > 1 && ps->thread_cpu == NULL) {
+	ps->maxthreads = threads;
+	ps->thread_cpu = xcalloc(threads, sizeof(double), __func__);
+    }
+#endif /* THREADS */
+}
+
+void stats_end(const phase_t phase)
+/* finish timing a top-level phase */
+{
+    phase_stats_t *ps = &phases[phase];
+    struct timespec now;
+    struct rusage ru;
+
+    if (!collect_stats)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &ru);
+    ps->timed = true;
+    ps->wall = timespec_seconds(&now) - timespec_seconds(&ps->start);
+    ps->user = seconds(&ru.ru_utime) - seconds(&ps->rusage.ru_utime);
+    ps->system = seconds(&ru.ru_stime) - seconds(&ps->rusage.ru_stime);
+    ps->maxrss = ru.ru_maxrss;
+    ps->allocations = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED)
+		      - ps->allocations;
+    ps->allocated = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED)
+		    - ps->allocated;
+}
+
+void stats_clock(struct timespec *start)
+/* note the start of a piece of a nested phase */
+{
+    if (collect_stats)
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void stats_lap(const phase_t phase, struct timespec *start)
+/* charge the time since *start to a nested phase and restart the clock */
+{
+    struct timespec now;
+    int64_t ns;
+
+    if (!collect_stats)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - start->tv_sec) * (int64_t)1000000000
+	 + (now.tv_nsec - start->tv_nsec);
+    __atomic_add_fetch(&phases[phase].busy, ns, __ATOMIC_RELAXED);
+    *start = now;
+}
+
+void stats_thread_done(const phase_t phase)
+/* record the CPU time of the calling worker thread */
+{
+    phase_stats_t *ps = &phases[phase];
+    struct timespec cpu;
+    size_t slot;
+
+    if (!collect_stats || ps->thread_cpu == NULL)
+	return;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) != 0)
+	return;
+    slot = __atomic_fetch_add(&ps->nthreads, 1, __ATOMIC_RELAXED);
+    if (slot < ps->maxthreads)
+	ps->thread_cpu[slot] = timespec_seconds(&cpu);
+}
+
+void stats_alloc(const char *legend, const size_t size)
+/* count an allocation against its legend */
+{
+    size_t i, h = ((uintptr_t)legend >> 3) % ALLOC_SLOTS;
+
+    if (legend == NULL)
+	legend = "(none)";
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    for (i = 0; i < ALLOC_SLOTS; i++) {
+	alloc_slot_t *slot = &alloc_slots[(h + i) % ALLOC_SLOTS];
+	const char *seen = __atomic_load_n(&slot->legend, __ATOMIC_ACQUIRE);
+
+	if (seen == NULL
+	    && __atomic_compare_exchange_n(&slot->legend, &seen, legend, false,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    seen = legend;
+	if (seen == legend) {
+	    __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+	    __atomic_add_fetch(&slot->bytes, size, __ATOMIC_RELAXED);
+	    return;
+	}
+    }
+    __atomic_add_fetch(&alloc_lost, 1, __ATOMIC_RELAXED);
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+	unsigned char c = *s;
+	if (c == '"' || c == '\\')
+	    fprintf(fp, "\\%c", c);
+	else if (c < 0x20)
+	    fprintf(fp, "\\u%04x", c);
+	else
+	    fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static int slot_compare(const void *a, const void *b)
+/* order allocation slots by legend text, empty slots last */
+{
+    const alloc_slot_t *sa = a, *sb = b;
+
+    if (sa->legend == NULL || sb->legend == NULL)
+	return (sa->legend == NULL) - (sb->legend == NULL);
+    return strcmp(sa->legend, sb->legend);
+}
+
+void stats_write(const char *path,
+		 const forest_t *forest, const export_stats_t *export_stats)
+/* dump everything gathered as a JSON object */
+{
+    FILE *fp;
+    size_t strings, numbers, collisions, i, j;
+    const char *sep;
+
+    if ((fp = fopen(path, "w")) == NULL)
+	fatal_system_error("cannot open statistics file %s", path);
+
+    fprintf(fp, "{\n  \"version\": ");
+    json_string(fp, VERSION);
+#ifdef THREADS
+    fprintf(fp, ",\n  \"threads\": %d", threads > 1 ? threads : 1);
+#else
+    fprintf(fp, ",\n  \"threads\": 1");
+#endif /* THREADS */
+
+    fprintf(fp, ",\n  \"phases\": [");
+    for (i = 0; i < PHASE_COUNT; i++) {
+	phase_stats_t *ps = &phases[i];
+
+	fprintf(fp, "%s\n    {\"name\": \"%s\"", i ? "," : "", phase_names[i]);
+	if (ps->timed)
+	    fprintf(fp, ", \"wall_seconds\": %.6f, \"user_seconds\": %.6f, "
+		    "\"system_seconds\": %.6f, \"maxrss_kb\": %ld, "
+		    "\"allocations\": %zu, \"allocated_bytes\": %zu",
+		    ps->wall, ps->user, ps->system, ps->maxrss,
+		    ps->allocations, ps->allocated);
+	if (ps->busy > 0)
+	    fprintf(fp, ", \"busy_seconds\": %.6f", ps->busy / 1e9);
+	if (ps->nthreads > 0) {
+	    size_t n = ps->nthreads < ps->maxthreads ? ps->nthreads : ps->maxthreads;
+	    fprintf(fp, ", \"thread_cpu_seconds\": [");
+	    for (j = 0; j < n; j++)
+		fprintf(fp, "%s%.6f", j ? ", " : "", ps->thread_cpu[j]);
+	    fprintf(fp, "]");
+	}
+	fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]");
+
+    atom_stats(&strings, &numbers, &collisions);
+    fprintf(fp, ",\n  \"counts\": {\n"
+	    "    \"masters\": %d,\n"
+	    "    \"revisions\": %u,\n"
+	    "    \"text_bytes\": %.0f,\n"
+	    "    \"commits\": %ld,\n"
+	    "    \"blobs\": %ld,\n"
+	    "    \"duplicate_blobs\": %ld,\n"
+	    "    \"snapshot_bytes\": %.0f,\n"
+	    "    \"tags\": %zu,\n"
+	    "    \"string_atoms\": %zu,\n"
+	    "    \"number_atoms\": %zu,\n"
+	    "    \"atom_hash_collisions\": %zu,\n"
+	    "    \"warnings\": %u,\n"
+	    "    \"errors\": %d\n  }",
+	    forest->filecount, forest->total_revisions,
+	    (double)forest->textsize,
+	    export_stats->export_total_commits,
+	    export_stats->export_total_blobs,
+	    export_stats->export_duplicate_blobs,
+	    export_stats->snapsize,
+	    tag_count, strings, numbers, collisions,
+	    warncount, forest->errcount);
+
+    /* merge slots whose legends are equal strings at different addresses */
+    qsort(alloc_slots, ALLOC_SLOTS, sizeof(alloc_slot_t), slot_compare);
+    fprintf(fp, ",\n  \"allocations\": {\n    \"total\": {\"count\": %zu, "
+	    "\"bytes\": %zu, \"untracked\": %zu},\n    \"by_legend\": {",
+	    alloc_count, alloc_bytes, alloc_lost);
+    sep = "";
+    for (i = 0; i < ALLOC_SLOTS && alloc_slots[i].legend; i = j) {
+	size_t count = 0, bytes = 0;
+
+	for (j = i; j < ALLOC_SLOTS && alloc_slots[j].legend
+		 && strcmp(alloc_slots[j].legend, alloc_slots[i].legend) == 0; j++) {
+	    count += alloc_slots[j].count;
+	    bytes += alloc_slots[j].bytes;
+	}
+	fprintf(fp, "%s\n      ", sep);
+	json_string(fp, alloc_slots[i].legend);
+	fprintf(fp, ": {\"count\": %zu, \"bytes\": %zu}", count, bytes);
+	sep = ",";
+    }
+    fprintf(fp, "\n    }\n  }\n}\n");
+
+    if (fclose(fp) != 0)
+	fatal_system_error("error writing statistics file %s", path);
+}
+
+/* end */
@@ -14,54 +14,111 @@
  * the tag table should *not* be local to any one master.  
  */
 
-static tag_t *table[4096];
+/*
+ * The tag table is split into shards, each with its own lock and its
+ * own chained hash table that doubles as it fills, so threads digesting
+ * different masters rarely wait on each other.  Each shard keeps its
+ * own list of the tags created in it; sort_tags() merges these into
+ * all_tags once analysis is done.
+ */
+#define TAG_SHARDS	64	/* power of 2 */
 
-tag_t  *all_tags;
-size_t tag_count = 0;
+typedef struct _tag_shard {
+#ifdef THREADS
+    pthread_mutex_t	mutex;
+#endif /* THREADS */
+    tag_t		**table;
+    size_t		size, count;
+    tag_t		*tags;
+} tag_shard_t;
 
+static tag_shard_t shards[TAG_SHARDS] = {
 #ifdef THREADS
-static pthread_mutex_t tag_mutex = PTHREAD_MUTEX_INITIALIZER;
+    [0 ... TAG_SHARDS - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER },
 #endif /* THREADS */
+};
+
+tag_t  *all_tags;
+size_t tag_count = 0;
 
-static int tag_hash(const char *name)
+static uint64_t tag_hash(const char *name)
 /* return the hash code for a specified tag */ 
 {
-    uintptr_t l = (uintptr_t)name;
-    int res = 0;
-    while (l) {
-	res ^= l;
-	l >>= 12;
+    /* names are atoms, so the pointer will do, once its bits are mixed */
+    uint64_t l = (uintptr_t)name;
+    l ^= l >> 33;
+    l *= 0xff51afd7ed558ccdULL;
+    l ^= l >> 33;
+    return l;
+}
+
+static void grow_shard(tag_shard_t *shard)
+/* double the buckets of a shard's hash table */
+{
+    size_t	oldsize = shard->size, i;
+    tag_t	**old = shard->table;
+
+    shard->size = oldsize ? oldsize * 2 : 64;
+    shard->table = xcalloc(shard->size, sizeof(tag_t *), "tag table");
+    for (i = 0; i < oldsize; i++) {
+	tag_t *tag, *next;
+	for (tag = old[i]; tag; tag = next) {
+	    size_t bucket = (tag_hash(tag->name) / TAG_SHARDS) & (shard->size - 1);
+	    next = tag->hash_next;
+	    tag->hash_next = shard->table[bucket];
+	    shard->table[bucket] = tag;
+	}
     }
-    return res & 4095;
+    free(old);
 }
 
-static tag_t *find_tag(const char *name)
-/* look up a tag by name */
+static tag_t *find_tag(tag_shard_t *shard, const uint64_t hash, const char *name)
+/* look up a tag by name in its shard, creating it if need be */
 {
-    int hash = tag_hash(name);
+    size_t bucket;
     tag_t *tag;
-    for (tag = table[hash]; tag; tag = tag->hash_next)
-	if (tag->name == name)
-	    return tag;
+
+    if (shard->size) {
+	bucket = (hash / TAG_SHARDS) & (shard->size - 1);
+	for (tag = shard->table[bucket]; tag; tag = tag->hash_next)
+	    if (tag->name == name)
+		return tag;
+    }
+    if (shard->count >= shard->size)
+	grow_shard(shard);
+    bucket = (hash / TAG_SHARDS) & (shard->size - 1);
     tag = xcalloc(1, sizeof(tag_t), "tag lookup");
     tag->name = name;
-    tag->hash_next = table[hash];
-    table[hash] = tag;
-    tag->next = all_tags;
-    all_tags = tag;
-    tag_count++;
+    tag->hash_next = shard->table[bucket];
+    shard->table[bucket] = tag;
+    tag->next = shard->tags;
+    shard->tags = tag;
+    shard->count++;
     return tag;
 }
 
 void tag_commit(cvs_commit *c, const char *name, cvs_file *cvsfile)
 /* add a CVS commit to the list associated with a named tag */
 {
+    uint64_t hash = tag_hash(name);
+    tag_shard_t *shard = &shards[hash & (TAG_SHARDS - 1)];
     tag_t *tag;
 #ifdef THREADS
     if (threads > 1)
-	pthread_mutex_lock(&tag_mutex);
+	pthread_mutex_lock(&shard->mutex);
 #endif /* THREADS */
-    tag = find_tag(name);
+    tag = find_tag(shard, hash, name);
+    /*
+     * Masters may be digested in any order when threaded; remember the
+     * earliest (master, symbol) position at which the tag occurs so
+     * sort_tags() can restore the order a sequential run would give.
+     */
+    cvsfile->ntags++;
+    if (tag->first_master == NULL || c->master < tag->first_master
+	|| (c->master == tag->first_master && cvsfile->ntags < tag->first_order)) {
+	tag->first_master = c->master;
+	tag->first_order = cvsfile->ntags;
+    }
     if (tag->last == cvsfile->gen.master_name) {
 	announce("duplicate tag %s in CVS master %s, ignoring\n",
 		 name, cvsfile->gen.master_name);
@@ -78,10 +135,21 @@ void tag_commit(cvs_commit *c, const char *name, cvs_file *cvsfile)
     }
 #ifdef THREADS
     if (threads > 1)
-	pthread_mutex_unlock(&tag_mutex);
+	pthread_mutex_unlock(&shard->mutex);
 #endif /* THREADS */
 }
 
+static int tagged_compare(const void *a, const void *b)
+/* order commits by descending position of their master */
+{
+    const cvs_commit *ca = *(const cvs_commit **)a;
+    const cvs_commit *cb = *(const cvs_commit **)b;
+
+    if (ca->master != cb->master)
+	return (ca->master < cb->master) ? 1 : -1;
+    return 0;
+}
+
 cvs_commit **tagged(tag_t *tag)
 /* return an allocated list of pointers to commits with the specified tag */
 {
@@ -98,15 +166,64 @@ cvs_commit **tagged(tag_t *tag)
 
 	for (c = c->next, p += n; c; c = c->next, p += Ncommits)
 	    memcpy(p, c->v, Ncommits * sizeof(*p));
+
+	/* newest master first, as a sequential analysis leaves them */
+	qsort(v, tag->count, sizeof(*v), tagged_compare);
     }
     return v;
 }
 
+static int tag_compare(const void *a, const void *b)
+/* order tags latest-created first, as find_tag() pushes them */
+{
+    const tag_t *ta = *(const tag_t **)a;
+    const tag_t *tb = *(const tag_t **)b;
+
+    if (ta->first_master != tb->first_master)
+	return (ta->first_master < tb->first_master) ? 1 : -1;
+    if (ta->first_order != tb->first_order)
+	return (ta->first_order < tb->first_order) ? 1 : -1;
+    return 0;
+}
+
+void sort_tags(void)
+/* merge the shards into the tag list, in the order a sequential analysis gives */
+{
+    tag_t **v, *tag;
+    size_t i = 0, s;
+
+    all_tags = NULL;
+    tag_count = 0;
+    for (s = 0; s < TAG_SHARDS; s++)
+	tag_count += shards[s].count;
+    if (tag_count == 0)
+	return;
+    v = xmalloc(tag_count * sizeof(tag_t *), __func__);
+    for (s = 0; s < TAG_SHARDS; s++)
+	for (tag = shards[s].tags; tag; tag = tag->next)
+	    v[i++] = tag;
+    qsort(v, tag_count, sizeof(tag_t *), tag_compare);
+    for (i = 0; i < tag_count - 1; i++)
+	v[i]->next = v[i + 1];
+    v[tag_count - 1]->next = NULL;
+    all_tags = v[0];
+    free(v);
+}
+
 void discard_tags(void)
 /* discard all tag storage */
 {
     tag_t *tag = all_tags;
+    size_t s;
+
     all_tags = NULL;
+    tag_count = 0;
+    for (s = 0; s < TAG_SHARDS; s++) {
+	free(shards[s].table);
+	shards[s].table = NULL;
+	shards[s].size = shards[s].count = 0;
+	shards[s].tags = NULL;
+    }
     while (tag) {
 	tag_t *p = tag->next;
 	chunk_t *c = tag->commits;
@@ -0,0 +1,150 @@
+/*
+ * Rebuild a fast-import stream from the library interface's callbacks.
+ *
+ * Takes a master list on stdin like cvs-fast-export, and the few of its
+ * options the regression tests use, and writes what the command would
+ * have, so that l_regress can diff it against the command's checkfiles.
+ * The order must be given as -C or -F.  Incremental (-i) output is not
+ * reproduced: the command puts its "from" lines ahead of the commit's
+ * blobs, and the sink sees them only with the commit.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "cvs-fast-export.h"
+
+/*
+ * The command writes its sourcetype line as emission starts: ahead of
+ * everything in canonical order, but after all the blobs in fast order.
+ */
+static bool sourcetype_due;
+
+static void sourcetype(void)
+{
+    if (sourcetype_due) {
+	printf("#reposurgeon sourcetype cvs\n");
+	sourcetype_due = false;
+    }
+}
+
+static void blob(void *context, const cfe_blob_t *b)
+{
+    printf("blob\nmark :%u\ndata %zu\n", b->mark, b->prefixlen + b->len);
+    if (b->prefix != NULL)
+	fwrite(b->prefix, 1, b->prefixlen, stdout);
+    fwrite(b->data, 1, b->len, stdout);
+    fputc('\n', stdout);
+}
+
+static const char *timestamp(const time_t date, const char *tz)
+/* as export.c's utc_offset_timestamp() formats a commit date */
+{
+    static char out[64];
+
+    setenv("TZ", tz, 1);
+    tzset();
+    strftime(out, sizeof(out), "%s %z", localtime(&date));
+    setenv("TZ", "UTC", 1);
+    tzset();
+    return out;
+}
+
+static void commit(void *context, const cfe_commit_t *c)
+{
+    size_t i;
+
+    sourcetype();
+    printf("commit %s\nmark :%u\n", c->ref, c->mark);
+    printf("committer %s <%s> %s\n",
+	   c->committer, c->email, timestamp(c->date, c->timezone));
+    printf("data %zu\n%s\n", strlen(c->log), c->log);
+    if (c->parent != 0)
+	printf("from :%u\n", c->parent);
+    for (i = 0; i < c->nfileops; i++) {
+	const cfe_fileop_t *op = &c->fileops[i];
+
+	if (op->op == 'D')
+	    printf("D %s\n", op->path);
+	else if (op->inline_data != NULL) {
+	    printf("M 100%o inline %s\ndata %zu\n", op->mode, op->path, op->inline_len);
+	    fwrite(op->inline_data, 1, op->inline_len, stdout);
+	    fputc('\n', stdout);
+	} else
+	    printf("M 100%o :%u %s\n", op->mode, op->mark, op->path);
+    }
+    if (c->revisions != NULL && c->revisions[0] != '\0')
+	printf("property cvs-revisions %zu %s", strlen(c->revisions), c->revisions);
+    fputc('\n', stdout);
+}
+
+static void reset(void *context, const char *ref, const cfe_mark_t mark)
+{
+    printf("reset %s\nfrom :%u\n\n", ref, mark);
+}
+
+static void tag(void *context, const char *name, const cfe_mark_t mark)
+{
+    printf("reset refs/tags/%s\nfrom :%u\n\n", name, mark);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+	{ "expand",		1, 0, 'k' },
+	{ "authormap",		1, 0, 'A' },
+	{ "reposurgeon",	0, 0, 'r' },
+	{ "threads",		1, 0, 't' },
+	{ "canonical",		0, 0, 'C' },
+	{ "fast",		0, 0, 'F' },
+	{ NULL,			0, 0, '\0' },
+    };
+    cfe_sink_t sink = {NULL, blob, commit, reset, tag};
+    cfe_options_t opts;
+    char line[BUFSIZ], **masters = NULL;
+    size_t nmasters = 0, alloc = 0;
+    int c, errors;
+
+    cfe_options_init(&opts);
+    while ((c = getopt_long(argc, argv, "k:A:rTt:CF", options, NULL)) != -1) {
+	switch (c) {
+	case 'k': opts.expand = optarg; break;
+	case 'A': opts.authormap = optarg; break;
+	case 'r': opts.revisions = true; break;
+	case 'T': opts.force_dates = true; break;
+	case 't': opts.threads = atoi(optarg); break;
+	case 'C': opts.order = cfe_canonical; break;
+	case 'F': opts.order = cfe_fast; break;
+	default:
+	    fprintf(stderr, "usage: cfe-stream [-k MODE] [-A MAP] [-r] [-T] [-t N] [-C|-F]\n");
+	    return 1;
+	}
+    }
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+	line[strcspn(line, "\n")] = '\0';
+	if (nmasters >= alloc) {
+	    alloc = alloc ? alloc * 2 : 64;
+	    if ((masters = realloc(masters, alloc * sizeof(char *))) == NULL)
+		return 1;
+	}
+	if ((masters[nmasters] = malloc(strlen(line) + 1)) == NULL)
+	    return 1;
+	strcpy(masters[nmasters++], line);
+    }
+
+    sourcetype_due = opts.revisions;
+    if (opts.order != cfe_fast)
+	sourcetype();
+    errors = cfe_convert(&opts, (const char *const *)masters, nmasters, &sink);
+    if (!opts.revisions)
+	printf("done\n");
+    return errors > 0;
+}
+
+/* end */
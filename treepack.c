@@ -3,7 +3,6 @@
  * Designed to be included in revdir.c.
  */
 
-#define REV_DIR_HASH	786433
 /* Names are getting confusing. Externally we call things a revdir, where really it's
  * just a list of revisions.
  * Internally in treepack, we store as a directory of revisions, which each level having 
@@ -15,16 +14,10 @@ struct _rev_pack {
     serial_t   ndirs;
     serial_t   nfiles;
     rev_pack   **dirs;
-    cvs_commit **files;
+    pack_file_t *files;
+    const master_dir *directory;	/* the one whose contents these are */
 };
 
-typedef struct _rev_pack_hash {
-    struct _rev_pack_hash *next;
-    rev_pack	          dir;
-} rev_pack_hash;
-
-static rev_pack_hash	*buckets[REV_DIR_HASH];
-
 typedef struct _pack_frame {
     const master_dir    *dir;
     const rev_pack      **dirs;
@@ -33,40 +26,63 @@ typedef struct _pack_frame {
     unsigned short      sdirs;
 } pack_frame;
 
-/* variables used by streaming pack interface */
-static serial_t         sfiles = 0;
-static serial_t         nfiles = 0;
-static const cvs_commit **files = NULL;
-static pack_frame       *frame;
-static pack_frame       frames[MAX_DIR_DEPTH];
+/*
+ * Variables used by streaming pack interface.  These are per thread,
+ * so branches can be collated in parallel; the table of packed
+ * directories they feed is shared.
+ */
+static THREAD_LOCAL serial_t         sfiles = 0;
+static THREAD_LOCAL serial_t         nfiles = 0;
+static THREAD_LOCAL pack_file_t      *files = NULL;
+static THREAD_LOCAL pack_frame       *frame;
+static THREAD_LOCAL pack_frame       frames[MAX_DIR_DEPTH];
+
+static hash_t
+pack_entry_hash(const void *entry)
+{
+    return ((const rev_pack *)entry)->hash;
+}
+
+static bool
+pack_entry_match(const void *entry, const void *key)
+/* is entry the directory being packed in the frame key? */
+{
+    const rev_pack *dir = entry;
+    const pack_frame *f = key;
+
+    return dir->nfiles == nfiles && dir->ndirs == f->ndirs &&
+	!memcmp(f->dirs, dir->dirs, f->ndirs * sizeof(rev_pack *)) &&
+	!memcmp(files, dir->files, nfiles * sizeof(pack_file_t));
+}
+
+static void
+pack_entry_free(void *entry)
+{
+    rev_pack *dir = entry;
+
+    free(dir->dirs);
+    free(dir->files);
+    free(dir);
+}
 
 static const rev_pack *
 rev_pack_dir(void)
 {
-    rev_pack_hash **bucket = &buckets[frame->hash % REV_DIR_HASH];
-    rev_pack_hash *h;
+    rev_pack *dir;
 
     /* avoid packing a file list if we've done it before */ 
-    for (h = *bucket; h; h = h->next) {
-	if (h->dir.hash == frame->hash &&
-	    h->dir.nfiles == nfiles && h->dir.ndirs == frame->ndirs &&
-	    !memcmp(frame->dirs, h->dir.dirs, frame->ndirs * sizeof(rev_pack *)) &&
-	    !memcmp(files, h->dir.files, nfiles * sizeof(cvs_commit *)))
-	{
-	    return &h->dir;
-	}
-    }
-    h = xmalloc(sizeof(rev_pack_hash), __func__);
-    h->next = *bucket;
-    *bucket = h;
-    h->dir.hash = frame->hash;
-    h->dir.ndirs = frame->ndirs;
-    h->dir.dirs = xmalloc(frame->ndirs * sizeof(rev_pack *), __func__);
-    memcpy(h->dir.dirs, frame->dirs, frame->ndirs * sizeof(rev_pack *));
-    h->dir.nfiles = nfiles;
-    h->dir.files = xmalloc(nfiles * sizeof(cvs_commit *), __func__);
-    memcpy(h->dir.files, files, nfiles * sizeof(cvs_commit *));
-    return &h->dir;
+    if ((dir = pack_find(frame->hash, frame)) != NULL)
+	return dir;
+    dir = xmalloc(sizeof(rev_pack), __func__);
+    dir->hash = frame->hash;
+    dir->directory = frame->dir;
+    dir->ndirs = frame->ndirs;
+    dir->dirs = xmalloc(frame->ndirs * sizeof(rev_pack *), __func__);
+    memcpy(dir->dirs, frame->dirs, frame->ndirs * sizeof(rev_pack *));
+    dir->nfiles = nfiles;
+    dir->files = xmalloc(nfiles * sizeof(pack_file_t), __func__);
+    memcpy(dir->files, files, nfiles * sizeof(pack_file_t));
+    return pack_insert(frame->hash, frame, dir);
 }
 
 /* Post order tree traversal iterator. */
@@ -77,8 +93,8 @@ typedef struct _dir_pos {
 } dir_pos;
 
 struct _revdir_iter {
-    cvs_commit     **file;
-    cvs_commit     **filemax;
+    const pack_file_t *file;
+    const pack_file_t *filemax;
     size_t         dirpos; // current dir is dirstack[dirpos]
     dir_pos        dirstack[MAX_DIR_DEPTH];
 };
@@ -93,8 +109,10 @@ revdir_iter_same_dir(const revdir_iter *it1, const revdir_iter *it2)
 cvs_commit *
 revdir_iter_next(revdir_iter *it) {
     while (1) {
-	if (it->file != it->filemax)
-	    return *it->file++;
+	if (it->file != it->filemax) {
+	    it->file++;
+	    return UNPACK_FILE(it->file[-1]);
+	}
 	// end of stack
 	if (!it->dirpos)
 	    return NULL;
@@ -153,8 +171,10 @@ revdir_iter_next_dir(revdir_iter *it)
 	    it->file = dir->files;
 	    it->filemax = dir->files + dir->nfiles;
 	}
-	if (it->file != it->filemax)
-	    return *it->file++;
+	if (it->file != it->filemax) {
+	    it->file++;
+	    return UNPACK_FILE(it->file[-1]);
+	}
     }
 }
 
@@ -186,6 +206,91 @@ revdir_iter_alloc(const revdir *revdir)
     return it;
 }
 
+static void
+diff_all(const rev_pack *pack, const bool deleted,
+	 revdir_diff_fn *fn, void *arg)
+/* report every file in a directory tree as deleted or added */
+{
+    serial_t i;
+
+    for (i = 0; i < pack->ndirs; i++)
+	diff_all(pack->dirs[i], deleted, fn, arg);
+    for (i = 0; i < pack->nfiles; i++)
+	if (deleted)
+	    fn(UNPACK_FILE(pack->files[i]), NULL, arg);
+	else
+	    fn(NULL, UNPACK_FILE(pack->files[i]), arg);
+}
+
+static const rev_master *
+first_master(const rev_pack *pack)
+/* the master of the first file in a (never empty) subdirectory */
+{
+    while (pack->ndirs > 0)
+	pack = pack->dirs[0];
+    return UNPACK_FILE(pack->files[0])->master;
+}
+
+static void
+diff_pack(const rev_pack *old, const rev_pack *new,
+	  revdir_diff_fn *fn, void *arg)
+/* report the files that differ between two packings of a directory */
+{
+    serial_t i = 0, j = 0;
+
+    /* whole subtrees are shared between revdirs wherever nothing changed */
+    if (old == new)
+	return;
+
+    /* subdirectories, matched up by the directory they pack */
+    while (i < old->ndirs && j < new->ndirs) {
+	const rev_pack *o = old->dirs[i], *n = new->dirs[j];
+
+	if (o->directory == n->directory) {
+	    diff_pack(o, n, fn, arg);
+	    i++, j++;
+	} else if (first_master(o) < first_master(n))
+	    /* masters, and so directories, are sorted in fileop order */
+	    diff_all(old->dirs[i++], true, fn, arg);
+	else
+	    diff_all(new->dirs[j++], false, fn, arg);
+    }
+    for (; i < old->ndirs; i++)
+	diff_all(old->dirs[i], true, fn, arg);
+    for (; j < new->ndirs; j++)
+	diff_all(new->dirs[j], false, fn, arg);
+
+    /* then the files in the directory itself, which come after them */
+    for (i = j = 0; i < old->nfiles || j < new->nfiles;) {
+	cvs_commit *o = i < old->nfiles ? UNPACK_FILE(old->files[i]) : NULL;
+	cvs_commit *n = j < new->nfiles ? UNPACK_FILE(new->files[j]) : NULL;
+
+	if (o == n) {
+	    i++, j++;
+	} else if (o && n && o->master == n->master) {
+	    fn(o, n, arg);
+	    i++, j++;
+	} else if (o && (!n || o->master < n->master)) {
+	    fn(o, NULL, arg);
+	    i++;
+	} else {
+	    fn(NULL, n, arg);
+	    j++;
+	}
+    }
+}
+
+void
+revdir_diff(const revdir *old, const revdir *new,
+	    revdir_diff_fn *fn, void *arg)
+/* report the files that differ between two revdirs, in path order */
+{
+    if (old == NULL)
+	diff_all(new->revpack, false, fn, arg);
+    else
+	diff_pack(old->revpack, new->revpack, fn, arg);
+}
+
 static const master_dir *
 first_subdir (const master_dir *child, const master_dir *ancestor)
 /* in ancestor/d1/d2/child, return d1 */
@@ -199,10 +304,10 @@ void
 revdir_pack_alloc(const size_t max_size)
 {
     if (!files) {
-	files = xmalloc(max_size * sizeof(cvs_commit *), __func__);
+	files = xmalloc(max_size * sizeof(pack_file_t), __func__);
 	sfiles = max_size;
     } else if (sfiles < max_size) {
-	files = xrealloc(files, max_size * sizeof(cvs_commit *), __func__);
+	files = xrealloc(files, max_size * sizeof(pack_file_t), __func__);
 	sfiles = max_size;
     }
 }
@@ -240,12 +345,10 @@ revdir_pack_add(const cvs_commit *file, const master_dir *dir)
 	    /* If you are using TREEPACK then this is the hottest inner
 	     * loop in the application. Avoid dereferencing file
              */
-	    files[nfiles++] = file;
-	    /* Proper FNV1a is a byte at a time, but this is effective
-	     * with the amount of data we're typically mixing into the hash
-             * and very lightweight
-	     */
- 	    frame->hash = (frame->hash ^ (uintptr_t)file) * 16777619U;
+	    const pack_file_t packed = PACK_FILE(file);
+
+	    files[nfiles++] = packed;
+	    HASH_MIX_WORD(frame->hash, packed);
 	    return;
 	}
 	if (dir_is_ancestor(dir, frame->dir)) {
@@ -262,7 +365,8 @@ revdir_pack_add(const cvs_commit *file, const master_dir *dir)
 	const rev_pack * const r = rev_pack_dir();
 	nfiles = 0;
 	frame--;
-	frame->hash = HASH_COMBINE(frame->hash, r->hash);
+	/* packed directories are unique, so the pointer is the key */
+	HASH_MIX_WORD(frame->hash, r);
 	push_rev_pack(r);
     }
 }
@@ -278,7 +382,8 @@ revdir_pack_end(revdir *revdir)
 	
 	nfiles = 0;
 	frame--;
-	frame->hash = HASH_COMBINE(frame->hash, r->hash);
+	/* packed directories are unique, so the pointer is the key */
+	HASH_MIX_WORD(frame->hash, r);
 	push_rev_pack(r);
     }
     revdir->revpack = r;
@@ -343,23 +448,6 @@ revdir_pack_files(const cvs_commit **files, const size_t nfiles, revdir *revdir)
     revdir_pack_free();
 }
 
-void
-revdir_free(void)
-{
-    size_t i;
-    for (i = 0; i < REV_DIR_HASH; i++) {
-	rev_pack_hash **bucket = &buckets[i];
-	rev_pack_hash *h;
-
-	while ((h = *bucket)) {
-	    *bucket = h->next;
-	    free(h->dir.dirs);
-	    free(h->dir.files);
-	    free(h);
-	}
-    }
-}
-
 void
 revdir_free_bufs(void)
 {
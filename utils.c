@@ -17,6 +17,7 @@ int clock_gettime(clockid_t clock_id, struct timespec *tp)
 
 bool nowarn;
 unsigned int warncount;
+THREAD_LOCAL FILE *log_capture;
 
 
 #if _POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600
@@ -29,6 +30,8 @@ void* xmemalign(size_t align, size_t size, char const *legend)
     if (err)
 	fatal_error("posix_memalign(%zd, %zd) failed in %s: %s",
 			   align, size, legend, strerror(err));
+    if (collect_stats)
+	stats_alloc(legend, size);
     return ret;
 }
 #endif
@@ -43,6 +46,8 @@ void* xmalloc(size_t size, char const *legend)
     if (!ret)
 	fatal_system_error("Out of memory, malloc(%zd) failed in %s",
 			   size, legend);
+    if (collect_stats)
+	stats_alloc(legend, size);
     return ret;
 }
 
@@ -52,6 +57,8 @@ void* xcalloc(size_t nmemb, size_t size, char const *legend)
     if (!ret)
 	fatal_system_error("Out of memory, calloc(%zd, %zd) failed in %s",
 			   nmemb, size, legend);
+    if (collect_stats)
+	stats_alloc(legend, nmemb * size);
     return ret;
 }
 
@@ -65,9 +72,54 @@ void* xrealloc(void *ptr, size_t size, char const *legend)
     if (!ret)
 	fatal_system_error("Out of memory, realloc(%zd) failed in %s",
 			   size, legend);
+    if (collect_stats)
+	stats_alloc(legend, size);
     return ret;
 }
 
+/*
+ * Arena blocks start small, because there is one arena per master and
+ * most masters have only a handful of revisions, and double up to a
+ * cap so that huge masters don't leave a huge tail of waste.
+ */
+#define ARENA_MIN_BLOCK	1024
+#define ARENA_MAX_BLOCK	65536
+#define ARENA_ALIGN	sizeof(void *)
+
+void* arena_alloc(arena_block_t **arena, size_t size, char const *legend)
+/* zeroed storage from a bump arena; it is freed only by arena_free() */
+{
+    arena_block_t *b = *arena;
+    void *ret;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (b == NULL || b->used + size > b->size) {
+	size_t blocksize = b ? b->size * 2 : ARENA_MIN_BLOCK;
+	if (blocksize > ARENA_MAX_BLOCK)
+	    blocksize = ARENA_MAX_BLOCK;
+	if (blocksize < size)
+	    blocksize = size;
+	b = xcalloc(1, sizeof(arena_block_t) + blocksize, legend);
+	b->size = blocksize;
+	b->next = *arena;
+	*arena = b;
+    }
+    ret = (char *)b->data + b->used;
+    b->used += size;
+    return ret;
+}
+
+void arena_free(arena_block_t **arena)
+/* release everything allocated from an arena */
+{
+    arena_block_t *b;
+
+    while ((b = *arena)) {
+	*arena = b->next;
+	free(b);
+    }
+}
+
 char *
 cvstime2rfc3339(const cvstime_t date)
 /* RFC3339 time representation (not thread-safe!) */
@@ -258,14 +310,14 @@ void warn(char const *format,...)
     if (nowarn)
 	return;
 
-    if (LOGFILE == stderr)
+    if (LOGSTREAM == stderr)
 	progress_interrupt();
-    fprintf(LOGFILE, "cvs-fast-export: ");
+    fprintf(LOGSTREAM, "cvs-fast-export: ");
     va_start(args, format);
-    vfprintf(LOGFILE, format, args);
+    vfprintf(LOGSTREAM, format, args);
     va_end(args);
 
-    warncount++;
+    __atomic_add_fetch(&warncount, 1, __ATOMIC_RELAXED);
 }
 
 void debugmsg(char const *format,...)
@@ -0,0 +1,212 @@
+/*
+ * Find masters by walking directory trees, in place of "find DIR |".
+ *
+ * walk_masters() reports what find(1) would: it descends into real
+ * directories but not into symlinks to them, and returns every other
+ * entry that can be stat()ed, with its size.  Picking out the ,v files
+ * is left to analyze_masters(), so the two ways in apply exactly the
+ * same filter.  Entries come back in no particular order, since they
+ * are sorted into path order afterwards anyway.
+ *
+ * On a network filesystem discovery is mostly round trips for readdir
+ * and stat, so with threads several directories are read at once.
+ * Directories found but not yet read sit on a shared stack; a worker
+ * finding it empty waits until either another worker pushes something
+ * or no directory is being read any more, which means the walk is done.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#ifdef THREADS
+#include <pthread.h>
+#endif /* THREADS */
+
+#include "cvs.h"
+
+typedef struct _walk_list {
+    walk_entry_t	*entries;
+    size_t		count, alloc;
+} walk_list_t;
+
+static char		**pending;	/* directories waiting to be read */
+static size_t		npending, pending_alloc;
+static size_t		busy;		/* directories being read */
+#ifdef THREADS
+static pthread_mutex_t	walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	walk_cond = PTHREAD_COND_INITIALIZER;
+#endif /* THREADS */
+
+static void walk_lock(void)
+{
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_lock(&walk_mutex);
+#endif /* THREADS */
+}
+
+static void walk_unlock(void)
+{
+#ifdef THREADS
+    if (threads > 1)
+	pthread_mutex_unlock(&walk_mutex);
+#endif /* THREADS */
+}
+
+static void walk_push(char *dir)
+/* queue a directory to be read; caller holds the lock */
+{
+    if (npending >= pending_alloc) {
+	pending_alloc = pending_alloc ? pending_alloc * 2 : 256;
+	pending = xrealloc(pending, pending_alloc * sizeof(char *), __func__);
+    }
+    pending[npending++] = dir;
+#ifdef THREADS
+    if (threads > 1)
+	pthread_cond_signal(&walk_cond);
+#endif /* THREADS */
+}
+
+static void walk_found(walk_list_t *out, char *path, const off_t size)
+{
+    if (out->count >= out->alloc) {
+	out->alloc = out->alloc ? out->alloc * 2 : 1024;
+	out->entries = xrealloc(out->entries,
+				out->alloc * sizeof(walk_entry_t), __func__);
+    }
+    out->entries[out->count].name = path;
+    out->entries[out->count].size = size;
+    out->count++;
+}
+
+static void walk_dir(const char *dir, walk_list_t *out)
+/* read one directory, queueing its subdirectories and keeping the rest */
+{
+    DIR *d;
+    struct dirent *de;
+    size_t dirlen = strlen(dir);
+    bool slash = dirlen > 0 && dir[dirlen - 1] == '/';
+
+    if ((d = opendir(dir)) == NULL) {
+	warn("%s: %s\n", dir, strerror(errno));
+	return;
+    }
+    while ((de = readdir(d)) != NULL) {
+	struct stat st;
+	size_t namelen;
+	char *path;
+	int dfd = dirfd(d);
+	bool isdir = false;
+
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	/* the entry type usually saves a stat on directories */
+	if (de->d_type == DT_DIR)
+	    isdir = true;
+	else if (fstatat(dfd, de->d_name, &st,
+			 de->d_type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0) != 0)
+	    continue;
+	else if (de->d_type == DT_UNKNOWN && S_ISDIR(st.st_mode))
+	    isdir = true;
+	else if (S_ISLNK(st.st_mode) && fstatat(dfd, de->d_name, &st, 0) != 0)
+	    continue;
+	else if (S_ISDIR(st.st_mode))
+	    continue;		/* a symlink to a directory; find won't follow it */
+
+	namelen = strlen(de->d_name);
+	path = xmalloc(dirlen + !slash + namelen + 1, __func__);
+	memcpy(path, dir, dirlen);
+	if (!slash)
+	    path[dirlen] = '/';
+	memcpy(path + dirlen + !slash, de->d_name, namelen + 1);
+	if (isdir) {
+	    walk_lock();
+	    walk_push(path);
+	    walk_unlock();
+	} else
+	    walk_found(out, path, st.st_size);
+    }
+    closedir(d);
+}
+
+static void *walker(void *arg)
+/* read directories off the stack until there are none left anywhere */
+{
+    walk_list_t *out = arg;
+
+    for (;;) {
+	char *dir;
+
+	walk_lock();
+#ifdef THREADS
+	if (threads > 1)
+	    while (npending == 0 && busy > 0)
+		pthread_cond_wait(&walk_cond, &walk_mutex);
+#endif /* THREADS */
+	if (npending == 0) {
+	    walk_unlock();
+	    return NULL;
+	}
+	dir = pending[--npending];
+	busy++;
+	walk_unlock();
+
+	walk_dir(dir, out);
+	free(dir);
+
+	walk_lock();
+#ifdef THREADS
+	/* the last reader out wakes everyone up to finish */
+	if (--busy == 0 && npending == 0 && threads > 1)
+	    pthread_cond_broadcast(&walk_cond);
+#else
+	--busy;
+#endif /* THREADS */
+	walk_unlock();
+    }
+}
+
+size_t walk_masters(const char *root, walk_entry_t **entries)
+/* list everything but directories under root; caller frees names and array */
+{
+    walk_list_t found = {NULL, 0, 0};
+    char *top = xmalloc(strlen(root) + 1, __func__);
+
+    npending = busy = 0;
+    walk_push(strcpy(top, root));
+#ifdef THREADS
+    if (threads > 1) {
+	pthread_t *workers = xcalloc(threads, sizeof(pthread_t), __func__);
+	walk_list_t *lists = xcalloc(threads, sizeof(walk_list_t), __func__);
+	int i;
+
+	for (i = 0; i < threads; i++)
+	    pthread_create(&workers[i], NULL, walker, &lists[i]);
+	for (i = 0; i < threads; i++) {
+	    pthread_join(workers[i], NULL);
+	    if (lists[i].count == 0)
+		continue;
+	    found.entries = xrealloc(found.entries,
+				     (found.count + lists[i].count) * sizeof(walk_entry_t),
+				     __func__);
+	    memcpy(found.entries + found.count, lists[i].entries,
+		   lists[i].count * sizeof(walk_entry_t));
+	    found.count += lists[i].count;
+	    free(lists[i].entries);
+	}
+	free(lists);
+	free(workers);
+    }
+    else
+#endif /* THREADS */
+	walker(&found);
+
+    free(pending);
+    pending = NULL;
+    pending_alloc = 0;
+    *entries = found.entries;
+    return found.count;
+}
+
+/* end */